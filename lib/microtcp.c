@@ -1,738 +1,4703 @@
+#define _GNU_SOURCE
 #include "../lib/microtcp.h"
+#include "microtcp_timer.h"
+#include "microtcp_uring.h"
 #include "../utils/crc32.h"
+#include "../utils/pool.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <unistd.h>
+#include <linux/errqueue.h>
 
+/*Sequence number comparisons, safe across the 32-bit wrap around*/
+#define SEQ_LT(a, b)  ((int32_t)((uint32_t)(a) - (uint32_t)(b)) < 0)
+#define SEQ_LEQ(a, b) ((int32_t)((uint32_t)(a) - (uint32_t)(b)) <= 0)
+#define SEQ_GT(a, b)  SEQ_LT(b, a)
+#define SEQ_GEQ(a, b) SEQ_LEQ(b, a)
 
+/*UDP segmentation offload limits, see UDP_MAX_SEGMENTS of the kernel*/
+#define GSO_MAX_SEGS 64
+#define GSO_MAX_BYTES 65507
+#define GRO_SLOTS (MICROTCP_RX_BATCH / 4)
+#define RX_SEGMENTS (GRO_SLOTS * GSO_MAX_SEGS)
+
+/**
+*   Outgoing segments are collected here and handed to the kernel with a single
+*   sendmmsg(). Every segment is an iovec of the header followed by the payload
+*   slices, the header is copied in the batch while the payload is referenced
+*   in place. In offload mode a message carries a whole run of equally sized
+*   segments, which the kernel splits back to datagrams (UDP_SEGMENT).
+*/
+struct microtcp_tx_batch
+{
+    struct mmsghdr msgs[MICROTCP_TX_BATCH];
+    struct iovec iov[(1 + MICROTCP_SEG_IOV) * MICROTCP_TX_BATCH];
+    microtcp_header_t headers[MICROTCP_TX_BATCH];
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(uint16_t))];
+        struct cmsghdr align;
+    } control[MICROTCP_TX_BATCH];
+    size_t run_bytes[MICROTCP_TX_BATCH];    /**< Bytes of each message */
+    size_t run_seg_len[MICROTCP_TX_BATCH];  /**< Size of the segments of a run */
+    size_t run_last_len[MICROTCP_TX_BATCH]; /**< Size of the last segment of a run */
+    unsigned int run_segs[MICROTCP_TX_BATCH];
+    unsigned int len;                       /**< Messages */
+    unsigned int segments;                  /**< Segments, one header each */
+    unsigned int iov_used;
+    int zerocopy;
+    int probe;                              /**< Message of the path MTU probe, -1 if none */
+};
+
+/**
+*   A ring of segment slots filled by a single recvmmsg(). The segments are
+*   validated in bulk right after the call, the valid ones are then consumed
+*   in order from head up to len. In offload mode the slots are large enough
+*   for the super-datagrams of UDP_GRO, which are split back to segments here.
+*/
+struct microtcp_rx_ring
+{
+    struct mmsghdr msgs[MICROTCP_RX_BATCH];
+    struct iovec iov[MICROTCP_RX_BATCH];
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control[MICROTCP_RX_BATCH];
+    microtcp_header_t headers[RX_SEGMENTS];
+    uint8_t *payloads[RX_SEGMENTS];
+    uint32_t crcs[RX_SEGMENTS];             /**< CRC-32 of the header, to go on over the payload */
+    uint8_t *slots[MICROTCP_RX_BATCH];      /**< Segment buffers, carved out of slab */
+    uint8_t *slab;
+    struct sockaddr_storage names[MICROTCP_RX_BATCH]; /**< Senders, for the demux */
+    size_t slot_len;
+    size_t want_len;                        /**< Slot length the largest datagram that did
+                                                 not fit asks for, 0 if all of them did */
+    unsigned int nslots;
+    unsigned int head;
+    unsigned int len;
+};
+
+struct microtcp_demux_slot
+{
+    uint64_t peer;                          /**< Key of the peer, see peer_key() */
+    microtcp_sock_t *conn;                  /**< NULL for an empty slot */
+};
+
+/**
+*   The connections of a listener, which all read and write its UDP socket.
+*   Whichever of them reads a datagram hands it to its owner, found by the
+*   address and port of the sender in an open addressing hash table with
+*   linear probing. Segments of other connections are copied to their stash,
+*   SYNs of new peers to the one of the listener.
+*/
+struct microtcp_demux
+{
+    struct microtcp_demux_slot *table;
+    size_t cap;                             /**< Slots, always a power of two */
+    size_t len;                             /**< Connections in the table */
+    microtcp_sock_t *listener;              /**< NULL once the listener is shut down */
+    size_t backlog;                         /**< Most SYNs the listener's stash holds, and
+                                                 connections not accepted yet */
+    struct microtcp_half_open *half_open;   /**< Connections not accepted yet, newest first */
+    size_t half_open_len;
+    size_t refs;                            /**< The listener and its connections */
+    size_t dgram_len;                       /**< Largest segment routed, header and max_mss */
+    pool_t dgram_pool;                      /**< Stashed segments */
+    uint8_t *scratch;                       /**< A datagram read while waiting on a stash */
+};
+
+struct microtcp_dgram
+{
+    struct microtcp_dgram *next;
+    struct sockaddr from;                   /**< The sender, for a SYN */
+    socklen_t from_len;
+    size_t len;
+    uint8_t data[];
+};
+
+/**
+*   The connection of a new peer, from its SYN until microtcp_accept_conn()
+*   takes it. While it is SYN_RECEIVED the SYN_ACK goes out again whenever
+*   the timer goes off, and segments that overtake the ACK of the peer wait
+*   in early for the connection.
+*/
+struct microtcp_half_open
+{
+    microtcp_sock_t conn;
+    microtcp_header_t syn_ack;              /**< In network byte order */
+    uint32_t tmp_seq;
+    uint32_t tmp_ack;
+    unsigned int tries;                     /**< SYN_ACKs sent */
+    struct microtcp_timer timer;
+    struct microtcp_dgram *early;
+    struct microtcp_dgram *early_tail;
+    size_t early_len;
+    struct microtcp_half_open *next;
+};
+
+/**
+*   The data of non-blocking sends, kept at its sequence number modulo len
+*   from snd_una up to snd_end of the socket
+*/
+struct microtcp_sndbuf
+{
+    struct iovec iov[2];                    /**< data twice over, see SNDBUF_AT() */
+    size_t len;                             /**< Always a power of two */
+    uint8_t data[];
+};
+
+/*Position of a sequence number inside the circular send buffer*/
+#define SNDBUF_AT(sndb, seq) ((uint32_t)(seq) & ((sndb)->len - 1))
+
+/*The timers of a connection, and their bits in timers_due*/
+#define TIMER_DELACK  0
+#define TIMER_RTO     1
+#define TIMER_PERSIST 2
+#define TIMER_PACING  3
+#define TIMER_CLOSE   4
+#define TIMER_COUNT   5
+
+static int recv_segment(microtcp_sock_t *socket, microtcp_header_t *header, const uint8_t **payload, int64_t timeout_us, uint32_t *crc);
+static ssize_t send_stream(microtcp_sock_t *socket, const struct iovec *iov, size_t iov_offset, size_t length, int flags);
+static int conn_drive(microtcp_sock_t *socket);
+static int conn_input(microtcp_sock_t *socket, microtcp_header_t *header, const uint8_t *payload, uint32_t crc);
+static int conn_timers(microtcp_sock_t *socket);
+static int64_t conn_next(microtcp_sock_t *socket);
+static int tx_queue(microtcp_sock_t *socket, const microtcp_header_t *header, const struct iovec *payload, size_t offset, size_t data_len, int zerocopy);
+static int send_ack(microtcp_sock_t *socket);
+static void conn_disarm(microtcp_sock_t *socket);
+static void plpmtu_too_big(microtcp_sock_t *socket);
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*Collects the MSG_ZEROCOPY completion notifications queued on the error queue of sd*/
+static int zc_reap(microtcp_sock_t *socket)
+{
+    struct sock_extended_err *serr;
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    char control[128];
+
+    for(;;)
+    {
+        memset(&msg, 0, sizeof(struct msghdr));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if(recvmsg(socket->sd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return 0;
+            }
+            perror("ERROR AT Zero-copy completion");
+            return -1;
+        }
+
+        for(cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if(!((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR)
+                || (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)))
+            {
+                continue;
+            }
+
+            serr = (struct sock_extended_err*) CMSG_DATA(cmsg);
+            if(serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+            {
+                continue;
+            }
+
+            /*Sends ee_info up to ee_data, inclusive, are done*/
+            socket->zc_completed += serr->ee_data - serr->ee_info + 1;
+            if(serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+            {
+                socket->zc_copied += serr->ee_data - serr->ee_info + 1;
+            }
+        }
+    }
+}
+
+/*Blocks until the kernel is done with every zero-copy send*/
+static int zc_wait(microtcp_sock_t *socket)
+{
+    struct pollfd pfd = { .fd = socket->sd, .events = 0 };
+
+    for(;;)
+    {
+        if(zc_reap(socket) == -1)
+        {
+            return -1;
+        }
+        if(socket->zc_completed == socket->zc_sent)
+        {
+            return 0;
+        }
+        if(poll(&pfd, 1, -1) == -1 && errno != EINTR)
+        {
+            perror("ERROR AT Zero-copy completion poll");
+            return -1;
+        }
+    }
+}
+
+/*Turns on UDP GSO/GRO for the offload mode, if the kernel supports them*/
+static void setup_offload(microtcp_sock_t *socket)
+{
+    int zero = 0, one = 1;
+
+    if(socket->offload
+        && (setsockopt(socket->sd, SOL_UDP, UDP_SEGMENT, &zero, sizeof(zero)) == -1
+            || setsockopt(socket->sd, SOL_UDP, UDP_GRO, &one, sizeof(one)) == -1))
+    {
+        perror("WARNING AT UDP offload, falling back to plain datagrams");
+        socket->offload = 0;
+    }
+}
+
+/*Moves the datagrams of a connection created with MICROTCP_SOCK_URING through
+  io_uring, if the kernel can. Connections of a listener share its socket and
+  keep the system calls*/
+static void setup_uring(microtcp_sock_t *socket)
+{
+    if(!socket->io_uring || socket->demux != NULL)
+    {
+        return;
+    }
+
+    socket->uring = uring_open(socket->sd, 2 * socket->rxr->nslots, socket->rxr->slot_len, socket->offload ? sizeof(socket->rxr->control[0].buf) : 0);
+    if(socket->uring == NULL)
+    {
+        perror("WARNING AT io_uring, falling back to system calls");
+        socket->io_uring = 0;
+    }
+}
+
+/*A timer of the connection went off, whatever call runs on it next deals with it*/
+static void conn_timer_fired(struct microtcp_timer *timer)
+{
+    microtcp_sock_t *socket = (microtcp_sock_t*) timer->arg;
+
+    socket->timers_due |= 1u << (timer - socket->timers);
+}
+
+static void free_buffers(microtcp_sock_t *socket)
+{
+    if(socket->rxr != NULL)
+    {
+        free(socket->rxr->slab);
+    }
+    free(socket->recvbuf);
+    free(socket->rxr);
+    free(socket->txb);
+    free(socket->sndq);
+    free(socket->sndb);
+    uring_close(socket->uring);
+    socket->recvbuf = NULL;
+    socket->rxr = NULL;
+    socket->txb = NULL;
+    socket->sndq = NULL;
+    socket->sndq_len = 0;
+    socket->sndb = NULL;
+    socket->persist_us = 0;
+    socket->uring = NULL;
+
+    if(socket->timers != NULL)
+    {
+        for(int i = 0; i < TIMER_COUNT; i++)
+        {
+            timer_cancel(&socket->timers[i]);
+        }
+        free(socket->timers);
+    }
+    socket->timers = NULL;
+    socket->timers_due = 0;
+}
+
+/**
+*   Rounds recvbuf_len up to a power of two within the supported range and
+*   picks the window scale that lets a 16-bit window advertise all of it
+*/
+static void setup_window(microtcp_sock_t *socket)
+{
+    size_t len = 1;
+
+    /*The largest segment this end takes, the receive buffer holds at least two*/
+    if(socket->max_mss < socket->mss)
+    {
+        socket->max_mss = socket->mss;
+    }
+
+    while((len < socket->recvbuf_len || len < 2 * socket->max_mss) && len < MICROTCP_MAX_RECVBUF_LEN)
+    {
+        len <<= 1;
+    }
+    socket->recvbuf_len = len;
+
+    socket->rcv_wscale = 0;
+    while((len >> socket->rcv_wscale) > UINT16_MAX && socket->rcv_wscale < MICROTCP_MAX_WSCALE)
+    {
+        socket->rcv_wscale++;
+    }
+    socket->snd_wscale = 0;
+}
+
+/*Lowers the MSS to the largest payload the peer takes, advertised in future_use2
+  of its SYN or SYN_ACK, and bounds the path MTU search by it*/
+static void setup_mss(microtcp_sock_t *socket, size_t peer_mss)
+{
+    if(peer_mss == 0)
+    {
+        peer_mss = socket->mss;
+    }
+    if(socket->mss > peer_mss)
+    {
+        socket->mss = peer_mss;
+    }
+    socket->base_mss = socket->mss;
+
+    memset(&socket->plpmtu, 0, sizeof(microtcp_plpmtu_t));
+    socket->plpmtu.low = socket->mss;
+    socket->plpmtu.max = min(socket->max_mss, peer_mss, SIZE_MAX);
+    if(socket->plpmtu.max < socket->plpmtu.low)
+    {
+        socket->plpmtu.max = socket->plpmtu.low;
+    }
+    socket->plpmtu.high = socket->plpmtu.max;
+}
+
+/*Sets DF on every datagram for the path MTU search. The kernel's own path MTU
+  is ignored, a datagram larger than the interface fails with EMSGSIZE instead*/
+static void setup_plpmtu(microtcp_sock_t *socket)
+{
+    int ret, val;
+
+    if(socket->plpmtu.high <= socket->plpmtu.low)
+    {
+        return;
+    }
+
+    if(socket->address.sa_family == AF_INET6)
+    {
+        val = IPV6_PMTUDISC_PROBE;
+        ret = setsockopt(socket->sd, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &val, sizeof(val));
+    }
+    else
+    {
+        val = IP_PMTUDISC_PROBE;
+        ret = setsockopt(socket->sd, IPPROTO_IP, IP_MTU_DISCOVER, &val, sizeof(val));
+    }
+
+    if(ret == -1)
+    {
+        perror("WARNING AT Path MTU discovery, keeping the initial MSS");
+        socket->plpmtu.high = socket->plpmtu.low;
+        socket->plpmtu.max = socket->plpmtu.low;
+    }
+}
+
+/*The window of the SYN and SYN_ACK, which is never scaled*/
+static uint16_t syn_window(microtcp_sock_t *socket)
+{
+    return socket->recvbuf_len > UINT16_MAX ? UINT16_MAX : socket->recvbuf_len;
+}
+
+/*Free space of the receive buffer, advertised to the peer as the window.
+  Out of order data lies inside the window, so it does not shrink it*/
+static size_t recv_window(microtcp_sock_t *socket)
+{
+    return socket->recvbuf_len - socket->buf_fill_level;
+}
+
+/*Data of non-blocking sends waiting for the window*/
+static size_t sndbuf_unsent(microtcp_sock_t *socket)
+{
+    return socket->sndb != NULL ? (uint32_t)(socket->snd_end - socket->seq_number) : 0;
+}
+
+/*The window field of a segment, recv_window() scaled down*/
+static uint16_t advertised_window(microtcp_sock_t *socket)
+{
+    size_t window = recv_window(socket) >> socket->rcv_wscale;
+
+    return window > UINT16_MAX ? UINT16_MAX : window;
+}
+
+/**
+*   Allocates the per connection buffers, once the 3-way handshake is complete
+*/
+static int alloc_buffers(microtcp_sock_t *socket)
+{
+    setup_offload(socket);
+    setup_plpmtu(socket);
+
+    socket->recvbuf = (uint8_t*) calloc(socket->recvbuf_len, sizeof(uint8_t));
+    socket->buf_fill_level = 0;
+    socket->fin_gap = 0;
+    socket->ooo_len = 0;
+    socket->sack_turn = 0;
+    socket->sack_high = socket->snd_una;
+    socket->high_rxt = socket->snd_una;
+    socket->rxr = (struct microtcp_rx_ring*) malloc(sizeof(struct microtcp_rx_ring));
+    socket->txb = (struct microtcp_tx_batch*) malloc(sizeof(struct microtcp_tx_batch));
+    socket->sndq = (microtcp_segment_t*) malloc(MICROTCP_SNDQ_LEN * sizeof(microtcp_segment_t));
+    socket->sndq_cap = MICROTCP_SNDQ_LEN;
+    socket->sndq_head = 0;
+    socket->sndq_len = 0;
+    socket->timers = (struct microtcp_timer*) calloc(TIMER_COUNT, sizeof(struct microtcp_timer));
+    socket->timers_due = 0;
+
+    /*One allocation holds all the slots of the receive ring. They take segments
+      of the MSS the connection starts with, and grow with the path MTU*/
+    if(socket->rxr != NULL)
+    {
+        socket->rxr->nslots = socket->offload ? GRO_SLOTS : MICROTCP_RX_BATCH;
+        socket->rxr->slot_len = socket->offload ? GSO_MAX_BYTES : sizeof(microtcp_header_t) + socket->mss;
+        socket->rxr->want_len = 0;
+        socket->rxr->slab = (uint8_t*) malloc(socket->rxr->nslots * socket->rxr->slot_len);
+        for(unsigned int i = 0; i < socket->rxr->nslots && socket->rxr->slab != NULL; i++)
+        {
+            socket->rxr->slots[i] = socket->rxr->slab + i * socket->rxr->slot_len;
+        }
+    }
+
+    if(socket->recvbuf == NULL || socket->rxr == NULL || socket->rxr->slab == NULL || socket->txb == NULL || socket->sndq == NULL || socket->timers == NULL)
+    {
+        free_buffers(socket);
+        return -1;
+    }
+
+    socket->txb->len = 0;
+    socket->txb->segments = 0;
+    socket->txb->iov_used = 0;
+    socket->txb->probe = -1;
+    socket->rxr->head = 0;
+    socket->rxr->len = 0;
+    for(int i = 0; i < TIMER_COUNT; i++)
+    {
+        socket->timers[i].fire = conn_timer_fired;
+        socket->timers[i].arg = socket;
+    }
+    setup_uring(socket);
+    return 0;
+}
+
+/**
+*   DEMULTIPLEXING of the connections of a listener
+*/
+
+/*The key of an IPv4 address and port, -1 for any other address family*/
+static int peer_key(const struct sockaddr *address, uint64_t *key)
+{
+    const struct sockaddr_in *in = (const struct sockaddr_in*) address;
+
+    if(address->sa_family != AF_INET)
+    {
+        return -1;
+    }
+    *key = ((uint64_t)ntohl(in->sin_addr.s_addr) << 16) | ntohs(in->sin_port);
+    return 0;
+}
+
+/*Slot of the table where the search for key starts. The multiplication spreads
+  every bit of the key over the high half, which is folded onto the low one*/
+static size_t peer_home(const struct microtcp_demux *demux, uint64_t key)
+{
+    uint64_t hash = key * 0x9e3779b97f4a7c15ULL;
+
+    return (hash ^ (hash >> 32)) & (demux->cap - 1);
+}
+
+/*The slot of key, or the empty slot where it would go*/
+static size_t demux_find(const struct microtcp_demux *demux, uint64_t key)
+{
+    size_t i = peer_home(demux, key);
+
+    while(demux->table[i].conn != NULL && demux->table[i].peer != key)
+    {
+        i = (i + 1) & (demux->cap - 1);
+    }
+    return i;
+}
+
+/*The connection of the peer at address, NULL if there is none*/
+static microtcp_sock_t *demux_lookup(const struct microtcp_demux *demux, const struct sockaddr *address)
+{
+    uint64_t key;
+
+    if(peer_key(address, &key) == -1)
+    {
+        return NULL;
+    }
+    return demux->table[demux_find(demux, key)].conn;
+}
+
+/*Doubles the table*/
+static int demux_grow(struct microtcp_demux *demux)
+{
+    struct microtcp_demux_slot *old = demux->table;
+    size_t old_cap = demux->cap;
+
+    demux->table = (struct microtcp_demux_slot*) calloc(2 * old_cap, sizeof(struct microtcp_demux_slot));
+    if(demux->table == NULL)
+    {
+        demux->table = old;
+        return -1;
+    }
+    demux->cap = 2 * old_cap;
+
+    for(size_t i = 0; i < old_cap; i++)
+    {
+        if(old[i].conn != NULL)
+        {
+            demux->table[demux_find(demux, old[i].peer)] = old[i];
+        }
+    }
+    free(old);
+    return 0;
+}
+
+/*Adds the connection of the peer at address, keeping the table at most half full.
+  Fails with EADDRINUSE if the peer already has a connection*/
+static int demux_insert(struct microtcp_demux *demux, microtcp_sock_t *conn, const struct sockaddr *address)
+{
+    uint64_t key;
+    size_t i;
+
+    if(peer_key(address, &key) == -1)
+    {
+        errno = EAFNOSUPPORT;
+        return -1;
+    }
+    if(2 * (demux->len + 1) > demux->cap && demux_grow(demux) == -1)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    i = demux_find(demux, key);
+    if(demux->table[i].conn != NULL)
+    {
+        errno = EADDRINUSE;
+        return -1;
+    }
+    demux->table[i].peer = key;
+    demux->table[i].conn = conn;
+    demux->len++;
+    return 0;
+}
+
+/*Removes the connection of the peer at address. The entries after it move back
+  over the hole when that brings them closer to their home slot, so a lookup
+  never stops at an empty slot before its key and no tombstones are needed*/
+static void demux_remove(struct microtcp_demux *demux, const struct sockaddr *address)
+{
+    size_t mask = demux->cap - 1;
+    size_t i, j, home;
+    uint64_t key;
+
+    if(peer_key(address, &key) == -1)
+    {
+        return;
+    }
+    i = demux_find(demux, key);
+    if(demux->table[i].conn == NULL)
+    {
+        return;
+    }
+
+    for(j = (i + 1) & mask; demux->table[j].conn != NULL; j = (j + 1) & mask)
+    {
+        /*The entry at j stays if its home lies cyclically in (i, j]*/
+        home = peer_home(demux, demux->table[j].peer);
+        if(i < j ? (home <= i || home > j) : (home <= i && home > j))
+        {
+            demux->table[i] = demux->table[j];
+            i = j;
+        }
+    }
+    demux->table[i].conn = NULL;
+    demux->len--;
+}
+
+static void stash_push(microtcp_sock_t *socket, struct microtcp_dgram *dgram)
+{
+    dgram->next = NULL;
+    if(socket->stash == NULL)
+    {
+        socket->stash = dgram;
+    }
+    else
+    {
+        socket->stash_tail->next = dgram;
+    }
+    socket->stash_tail = dgram;
+    socket->stash_len++;
+}
+
+static struct microtcp_dgram *stash_pop(microtcp_sock_t *socket)
+{
+    struct microtcp_dgram *dgram = socket->stash;
+
+    if(dgram != NULL)
+    {
+        socket->stash = dgram->next;
+        socket->stash_len--;
+        dgram->next = NULL;
+    }
+    return dgram;
+}
+
+/*Returns a list of stashed segments to the pool*/
+static void stash_free(struct microtcp_demux *demux, struct microtcp_dgram *dgram)
+{
+    struct microtcp_dgram *next;
+
+    for(; dgram != NULL; dgram = next)
+    {
+        next = dgram->next;
+        pool_free(&demux->dgram_pool, dgram);
+    }
+}
+
+/**
+*   Copies a segment read from the shared socket to the stash of its owner,
+*   the connection of the peer or, for the SYN of a new peer, the listener.
+*   Anything else is dropped, and so is whatever finds the stash full.
+*/
+static void demux_deliver(struct microtcp_demux *demux, microtcp_sock_t *owner, const uint8_t *buf, size_t len, const struct sockaddr *from, socklen_t from_len)
+{
+    struct microtcp_dgram *dgram;
+    size_t limit = MICROTCP_DEMUX_STASH_LEN;
+    uint16_t control;
+
+    if(owner == NULL && demux->listener != NULL && len >= sizeof(microtcp_header_t))
+    {
+        memcpy(&control, buf + offsetof(microtcp_header_t, control), sizeof(control));
+        if(ntohs(control) == SYN)
+        {
+            owner = demux->listener;
+            limit = demux->backlog;
+        }
+    }
+
+    if(owner == NULL || owner->stash_len >= limit || len > demux->dgram_len
+        || (dgram = (struct microtcp_dgram*) pool_alloc(&demux->dgram_pool)) == NULL)
+    {
+        return;
+    }
+
+    memcpy(dgram->data, buf, len);
+    dgram->len = len;
+    dgram->from_len = min(from_len, sizeof(struct sockaddr), SIZE_MAX);
+    memcpy(&dgram->from, from, dgram->from_len);
+    stash_push(owner, dgram);
+}
+
+/*Reads the next datagram of the shared socket, with the recvmsg() flags, and
+  delivers its segments*/
+static int demux_read(microtcp_sock_t *socket, int flags)
+{
+    struct microtcp_demux *demux = socket->demux;
+    struct iovec iov = { .iov_base = demux->scratch, .iov_len = GSO_MAX_BYTES };
+    struct sockaddr_storage from;
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    microtcp_sock_t *owner;
+    size_t gso_size;
+    ssize_t len;
+
+    do
+    {
+        memset(&msg, 0, sizeof(struct msghdr));
+        msg.msg_name = &from;
+        msg.msg_namelen = sizeof(from);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        len = recvmsg(socket->sd, &msg, flags);
+    } while(len == -1 && errno == EINTR);
+
+    /*EAGAIN is nothing left to read, not an error*/
+    if(len == -1)
+    {
+        if(errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            perror("ERROR AT Demux Recieve");
+        }
+        return -1;
+    }
+
+    /*Coalesced by UDP_GRO once a connection has turned offload on*/
+    gso_size = len;
+    for(cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if(cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+        {
+            gso_size = *(int*)CMSG_DATA(cmsg);
+        }
+    }
+
+    owner = demux_lookup(demux, (struct sockaddr*)&from);
+    for(size_t off = 0; off < (size_t)len; off += gso_size)
+    {
+        demux_deliver(demux, owner, demux->scratch + off, min(gso_size, len - off, SIZE_MAX), (struct sockaddr*)&from, msg.msg_namelen);
+    }
+    return 0;
+}
+
+/*Drops a reference to the demux, the last one frees it*/
+static void demux_put(struct microtcp_demux *demux)
+{
+    if(--demux->refs > 0)
+    {
+        return;
+    }
+    pool_destroy(&demux->dgram_pool);
+    free(demux->table);
+    free(demux->scratch);
+    free(demux);
+}
+
+/*Drops a connection that was never accepted, once it is off the list of the demux*/
+static void half_open_free(struct microtcp_demux *demux, struct microtcp_half_open *half)
+{
+    timer_cancel(&half->timer);
+    if(demux_lookup(demux, &half->conn.address) == &half->conn)
+    {
+        demux_remove(demux, &half->conn.address);
+    }
+    stash_free(demux, half->conn.stash);
+    stash_free(demux, half->early);
+    free(half);
+}
+
+/*Takes the socket out of its demux and releases what was stashed for it*/
+static void demux_leave(microtcp_sock_t *socket)
+{
+    struct microtcp_demux *demux = socket->demux;
+    struct microtcp_half_open *half;
+
+    if(demux == NULL)
+    {
+        return;
+    }
+
+    /*Nobody is left to accept the connections that wait for it*/
+    if(socket == demux->listener)
+    {
+        while((half = demux->half_open) != NULL)
+        {
+            demux->half_open = half->next;
+            half_open_free(demux, half);
+        }
+        demux->half_open_len = 0;
+        demux->listener = NULL;
+    }
+    else if(demux_lookup(demux, &socket->address) == socket)
+    {
+        demux_remove(demux, &socket->address);
+    }
+
+    stash_free(demux, socket->stash);
+    stash_free(demux, socket->stash_held);
+    socket->stash = NULL;
+    socket->stash_tail = NULL;
+    socket->stash_held = NULL;
+    socket->stash_len = 0;
+    socket->demux = NULL;
+    demux_put(demux);
+}
 
 microtcp_sock_t microtcp_socket (int domain, int type, int protocol) 
 {
-    microtcp_sock_t sock;
-    sock.sd = socket(domain, type, protocol);
+    microtcp_sock_t sock;
+    sock.sd = socket(domain, type & ~MICROTCP_SOCK_URING, protocol);
+
+    if(sock.sd == -1) 
+    {
+        perror("ERROR AT: Creation of socket");
+        sock.state = INVALID;
+    }
+    else
+    {
+        sock.state = UNKNOWN;
+        sock.init_win_size = 0 ;
+        sock.curr_win_size = 0;
+        sock.recvbuf = NULL;
+        sock.buf_fill_level = 0;
+        sock.fin_gap = 0;
+        sock.ooo_len = 0;
+        sock.ooo_recent = 0;
+        sock.sack_turn = 0;
+        sock.cwnd =0;
+        sock.ssthresh =0;
+        sock.dup_acks =0;
+        sock.recover =0;
+        sock.in_recovery =0;
+        sock.rto_recovery =0;
+        sock.sack_high =0;
+        sock.high_rxt =0;
+        sock.cc = &microtcp_cc_reno;
+        memset(sock.cc_priv, 0, sizeof(sock.cc_priv));
+        sock.pacing_rate =0;
+        sock.delivered =0;
+        sock.delivered_time_us =0;
+        sock.app_limited =0;
+        sock.max_pacing_rate =0;
+        sock.pacing_quantum =0;
+        sock.pacing_next_us =0;
+        sock.seq_number =0;
+        sock.ack_number =0;
+        sock.snd_una =0;
+        sock.sndq = NULL;
+        sock.sndq_cap =0;
+        sock.sndq_head =0;
+        sock.sndq_len =0;
+        sock.rxr = NULL;
+        sock.sndbuf_len = MICROTCP_SNDBUF_LEN;
+        sock.sndb = NULL;
+        sock.snd_end =0;
+        sock.persist_us =0;
+        sock.timers = NULL;
+        sock.timers_due =0;
+        sock.txb = NULL;
+        sock.tx_syscalls_saved =0;
+        sock.rx_syscalls_saved =0;
+        sock.zc_enabled =0;
+        sock.zc_active =0;
+        sock.zc_sent =0;
+        sock.zc_completed =0;
+        sock.zc_copied =0;
+        sock.offload =0;
+        sock.io_uring = (type & MICROTCP_SOCK_URING) != 0;
+        sock.uring = NULL;
+        sock.options = MICROTCP_OPT_ALL;
+        sock.recvbuf_len = MICROTCP_RECVBUF_LEN;
+        sock.rcv_wscale =0;
+        sock.snd_wscale =0;
+        sock.ts_recent =0;
+        sock.ack_every = MICROTCP_ACK_EVERY;
+        sock.delack_us = MICROTCP_DELACK_US;
+        sock.ack_pending =0;
+        sock.ack_deadline_us =0;
+        sock.acks_saved =0;
+        sock.srtt_us =0;
+        sock.rttvar_us =0;
+        sock.rto_us = MICROTCP_ACK_TIMEOUT_US;
+        sock.rto_deadline_us =0;
+        sock.closing =0;
+        sock.fin_seq =0;
+        sock.fin_tries =0;
+        sock.close_us =0;
+        sock.min_rto_us = MICROTCP_MIN_RTO_US;
+        sock.max_rto_us = MICROTCP_MAX_RTO_US;
+        sock.mss = MICROTCP_MSS;
+        sock.max_mss = MICROTCP_PLPMTU_MAX_MSS;
+        sock.base_mss = MICROTCP_MSS;
+        memset(&sock.plpmtu, 0, sizeof(microtcp_plpmtu_t));
+        sock.init_cwnd = MICROTCP_INIT_CWND;
+        sock.init_ssthresh = MICROTCP_INIT_SSTHRESH;
+        sock.packets_send =0;
+        sock.packets_received =0;
+        sock.packets_lost =0;
+        sock.bytes_send =0;
+        sock.bytes_received =0;
+        sock.bytes_lost =0;
+        sock.heap_allocs =0;
+        sock.packets_reordered =0;
+        sock.demux = NULL;
+        sock.stash = NULL;
+        sock.stash_tail = NULL;
+        sock.stash_len =0;
+        sock.stash_held = NULL;
+	    memset(&sock.address, 0 , sizeof(struct  sockaddr));
+	    sock.address_len = 0;
+    }
+    
+    return sock;
+}
+
+int microtcp_bind (microtcp_sock_t *socket, const struct sockaddr *address, socklen_t address_len)
+{
+    if(socket->state == INVALID)
+    {
+        perror("ERROR AT: Bind of socket");
+        return -1;
+    }
+
+    return bind(socket->sd, address, address_len);
+}
+
+/**
+*   SOCKET OPTIONS
+*/
+
+int microtcp_setsockopt (microtcp_sock_t *socket, int level, int optname, const void *optval, socklen_t optlen)
+{
+    char name[MICROTCP_CC_NAME_MAX];
+    uint64_t val;
+    int valid = 1;
+
+    if(level != SOL_MICROTCP)
+    {
+        return setsockopt(socket->sd, level, optname, optval, optlen);
+    }
+
+    if(optname == MICROTCP_SO_CONGESTION)
+    {
+        memset(name, 0, sizeof(name));
+        memcpy(name, optval, min(optlen, sizeof(name) - 1, SIZE_MAX));
+        return microtcp_set_congestion_control(socket, name);
+    }
+
+    if(optlen != sizeof(uint64_t))
+    {
+        errno = EINVAL;
+        perror("ERROR AT Setsockopt: Option length");
+        return -1;
+    }
+    memcpy(&val, optval, sizeof(val));
+
+    /*These shape the connection, they are fixed once it is established*/
+    if(socket->state != UNKNOWN && (optname == MICROTCP_SO_MSS || optname == MICROTCP_SO_MAX_MSS || optname == MICROTCP_SO_RCVBUF
+        || optname == MICROTCP_SO_INIT_CWND || optname == MICROTCP_SO_INIT_SSTHRESH
+        || optname == MICROTCP_SO_OPTIONS || optname == MICROTCP_SO_OFFLOAD))
+    {
+        errno = EISCONN;
+        perror("ERROR AT Setsockopt: Socket already connected");
+        return -1;
+    }
+
+    /*The send buffer is fixed once a non-blocking send uses it*/
+    if(optname == MICROTCP_SO_SNDBUF && socket->sndb != NULL)
+    {
+        errno = EBUSY;
+        perror("ERROR AT Setsockopt: Send buffer in use");
+        return -1;
+    }
+
+    switch(optname)
+    {
+        case MICROTCP_SO_MSS:
+            valid = val >= MICROTCP_MIN_MSS && val <= MICROTCP_MAX_MSS;
+            if(valid)
+            {
+                socket->mss = val;
+            }
+            break;
+        case MICROTCP_SO_MAX_MSS:
+            valid = val >= MICROTCP_MIN_MSS && val <= MICROTCP_MAX_MSS;
+            if(valid)
+            {
+                socket->max_mss = val;
+            }
+            break;
+        case MICROTCP_SO_RCVBUF:
+            valid = val > 0 && val <= MICROTCP_MAX_RECVBUF_LEN;
+            if(valid)
+            {
+                socket->recvbuf_len = val;
+            }
+            break;
+        case MICROTCP_SO_INIT_CWND:
+            valid = val > 0;
+            if(valid)
+            {
+                socket->init_cwnd = val;
+            }
+            break;
+        case MICROTCP_SO_INIT_SSTHRESH:
+            valid = val > 0;
+            if(valid)
+            {
+                socket->init_ssthresh = val;
+            }
+            break;
+        case MICROTCP_SO_RTO:
+            valid = val >= socket->min_rto_us && val <= socket->max_rto_us;
+            if(valid)
+            {
+                socket->rto_us = val;
+            }
+            break;
+        case MICROTCP_SO_MIN_RTO:
+            valid = val > 0 && val <= socket->max_rto_us;
+            if(valid)
+            {
+                socket->min_rto_us = val;
+            }
+            break;
+        case MICROTCP_SO_MAX_RTO:
+            valid = val >= socket->min_rto_us;
+            if(valid)
+            {
+                socket->max_rto_us = val;
+            }
+            break;
+        case MICROTCP_SO_OPTIONS:
+            socket->options = val & MICROTCP_OPT_ALL;
+            break;
+        case MICROTCP_SO_OFFLOAD:
+            socket->offload = val != 0;
+            break;
+        case MICROTCP_SO_MAX_PACING_RATE:
+            socket->max_pacing_rate = val;
+            break;
+        case MICROTCP_SO_PACING_QUANTUM:
+            socket->pacing_quantum = val;
+            break;
+        case MICROTCP_SO_ACK_EVERY:
+            valid = val > 0 && val <= UINT32_MAX;
+            if(valid)
+            {
+                socket->ack_every = val;
+            }
+            break;
+        case MICROTCP_SO_DELACK:
+            valid = val < socket->min_rto_us;
+            if(valid)
+            {
+                socket->delack_us = val;
+            }
+            break;
+        case MICROTCP_SO_SNDBUF:
+            valid = val > 0 && val <= MICROTCP_MAX_RECVBUF_LEN;
+            if(valid)
+            {
+                socket->sndbuf_len = val;
+            }
+            break;
+        default:
+            errno = ENOPROTOOPT;
+            perror("ERROR AT Setsockopt: Unknown option");
+            return -1;
+    }
+
+    if(!valid)
+    {
+        errno = EINVAL;
+        perror("ERROR AT Setsockopt: Value out of range");
+        return -1;
+    }
+    return 0;
+}
+
+int microtcp_getsockopt (microtcp_sock_t *socket, int level, int optname, void *optval, socklen_t *optlen)
+{
+    uint64_t val;
+
+    if(level != SOL_MICROTCP)
+    {
+        return getsockopt(socket->sd, level, optname, optval, optlen);
+    }
+
+    if(optname == MICROTCP_SO_CONGESTION)
+    {
+        if(*optlen < strlen(socket->cc->name) + 1)
+        {
+            errno = EINVAL;
+            perror("ERROR AT Getsockopt: Option length");
+            return -1;
+        }
+        strcpy((char*)optval, socket->cc->name);
+        *optlen = strlen(socket->cc->name) + 1;
+        return 0;
+    }
+
+    switch(optname)
+    {
+        case MICROTCP_SO_MSS:               val = socket->mss;              break;
+        case MICROTCP_SO_MAX_MSS:           val = socket->max_mss;          break;
+        case MICROTCP_SO_RCVBUF:            val = socket->recvbuf_len;      break;
+        case MICROTCP_SO_INIT_CWND:         val = socket->init_cwnd;        break;
+        case MICROTCP_SO_INIT_SSTHRESH:     val = socket->init_ssthresh;    break;
+        case MICROTCP_SO_RTO:               val = socket->rto_us;           break;
+        case MICROTCP_SO_MIN_RTO:           val = socket->min_rto_us;       break;
+        case MICROTCP_SO_MAX_RTO:           val = socket->max_rto_us;       break;
+        case MICROTCP_SO_OPTIONS:           val = socket->options;          break;
+        case MICROTCP_SO_OFFLOAD:           val = socket->offload;          break;
+        case MICROTCP_SO_MAX_PACING_RATE:   val = socket->max_pacing_rate;  break;
+        case MICROTCP_SO_PACING_QUANTUM:    val = socket->pacing_quantum;   break;
+        case MICROTCP_SO_ACK_EVERY:         val = socket->ack_every;        break;
+        case MICROTCP_SO_DELACK:            val = socket->delack_us;        break;
+        case MICROTCP_SO_SNDBUF:            val = socket->sndbuf_len;       break;
+        default:
+            errno = ENOPROTOOPT;
+            perror("ERROR AT Getsockopt: Unknown option");
+            return -1;
+    }
+
+    if(*optlen < sizeof(uint64_t))
+    {
+        errno = EINVAL;
+        perror("ERROR AT Getsockopt: Option length");
+        return -1;
+    }
+    memcpy(optval, &val, sizeof(val));
+    *optlen = sizeof(uint64_t);
+    return 0;
+}
+
+/**
+*   CONNECT (3way handshake)
+*	Step 1: Client sends first package (SYN)
+*	Step 3: Client recieves second package (SYN,ACK) and sends thirds package (ACK)
+*/
+
+static int connect_handshake (microtcp_sock_t *socket, microtcp_header_t *header, const struct sockaddr *address, socklen_t address_len)
+{
+	uint32_t tmp_seq, tmp_ack;
+	uint16_t tmp_win;
+
+	srand((uint32_t)time(NULL));
+
+	/*Socket check*/
+	if (socket->state != UNKNOWN) 
+    {
+        perror("ERROR AT Connect: Invalid socket");
+        return -1;
+    }
+
+	setup_window(socket);
+
+    /************ FIRST STEP *************/
+    /*First package creation*/
+    header_init(header);
+    header->seq_number = (rand()% (10000 - 1000 + 1)) + 1000;
+    header->control = SYN;
+    header->window = syn_window(socket);
+    header->future_use0 = socket->options;
+    header->future_use1 = socket->rcv_wscale;
+    header->future_use2 = socket->max_mss;
+    header->checksum = crc32((uint8_t*)header, sizeof(microtcp_header_t));
+	tmp_seq = header->seq_number;		
+
+	printf("\nSending 1st package (3way handshake)\n");
+    header_print(header);
+    printf("\n");
+
+    /*Convert into network byte order  */
+    header_hton(header);
+
+	/*First package transmition*/
+    if(sendto(socket->sd, header, sizeof(microtcp_header_t),0,address ,address_len) == -1 ) 
+    {
+        perror("ERROR AT Connect: Step1 Send");
+        socket->state = INVALID;
+        return -1;
+   	}
+
+    /************ THIRD STEP *************/
+
+	/*Second package download*/
+    if(recvfrom(socket->sd,header, sizeof(microtcp_header_t), 0, (struct sockaddr*)address, &address_len) == -1)
+    {
+	    perror("ERROR AT Connect: Step3 Recieve");
+        socket->state = INVALID;
+        return -1;
+	}
+
+	/*Convert into host byte order*/
+    header_ntoh(header);
+
+	printf("\n2nd package recieved (3way handshake)\n");
+    header_print(header);
+    printf("\n");
+
+    /*Second package checks*/
+    if(!check_sum(header))
+    {
+        perror("ERROR AT Connect: Step3 Checksum");
+        socket->state = INVALID;
+        return -1;
+    }
+
+    if(header->control != SYN_ACK)
+    {
+        perror("ERROR AT Connect: Step3 Control");
+        socket->state = INVALID;
+        return -1;
+    }
+
+    if(header->ack_number != (tmp_seq + 1))
+    {
+        perror("ERROR AT Connect: Step3 Seq_number");
+        socket->state = INVALID;
+        return -1;
+    }
+
+	tmp_seq = header->seq_number;		
+    tmp_ack = header->ack_number;		
+	tmp_win = header->window;
+	socket->options &= header->future_use0;
+	if(socket->options & MICROTCP_OPT_WSCALE)
+    {
+		socket->snd_wscale = header->future_use1 < MICROTCP_MAX_WSCALE ? header->future_use1 : MICROTCP_MAX_WSCALE;
+	}
+	else
+    {
+		socket->rcv_wscale = 0;
+	}
+	setup_mss(socket, header->future_use2);
+
+	/*Third package creation */
+    header_init(header);
+    header->control =ACK;
+    header->seq_number = tmp_ack;		
+    header->ack_number = tmp_seq + 1;   
+    header->window = advertised_window(socket);
+    header->checksum = crc32((uint8_t*)header, sizeof(microtcp_header_t));
+
+	printf("\nTransmition 3rd package (3way handshake)\n");
+    header_print(header);
+    printf("\n");
+
+	/*Convert header into network byte order */
+	header_hton(header);
+
+    /*Third package transmition */
+    if(sendto(socket->sd, header, sizeof(microtcp_header_t),0,address ,address_len) == -1 ){	
+        perror("Connect: Step3 Send");
+        socket->state = INVALID;
+        return -1;
+ 	}
+
+
+    /*Socket initiation*/
+	socket->caller = CLIENT;
+    socket->state = ESTABLISHED;
+	socket->ssthresh = socket->init_ssthresh; 
+	socket->cwnd = socket->init_cwnd;    
+	socket->cc->init(socket);
+	socket->seq_number = tmp_ack;	
+    socket->ack_number = tmp_seq + 1;		
+    socket->snd_una = socket->seq_number;
+	socket->init_win_size = tmp_win;
+	socket->curr_win_size = tmp_win;
+	socket->address = *address;
+	socket->address_len = address_len;
+
+	/*Buffers check*/
+	if(alloc_buffers(socket) == -1)
+    {
+		perror("ERROR AT Connect: Buffers Memory Allocation");
+		return -1;
+	}
+
+	return 0;
+}
+
+int microtcp_connect (microtcp_sock_t *socket, const struct sockaddr *address, socklen_t address_len)
+{
+	microtcp_header_t header;
+
+	return connect_handshake(socket, &header, address, address_len);
+}
+
+/**
+*   ACCEPT (3way handshake)
+*   Step 2: Server recieves first package (SYN) and sends second package (SYN,ACK)
+*   Step 4: Server recieves third package (ACK)
+*/
+
+/*Step 2: checks the SYN in header and turns it into the SYN_ACK that answers it,
+  in network byte order. tmp_seq and tmp_ack get its sequence and ack numbers*/
+static int accept_syn (microtcp_sock_t *socket, microtcp_header_t *header, uint32_t *tmp_seq, uint32_t *tmp_ack)
+{
+	/*Convert into host byte order*/
+    header_ntoh(header);
+
+   	printf("\nRecieved 1st package (3way handshake)\n");
+   	header_print(header);
+    printf("\n");
+
+    /* First package checks*/
+    if(!check_sum(header))
+    {
+        socket->state = INVALID;
+        return -1;
+    }
+
+	if(header->control != SYN)
+    {
+        socket->state = INVALID;
+        return -1;
+    }
+
+	*tmp_seq = header->seq_number;
+	socket->options &= header->future_use0;
+	setup_window(socket);
+	if(socket->options & MICROTCP_OPT_WSCALE)
+    {
+		socket->snd_wscale = header->future_use1 < MICROTCP_MAX_WSCALE ? header->future_use1 : MICROTCP_MAX_WSCALE;
+	}
+	else
+    {
+		socket->rcv_wscale = 0;
+	}
+	setup_mss(socket, header->future_use2);
+
+    /*Second package creation*/
+	header_init(header);
+   	header->seq_number = (rand()% (20000 - 11000 + 1)) + 1000;
+	header->ack_number = *tmp_seq + 1;
+    header->control = SYN_ACK;
+    header->window = syn_window(socket);
+    header->future_use0 = socket->options;
+    header->future_use1 = socket->rcv_wscale;
+    header->future_use2 = socket->max_mss;
+    header->checksum = crc32((uint8_t*)header, sizeof(microtcp_header_t));
+    *tmp_seq = header->seq_number;
+    *tmp_ack = header->ack_number;
+    printf("\nTransmition 2nd package (3way handshake)\n");
+    header_print(header);
+    printf("\n");
+
+    /*Convert into network byte order */
+	header_hton(header);
+
+    return 0;
+}
+
+/*Step 4: checks the ACK in header that answers the SYN_ACK and sets up the
+  connection, all but its address and buffers*/
+static int accept_ack (microtcp_sock_t *socket, microtcp_header_t *header, uint32_t tmp_seq, uint32_t tmp_ack)
+{
+    /* Convert into host byte order */
+    header_ntoh(header);
+
+    printf("\nRecieved 3rd package (3way handshake)\n");
+    header_print(header);
+    printf("\n");
+
+    /* Third package checks*/
+    if(!check_sum(header))
+    {
+        perror("ERROR AT: checksum");
+        socket->state = INVALID;
+        return -1;
+    }
+    
+    if(header->control != ACK) 
+    {
+        perror("ERROR AT: ACK");
+        socket->state = INVALID;
+        return -1;
+    }
+    
+    if(header->seq_number != tmp_ack) 
+    {
+        perror("ERROR AT: seq");
+        socket->state = INVALID;
+        return -1;
+    }
+
+    if(header->ack_number != (tmp_seq + 1)) 
+    {
+        socket->state =INVALID;
+        return -1;
+    }
+
+    /*  Socket initiation*/
+	socket->caller = SERVER;
+    socket->state = ESTABLISHED;
+	socket->ssthresh = socket->init_ssthresh; 
+	socket->cwnd = socket->init_cwnd;	
+	socket->cc->init(socket);
+	socket->init_win_size = (size_t)header->window << socket->snd_wscale;
+    socket->curr_win_size = socket->init_win_size;
+    socket->seq_number = header->ack_number;
+    socket->ack_number = header->seq_number;
+    socket->snd_una = socket->seq_number;
+    return 0;
+}
+
+static int accept_handshake (microtcp_sock_t *socket, microtcp_header_t *header, struct sockaddr *address, socklen_t address_len)
+{
+	uint32_t tmp_seq, tmp_ack;
+
+	srand((uint32_t)time(NULL));
+
+    /************ SECOND STEP *************/
+
+    /* First package download*/
+	if(recvfrom(socket->sd, header, sizeof(microtcp_header_t), 0, address, &address_len) == -1)
+    {
+        perror("ERROR AT Accept: Step2 Recieve");
+        socket->state = INVALID;
+        return -1;
+    }
+
+    if(accept_syn(socket, header, &tmp_seq, &tmp_ack) == -1)
+    {
+        return -1;
+    }
+
+    /*Second package transmition*/
+    if(sendto(socket->sd, header, sizeof(microtcp_header_t), 0, address, address_len) == -1)
+    {			
+        socket->state = INVALID;
+        return -1;
+    }
+
+
+	/************ FOURTH STEP *************/
+
+	/*  Third package download */
+    if(recvfrom(socket->sd, header, sizeof(microtcp_header_t), 0, address, &address_len) == -1)
+    {	
+        socket->state = INVALID;
+        return -1;
+    }
+
+    if(accept_ack(socket, header, tmp_seq, tmp_ack) == -1)
+    {
+        return -1;
+    }
+
+	socket->address = *address;
+	socket->address_len = address_len;
+
+    /*Buffers check*/
+    if(alloc_buffers(socket) == -1)
+    {
+            perror("ERROR AT Accept: Buffers Memory Allocation");
+            return -1;
+    }
+
+    return socket->sd;
+}
+
+int microtcp_accept (microtcp_sock_t *socket, struct sockaddr *address, socklen_t address_len)
+{
+	microtcp_header_t header;
+
+	return accept_handshake(socket, &header, address, address_len);
+}
+
+/**
+*   LISTEN
+*   The connections of a listener share its UDP socket. Segments reach them
+*   through the demux, so the handshakes of new peers go on in the stashes of
+*   their half-open connections instead of recvfrom(), as many at a time as
+*   the backlog.
+*/
+
+int microtcp_listen (microtcp_sock_t *socket, int backlog)
+{
+	struct microtcp_demux *demux;
+
+	if(socket->state != UNKNOWN)
+    {
+		errno = EINVAL;
+		perror("ERROR AT Listen: Invalid socket");
+		return -1;
+	}
+
+	demux = (struct microtcp_demux*) calloc(1, sizeof(struct microtcp_demux));
+	if(demux != NULL)
+    {
+		demux->cap = 64;
+		demux->table = (struct microtcp_demux_slot*) calloc(demux->cap, sizeof(struct microtcp_demux_slot));
+		demux->scratch = (uint8_t*) malloc(GSO_MAX_BYTES);
+		demux->dgram_len = sizeof(microtcp_header_t) + (socket->max_mss > socket->mss ? socket->max_mss : socket->mss);
+		pool_init(&demux->dgram_pool, sizeof(struct microtcp_dgram) + demux->dgram_len, MICROTCP_DEMUX_POOL_LEN);
+	}
+
+	if(demux == NULL || demux->table == NULL || demux->scratch == NULL || demux->dgram_pool.slab == NULL)
+    {
+		if(demux != NULL)
+        {
+			pool_destroy(&demux->dgram_pool);
+			free(demux->table);
+			free(demux->scratch);
+			free(demux);
+		}
+		errno = ENOMEM;
+		perror("ERROR AT Listen: Memory Allocation");
+		return -1;
+	}
+
+	demux->listener = socket;
+	demux->backlog = backlog > 0 ? (size_t)backlog : MICROTCP_LISTEN_BACKLOG;
+	demux->refs = 1;
+	socket->demux = demux;
+	socket->state = LISTEN;
+
+	/*Once, so that connections accepted in the same second start at different sequence numbers*/
+	srand((uint32_t)time(NULL));
+	return 0;
+}
+
+/*The timer only wakes the thread up, listen_drive() looks at the time*/
+static void half_open_fired(struct microtcp_timer *timer)
+{
+	(void) timer;
+}
+
+/*Sends the SYN_ACK of a half-open connection. A failed send is a lost one*/
+static void half_open_send(struct microtcp_half_open *half)
+{
+	if(sendto(half->conn.sd, &half->syn_ack, sizeof(microtcp_header_t), 0, &half->conn.address, half->conn.address_len) == -1)
+    {
+		perror("WARNING AT Accept: Step2 Send");
+	}
+}
+
+/*Sets the timer for the next SYN_ACK, the RTO doubled for every one sent*/
+static void half_open_arm(struct microtcp_half_open *half)
+{
+	uint64_t rto = half->conn.rto_us;
+
+	for(unsigned int i = 1; i < half->tries && rto < half->conn.max_rto_us; i++)
+    {
+		rto *= 2;
+	}
+	if(rto > half->conn.max_rto_us)
+    {
+		rto = half->conn.max_rto_us;
+	}
+	timer_arm(&half->timer, now_us() + rto);
+}
+
+/*Sets up the connection of a new peer from its SYN and answers it. A SYN of
+  a peer that has a connection already, or one past the backlog, is dropped*/
+static void half_open_syn(microtcp_sock_t *socket, struct microtcp_dgram *dgram)
+{
+	struct microtcp_demux *demux = socket->demux;
+	struct microtcp_half_open *half;
+	microtcp_sock_t *conn;
+
+	if(demux_lookup(demux, &dgram->from) != NULL || demux->half_open_len >= demux->backlog)
+    {
+		return;
+	}
+
+	half = (struct microtcp_half_open*) calloc(1, sizeof(struct microtcp_half_open));
+	if(half == NULL)
+    {
+		perror("WARNING AT Accept: Memory Allocation");
+		return;
+	}
+
+	/*The connection starts out with the settings of the listener*/
+	conn = &half->conn;
+	*conn = *socket;
+	conn->stash = NULL;
+	conn->stash_tail = NULL;
+	conn->stash_len = 0;
+	conn->stash_held = NULL;
+	conn->address = dgram->from;
+	conn->address_len = dgram->from_len;
+
+	/*Zero-copy completions of the shared socket could not be told apart*/
+	conn->zc_enabled = -1;
+
+	memcpy(&half->syn_ack, dgram->data, sizeof(microtcp_header_t));
+	if(accept_syn(conn, &half->syn_ack, &half->tmp_seq, &half->tmp_ack) == -1)
+    {
+		free(half);
+		return;
+	}
+
+	/*From now on the segments of the peer are routed to the connection*/
+	if(demux_insert(demux, conn, &conn->address) == -1)
+    {
+		perror("WARNING AT Accept: Connection table");
+		free(half);
+		return;
+	}
+	conn->state = SYN_RECEIVED;
+	half->timer.fire = half_open_fired;
+	half->timer.arg = half;
+	half->next = demux->half_open;
+	demux->half_open = half;
+	demux->half_open_len++;
+
+	half_open_send(half);
+	half->tries = 1;
+	half_open_arm(half);
+}
+
+/*Takes in the segments of the peer of a half-open connection. Its ACK makes
+  the connection ESTABLISHED, its SYN again is answered again and anything
+  else waits in early, ahead of what the stash gets afterwards*/
+static void half_open_input(struct microtcp_demux *demux, struct microtcp_half_open *half)
+{
+	microtcp_sock_t *conn = &half->conn;
+	struct microtcp_dgram *dgram;
+	microtcp_header_t header;
+
+	while(conn->state == SYN_RECEIVED && (dgram = stash_pop(conn)) != NULL)
+    {
+		memset(&header, 0, sizeof(microtcp_header_t));
+		memcpy(&header, dgram->data, min(dgram->len, sizeof(microtcp_header_t), SIZE_MAX));
+
+		if(ntohs(header.control) == SYN)
+        {
+			stash_free(demux, dgram);
+			half_open_send(half);
+			continue;
+		}
+
+		if(ntohs(header.control) == ACK)
+        {
+			stash_free(demux, dgram);
+			if(accept_ack(conn, &header, half->tmp_seq, half->tmp_ack) == -1)
+            {
+				conn->state = SYN_RECEIVED;
+			}
+			continue;
+		}
+
+		if(half->early_len >= MICROTCP_DEMUX_STASH_LEN)
+        {
+			stash_free(demux, dgram);
+			continue;
+		}
+		if(half->early == NULL)
+        {
+			half->early = dgram;
+		}
+		else
+        {
+			half->early_tail->next = dgram;
+		}
+		half->early_tail = dgram;
+		half->early_len++;
+	}
+
+	if(conn->state == ESTABLISHED)
+    {
+		timer_cancel(&half->timer);
+		if(half->early != NULL)
+        {
+			half->early_tail->next = conn->stash;
+			if(conn->stash == NULL)
+            {
+				conn->stash_tail = half->early_tail;
+			}
+			conn->stash = half->early;
+			conn->stash_len += half->early_len;
+			half->early = NULL;
+			half->early_len = 0;
+		}
+	}
+}
+
+/**
+*   Moves the handshakes of new peers on without blocking: routes what has
+*   arrived, answers the SYNs of new peers, takes in the segments of the
+*   half-open connections, and sends their SYN_ACK again once its timer
+*   is due. A connection whose peer leaves MICROTCP_SYNACK_RETRIES of them
+*   unanswered is dropped.
+*/
+static int listen_drive(microtcp_sock_t *socket)
+{
+	struct microtcp_demux *demux = socket->demux;
+	struct microtcp_half_open *half, **pprev;
+	struct microtcp_dgram *dgram;
+	uint64_t now;
+
+	while(demux_read(socket, MSG_DONTWAIT) == 0)
+    {
+	}
+	if(errno != EAGAIN && errno != EWOULDBLOCK)
+    {
+		return -1;
+	}
+
+	while((dgram = stash_pop(socket)) != NULL)
+    {
+		half_open_syn(socket, dgram);
+		stash_free(demux, dgram);
+	}
+
+	now = now_us();
+	pprev = &demux->half_open;
+	while((half = *pprev) != NULL)
+    {
+		if(half->conn.state == SYN_RECEIVED)
+        {
+			half_open_input(demux, half);
+		}
+		if(half->conn.state == SYN_RECEIVED && now >= half->timer.expires_us)
+        {
+			if(half->tries > MICROTCP_SYNACK_RETRIES)
+            {
+				*pprev = half->next;
+				demux->half_open_len--;
+				half_open_free(demux, half);
+				continue;
+			}
+			half_open_send(half);
+			half->tries++;
+			half_open_arm(half);
+		}
+		pprev = &half->next;
+	}
+	return 0;
+}
+
+/*Whether segments wait for a listener, in its stash or a half-open connection's*/
+static int listen_stashed(const microtcp_sock_t *socket)
+{
+	const struct microtcp_half_open *half;
+
+	if(socket->stash != NULL)
+    {
+		return 1;
+	}
+	for(half = socket->demux != NULL ? socket->demux->half_open : NULL; half != NULL; half = half->next)
+    {
+		if(half->conn.state == SYN_RECEIVED && half->conn.stash != NULL)
+        {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*Microseconds until the next SYN_ACK of the listener is due, -1 if none is*/
+static int64_t listen_next(const microtcp_sock_t *socket)
+{
+	const struct microtcp_half_open *half;
+	uint64_t next = UINT64_MAX;
+	uint64_t now;
+
+	for(half = socket->demux != NULL ? socket->demux->half_open : NULL; half != NULL; half = half->next)
+    {
+		if(half->conn.state == SYN_RECEIVED && half->timer.expires_us < next)
+        {
+			next = half->timer.expires_us;
+		}
+	}
+
+	if(next == UINT64_MAX)
+    {
+		return -1;
+	}
+	now = now_us();
+	return next > now ? (int64_t)(next - now) : 0;
+}
+
+/*Blocks until the shared socket is readable or a timer of the thread goes
+  off. Fails with EAGAIN once deadline has passed*/
+static int listen_wait(microtcp_sock_t *socket, uint64_t deadline)
+{
+	struct pollfd pfd[2] = { { .fd = socket->sd, .events = POLLIN }, { .fd = -1, .events = POLLIN } };
+	struct timespec ts;
+	uint64_t now = now_us();
+	uint64_t wait = deadline;
+
+	if(timer_expire(now) > 0)
+    {
+		return 0;
+	}
+	if(now >= deadline)
+    {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	pfd[1].fd = timer_fd(now);
+	if(pfd[1].fd < 0 && timer_next() < wait)
+    {
+		wait = timer_next();
+	}
+	if(wait != UINT64_MAX)
+    {
+		ts.tv_sec = (wait - now) / 1000000;
+		ts.tv_nsec = ((wait - now) % 1000000) * 1000;
+	}
+
+	if(ppoll(pfd, 2, wait != UINT64_MAX ? &ts : NULL, NULL) == -1 && errno != EINTR)
+    {
+		perror("ERROR AT Accept poll");
+		return -1;
+	}
+	return 0;
+}
+
+int microtcp_accept_conn (microtcp_sock_t *socket, microtcp_sock_t *conn, struct sockaddr *address, socklen_t address_len)
+{
+	struct microtcp_demux *demux = socket->demux;
+	struct microtcp_half_open *half, **pprev, **oldest;
+	struct timeval timeout;
+	socklen_t timeout_len = sizeof(timeout);
+	uint64_t deadline = UINT64_MAX;
+
+	if(socket->state != LISTEN)
+    {
+		errno = EINVAL;
+		perror("ERROR AT Accept: Socket not listening");
+		return -1;
+	}
+
+	/*SO_RCVTIMEO of the listener bounds the wait for a new peer*/
+	if(getsockopt(socket->sd, SOL_SOCKET, SO_RCVTIMEO, &timeout, &timeout_len) == 0 && (timeout.tv_sec > 0 || timeout.tv_usec > 0))
+    {
+		deadline = now_us() + (uint64_t)timeout.tv_sec * 1000000 + timeout.tv_usec;
+	}
+
+	/*The oldest connection whose handshake is over, the list is newest first*/
+	for(;;)
+    {
+		if(listen_drive(socket) == -1)
+        {
+			return -1;
+		}
+
+		oldest = NULL;
+		for(pprev = &demux->half_open; *pprev != NULL; pprev = &(*pprev)->next)
+        {
+			if((*pprev)->conn.state == ESTABLISHED)
+            {
+				oldest = pprev;
+			}
+		}
+		if(oldest != NULL)
+        {
+			break;
+		}
+
+		if(listen_wait(socket, deadline) == -1)
+        {
+			return -1;
+		}
+	}
+
+	half = *oldest;
+	*oldest = half->next;
+	demux->half_open_len--;
+
+	/*The table points at conn from now on. Its slot is free again, so the
+	  insert does not grow the table and can not fail*/
+	*conn = half->conn;
+	demux_remove(demux, &conn->address);
+	demux_insert(demux, conn, &conn->address);
+	demux->refs++;
+	free(half);
+
+	memcpy(address, &conn->address, min(address_len, conn->address_len, SIZE_MAX));
+
+    /*Buffers check*/
+	if(alloc_buffers(conn) == -1)
+    {
+		errno = ENOMEM;
+		perror("ERROR AT Accept: Buffers Memory Allocation");
+		conn->state = INVALID;
+		demux_leave(conn);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+*   The FIN handshake of microtcp_shutdown(). The client sends its FIN once
+*   its data is acknowledged (FIN_WAIT), takes the ACK (CLOSING_BY_HOST),
+*   then the FIN of the server, which it acknowledges and waits in
+*   TIME_WAIT in case that ACK gets lost. The server sends its FIN after the
+*   one of the client (LAST_ACK) and is done with its ACK. Everything moves
+*   on as the connection is driven, the timer of the close sends the FIN
+*   again, backing off, or gives up.
+*/
+
+/*Whether only the FIN handshake is left of the connection*/
+static int conn_closing(const microtcp_sock_t *socket)
+{
+	return socket->state == FIN_WAIT || socket->state == CLOSING_BY_HOST || socket->state == LAST_ACK
+		|| socket->state == TIME_WAIT || socket->state == CLOSED;
+}
+
+/*Sends the FIN of this end*/
+static int close_send_fin(microtcp_sock_t *socket)
+{
+	microtcp_header_t header;
+
+	header_init(&header);
+	header.control = FIN_ACK;
+	header.seq_number = socket->fin_seq;
+	header.window = advertised_window(socket);
+	header.checksum = crc32((uint8_t*)&header, sizeof(microtcp_header_t));
+
+	if(socket->fin_tries == 0)
+    {
+		printf(socket->caller == CLIENT ? "\nSending first package (shutdown)\n" : "\nTransmiting 3rd package (shutdown)\n");
+		header_print(&header);
+		printf("\n");
+	}
+	socket->fin_tries++;
+
+	header_hton(&header);
+	return tx_queue(socket, &header, NULL, 0, 0, 0);
+}
+
+/*Acknowledges the FIN of the server, the last segment of the client*/
+static int close_send_ack(microtcp_sock_t *socket)
+{
+	microtcp_header_t header;
+
+	header_init(&header);
+	header.control = ACK;
+	header.ack_number = socket->ack_number;
+	header.seq_number = socket->fin_seq + 1;
+	header.checksum = crc32((uint8_t*)&header, sizeof(microtcp_header_t));
+
+	header_hton(&header);
+	return tx_queue(socket, &header, NULL, 0, 0, 0);
+}
+
+/*When the FIN is sent again, the RTO doubled for every one sent so far. It
+  starts from the initial RTO at least, the FIN is answered only once the
+  application of the peer drives its socket again*/
+static uint64_t close_backoff(microtcp_sock_t *socket)
+{
+	uint64_t rto = socket->rto_us > MICROTCP_ACK_TIMEOUT_US ? socket->rto_us : MICROTCP_ACK_TIMEOUT_US;
+
+	for(unsigned int i = 1; i < socket->fin_tries && rto < socket->max_rto_us; i++)
+    {
+		rto *= 2;
+	}
+	return now_us() + (rto < socket->max_rto_us ? rto : socket->max_rto_us);
+}
+
+/*Sends the FIN once microtcp_shutdown() asked for it and the data before it
+  is acknowledged. The server waits for the FIN of the client first*/
+static int close_drive(microtcp_sock_t *socket)
+{
+	if(!socket->closing || (socket->state != ESTABLISHED && socket->state != CLOSING_BY_PEER))
+    {
+		return 0;
+	}
+	if(socket->state == ESTABLISHED && (socket->caller == SERVER || socket->sndq_len > 0 || sndbuf_unsent(socket) > 0))
+    {
+		return 0;
+	}
+
+	if(socket->caller == CLIENT)
+    {
+		socket->fin_seq = (uint32_t)socket->seq_number + 1;
+		socket->state = FIN_WAIT;
+	}
+	else
+    {
+		socket->fin_seq = (rand()% (11000 - 1000 + 1)) + 1000;
+		socket->state = LAST_ACK;
+	}
+	socket->fin_tries = 0;
+	if(close_send_fin(socket) == -1)
+    {
+		perror("ERROR AT Shutdown: FIN Send");
+		socket->state = INVALID;
+		return -1;
+	}
+	socket->close_us = close_backoff(socket);
+	return 0;
+}
+
+/*Acknowledges the FIN of the server and waits in TIME_WAIT, from the start
+  again for every time it comes, in case the ACK gets lost*/
+static int close_time_wait(microtcp_sock_t *socket)
+{
+	socket->close_us = now_us() + (4 * socket->rto_us > MICROTCP_TIME_WAIT_US ? 4 * socket->rto_us : MICROTCP_TIME_WAIT_US);
+	return close_send_ack(socket);
+}
+
+/*The FIN of the server, in FIN_WAIT too when the ACK of the client's FIN got lost*/
+static int close_peer_fin(microtcp_sock_t *socket, microtcp_header_t *header)
+{
+	printf("\nRecieved 3rd package (shutdown)\n");
+	header_print(header);
+	printf("\n");
+
+	socket->ack_number = header->seq_number + 1;
+	socket->state = TIME_WAIT;
+	return close_time_wait(socket);
+}
+
+/*Takes a segment of the FIN handshake, anything else is dropped*/
+static int close_input(microtcp_sock_t *socket, microtcp_header_t *header)
+{
+	int ret = 0;
+
+	switch(socket->state)
+    {
+		case FIN_WAIT:
+			if(header->control == ACK && header->ack_number == socket->fin_seq + 1)
+            {
+				printf("\nRecieved 2nd package (shutdown)\n");
+				header_print(header);
+				printf("\n");
+				socket->state = CLOSING_BY_HOST;
+				socket->close_us = now_us() + MICROTCP_FIN_WAIT_US;
+			}
+			else if(header->control == FIN_ACK)
+            {
+				ret = close_peer_fin(socket, header);
+			}
+			break;
+		case CLOSING_BY_HOST:
+			if(header->control == FIN_ACK)
+            {
+				ret = close_peer_fin(socket, header);
+			}
+			break;
+		case TIME_WAIT:
+			/*The server did not get the last ACK, it sent its FIN again*/
+			if(header->control == FIN_ACK && header->seq_number + 1 == socket->ack_number)
+            {
+				ret = close_time_wait(socket);
+			}
+			break;
+		case LAST_ACK:
+			/*The client did not get the ACK of its FIN*/
+			if(header->control == FIN_ACK && header->seq_number + 1 == socket->ack_number)
+            {
+				ret = send_ack(socket);
+			}
+			else if(header->control == ACK && header->seq_number == socket->ack_number && header->ack_number == socket->fin_seq + 1)
+            {
+				printf("\nRecieved 4th package (shutdown)\n");
+				header_print(header);
+				printf("\n");
+				socket->state = CLOSED;
+				socket->close_us = 0;
+			}
+			break;
+		default:
+			break;
+	}
+
+	if(ret == -1)
+    {
+		perror("ERROR AT Shutdown: Send");
+		socket->state = INVALID;
+	}
+	return ret;
+}
+
+/*The timer of the close went off. The FIN goes out again, or after
+  MICROTCP_FIN_RETRIES the handshake fails, as it does when the FIN of the
+  peer never comes. TIME_WAIT is simply over*/
+static int close_timeout(microtcp_sock_t *socket)
+{
+	socket->close_us = 0;
+
+	if(socket->state == TIME_WAIT)
+    {
+		socket->state = CLOSED;
+		return 0;
+	}
+
+	if((socket->state == FIN_WAIT || socket->state == LAST_ACK) && socket->fin_tries <= MICROTCP_FIN_RETRIES)
+    {
+		if(close_send_fin(socket) == -1)
+        {
+			perror("ERROR AT Shutdown: FIN Send");
+			socket->state = INVALID;
+			return -1;
+		}
+		socket->close_us = close_backoff(socket);
+		return 0;
+	}
+
+	errno = ETIMEDOUT;
+	perror(socket->state == FIN_WAIT || socket->state == LAST_ACK ? "ERROR AT Shutdown: FIN unanswered" : "ERROR AT Shutdown: No FIN from the peer");
+	socket->state = INVALID;
+	return -1;
+}
+
+/*Releases everything a connection holds: buffers, timers, its place in the
+  demux and what is stashed for it. It takes no part in the connection any
+  more, whatever state it was left in*/
+static void conn_release(microtcp_sock_t *socket)
+{
+	free_buffers(socket);
+	demux_leave(socket);
+}
+
+int microtcp_shutdown (microtcp_sock_t *socket, int how)
+{
+	microtcp_header_t header;
+	const uint8_t *payload;
+	uint32_t crc;
+	int ret, err;
+
+	/*A listener stops taking new peers, its connections go on until their own shutdown*/
+	if(socket->state == LISTEN)
+    {
+		demux_leave(socket);
+		socket->state = CLOSED;
+		return 0;
+	}
+
+	/*A connection that failed, or never was, has no handshake left to do*/
+	if(!socket->closing && socket->state != ESTABLISHED && socket->state != CLOSING_BY_PEER)
+    {
+		conn_release(socket);
+		return 0;
+	}
+
+	if(!socket->closing)
+    {
+		/*What non-blocking sends left is delivered before the FIN, by the
+		  timers of the connection when the call does not block*/
+		if(!(how & MSG_DONTWAIT) && socket->state == ESTABLISHED && socket->sndb != NULL && (socket->sndq_len > 0 || sndbuf_unsent(socket) > 0)
+			&& send_stream(socket, socket->sndb->iov, SNDBUF_AT(socket->sndb, socket->seq_number), sndbuf_unsent(socket), 0) == -1)
+        {
+			socket->state = INVALID;
+		}
+
+		socket->closing = 1;
+		if(socket->caller == SERVER && socket->state == ESTABLISHED)
+        {
+			socket->close_us = now_us() + MICROTCP_FIN_WAIT_US;
+		}
+	}
+
+	/*The handshake waits on the peer and the timer of the close alone*/
+	while(socket->state != CLOSED && socket->state != INVALID)
+    {
+		if(conn_drive(socket) == -1)
+        {
+			socket->state = INVALID;
+			break;
+		}
+		if(socket->state == CLOSED || (how & MSG_DONTWAIT))
+        {
+			break;
+		}
+
+		ret = recv_segment(socket, &header, &payload, conn_next(socket), &crc);
+		if(ret == -1 || (ret == 1 && conn_input(socket, &header, payload, crc) == -1))
+        {
+			socket->state = INVALID;
+		}
+	}
+
+	if(socket->state != CLOSED && socket->state != INVALID)
+    {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	/*The connection is over even when the handshake failed, nothing else would release it*/
+	ret = socket->state == CLOSED ? 0 : -1;
+	err = errno;
+	conn_release(socket);
+	errno = err;
+	return ret;
+}
+
+/**
+*   DATA TRANSFER helpers
+*/
+
+/*Position of a sequence number inside the circular receive buffer*/
+#define RECVBUF_AT(socket, seq) ((uint32_t)(seq) & ((socket)->recvbuf_len - 1))
+
+/*Hands every batched segment to the kernel*/
+static int tx_flush(microtcp_sock_t *socket)
+{
+    struct microtcp_tx_batch *batch = socket->txb;
+    unsigned int sent = 0, calls = 0;
+    int ret;
+
+    while(sent < batch->len)
+    {
+        ret = socket->uring != NULL ? uring_sendmmsg(socket->uring, batch->msgs + sent, batch->len - sent, batch->zerocopy ? MSG_ZEROCOPY : 0)
+            : sendmmsg(socket->sd, batch->msgs + sent, batch->len - sent, batch->zerocopy ? MSG_ZEROCOPY : 0);
+        if(ret == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            /*A path MTU probe larger than the interface takes, only the probe is lost*/
+            if(errno == EMSGSIZE && (int)sent == batch->probe)
+            {
+                plpmtu_too_big(socket);
+                sent++;
+                continue;
+            }
+            perror("ERROR AT Segment batch transmition");
+            batch->len = 0;
+            batch->segments = 0;
+            batch->iov_used = 0;
+            batch->probe = -1;
+            return -1;
+        }
+        sent += ret;
+        calls++;
+        if(batch->zerocopy)
+        {
+            socket->zc_sent += ret;
+        }
+    }
+
+    socket->tx_syscalls_saved += batch->segments - calls;
+    batch->len = 0;
+    batch->segments = 0;
+    batch->iov_used = 0;
+    batch->probe = -1;
+    return 0;
+}
+
+/*Whether a segment of seg_len bytes can go on the run of the last message of the batch*/
+static int tx_extends_run(microtcp_sock_t *socket, size_t seg_len)
+{
+    struct microtcp_tx_batch *batch = socket->txb;
+    unsigned int last = batch->len - 1;
+
+    return socket->offload && batch->len > 0
+        && batch->run_last_len[last] == batch->run_seg_len[last]
+        && seg_len <= batch->run_seg_len[last]
+        && batch->run_segs[last] < GSO_MAX_SEGS
+        && batch->run_bytes[last] + seg_len <= GSO_MAX_BYTES;
+}
+
+/**
+*   Adds a segment, header in network byte order, to the batch. The payload is
+*   data_len bytes starting at offset of the iovec payload. A full batch is flushed.
+*   Zero-copy segments go in batches of their own, and reference the header in
+*   place as the kernel may read it after sendmmsg() returns.
+*/
+static int tx_queue(microtcp_sock_t *socket, const microtcp_header_t *header, const struct iovec *payload, size_t offset, size_t data_len, int zerocopy)
+{
+    struct microtcp_tx_batch *batch = socket->txb;
+    size_t seg_len = sizeof(microtcp_header_t) + data_len;
+    struct mmsghdr *msg;
+    struct cmsghdr *cmsg;
+    struct iovec *iov;
+    unsigned int m;
+    size_t take;
+
+    if((batch->segments == MICROTCP_TX_BATCH || (batch->len > 0 && batch->zerocopy != zerocopy)) && tx_flush(socket) == -1)
+    {
+        return -1;
+    }
+
+    batch->zerocopy = zerocopy;
+    batch->headers[batch->segments] = *header;
+
+    /*The iovecs of a message are contiguous, so a run grows at the tail of the array*/
+    if(tx_extends_run(socket, seg_len))
+    {
+        m = batch->len - 1;
+        msg = &batch->msgs[m];
+        batch->run_segs[m]++;
+        batch->run_bytes[m] += seg_len;
+        batch->run_last_len[m] = seg_len;
+
+        if(batch->run_segs[m] == 2)
+        {
+            msg->msg_hdr.msg_control = batch->control[m].buf;
+            msg->msg_hdr.msg_controllen = sizeof(batch->control[m].buf);
+            cmsg = CMSG_FIRSTHDR(&msg->msg_hdr);
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            *(uint16_t*)CMSG_DATA(cmsg) = batch->run_seg_len[m];
+        }
+    }
+    else
+    {
+        m = batch->len++;
+        msg = &batch->msgs[m];
+        memset(msg, 0, sizeof(struct mmsghdr));
+        msg->msg_hdr.msg_name = &socket->address;
+        msg->msg_hdr.msg_namelen = socket->address_len;
+        msg->msg_hdr.msg_iov = &batch->iov[batch->iov_used];
+        batch->run_segs[m] = 1;
+        batch->run_bytes[m] = seg_len;
+        batch->run_seg_len[m] = seg_len;
+        batch->run_last_len[m] = seg_len;
+    }
+
+    iov = &batch->iov[batch->iov_used];
+    iov->iov_base = zerocopy ? (void*)header : &batch->headers[batch->segments];
+    iov->iov_len = sizeof(microtcp_header_t);
+    iov++;
+
+    while(data_len > 0)
+    {
+        take = min(payload->iov_len - offset, data_len, SIZE_MAX);
+        if(take > 0)
+        {
+            iov->iov_base = (uint8_t*)payload->iov_base + offset;
+            iov->iov_len = take;
+            iov++;
+            data_len -= take;
+        }
+        payload++;
+        offset = 0;
+    }
+
+    msg->msg_hdr.msg_iovlen += iov - &batch->iov[batch->iov_used];
+    batch->iov_used = iov - batch->iov;
+    batch->segments++;
+    return 0;
+}
+
+/**
+*   PACING
+*   Segments leave no faster than the pacing rate. A quantum of bytes may go
+*   back to back, so a fast path is not slowed down by one wake up per
+*   segment. Gaps up to MICROTCP_PACING_SPIN_US are spun away, longer ones
+*   are slept until the pacing timer goes off.
+*/
+
+/*The lower of the congestion control's rate and the caller's cap, 0 for no pacing*/
+static uint64_t pacing_rate(microtcp_sock_t *socket)
+{
+    if(socket->pacing_rate == 0 || (socket->max_pacing_rate != 0 && socket->max_pacing_rate < socket->pacing_rate))
+    {
+        return socket->max_pacing_rate;
+    }
+    return socket->pacing_rate;
+}
+
+/*Microseconds until the next segment may leave, 0 if it may leave now*/
+static uint64_t pacing_delay(microtcp_sock_t *socket)
+{
+    uint64_t now;
+
+    if(pacing_rate(socket) == 0)
+    {
+        return 0;
+    }
+
+    now = now_us();
+    return socket->pacing_next_us > now ? socket->pacing_next_us - now : 0;
+}
+
+/*Charges len bytes on the wire to the pacing schedule*/
+static void pacing_charge(microtcp_sock_t *socket, size_t len)
+{
+    uint64_t rate = pacing_rate(socket);
+    uint64_t seg_len = sizeof(microtcp_header_t) + socket->mss;
+    uint64_t now, quantum, burst_us;
+
+    if(rate == 0)
+    {
+        return;
+    }
+
+    /*An idle sender gets back at most one quantum of credit*/
+    quantum = socket->pacing_quantum;
+    if(quantum == 0)
+    {
+        quantum = rate / 1000 > 2 * seg_len ? rate / 1000 : 2 * seg_len;
+    }
+    burst_us = quantum * 1000000 / rate;
+
+    now = now_us();
+    if(socket->pacing_next_us + burst_us < now)
+    {
+        socket->pacing_next_us = now - burst_us;
+    }
+    socket->pacing_next_us += len * 1000000 / rate;
+}
+
+/*Queues a segment of the retransmission queue with the given header, the one
+  of the segment or a copy rewritten for a retransmission*/
+static int queue_segment(microtcp_sock_t *socket, microtcp_segment_t *segment, const microtcp_header_t *header, int zerocopy)
+{
+    if(tx_queue(socket, header, segment->iov, segment->iov_offset, segment->data_len, zerocopy) == -1)
+    {
+        return -1;
+    }
+
+    segment->sent_time_us = now_us();
+    /*Nothing else in flight, the retransmission timer starts now (RFC 6298 5.1)*/
+    if(socket->sndq_len == 1)
+    {
+        socket->rto_deadline_us = segment->sent_time_us + socket->rto_us;
+    }
+    pacing_charge(socket, sizeof(microtcp_header_t) + segment->data_len);
+    segment->delivered = socket->delivered;
+    segment->delivered_time_us = socket->sndq_len == 1 || socket->delivered_time_us == 0 ? segment->sent_time_us : socket->delivered_time_us;
+    segment->app_limited = socket->app_limited != 0;
+    socket->packets_send++;
+    socket->bytes_send += segment->data_len;
+    return 0;
+}
+
+static int transmit_segment(microtcp_sock_t *socket, microtcp_segment_t *segment)
+{
+    return queue_segment(socket, segment, &segment->header, socket->zc_active);
+}
+
+/*The checksum of a segment, the CRC-32 of its header in host byte order with
+  the checksum taken as 0, followed by the len bytes of payload at offset of iov*/
+static uint32_t segment_crc32(const microtcp_header_t *header, const struct iovec *iov, size_t offset, size_t len)
+{
+    microtcp_header_t h = *header;
+    uint32_t crc;
+    size_t take;
+
+    h.checksum = 0;
+    crc = update_crc32(0xffffffff, (const uint8_t*)&h, sizeof(microtcp_header_t));
+    while(len > 0)
+    {
+        take = min(iov->iov_len - offset, len, SIZE_MAX);
+        crc = update_crc32(crc, (const uint8_t*)iov->iov_base + offset, take);
+        len -= take;
+        iov++;
+        offset = 0;
+    }
+    return crc ^ 0xffffffff;
+}
+
+/*Queues a header only segment, a pure ACK or a zero window probe*/
+static int send_control(microtcp_sock_t *socket, uint16_t control)
+{
+    microtcp_header_t header;
+    size_t i;
+
+    header_init(&header);
+    header.control = control;
+    header.seq_number = socket->seq_number;
+    header.ack_number = socket->ack_number;
+    header.window = advertised_window(socket);
+
+    /*Echo the timestamp of the segment this ACK answers*/
+    if((control & ACK) && (socket->options & MICROTCP_OPT_TIMESTAMPS))
+    {
+        header.future_use0 = socket->ts_recent;
+    }
+
+    /*SACK block. The header has room for one, so the range of the latest out of
+      order segment alternates with the others in turn, and the sender learns
+      every hole within a few ACKs*/
+    if((control & ACK) && (socket->options & MICROTCP_OPT_SACK) && socket->ooo_len > 0)
+    {
+        if(socket->sack_turn % 2 == 0)
+        {
+            for(i = socket->ooo_len - 1; i > 0; i--)
+            {
+                if(SEQ_LEQ(socket->ooo[i].start, socket->ooo_recent) && SEQ_LT(socket->ooo_recent, socket->ooo[i].end))
+                {
+                    break;
+                }
+            }
+        }
+        else
+        {
+            i = (socket->sack_turn / 2) % socket->ooo_len;
+        }
+        socket->sack_turn++;
+        header.future_use1 = socket->ooo[i].start;
+        header.future_use2 = socket->ooo[i].end;
+    }
+    header.checksum = crc32((uint8_t*)&header, sizeof(microtcp_header_t));
+    header_hton(&header);
+
+    return tx_queue(socket, &header, NULL, 0, 0, 0);
+}
+
+/*Acknowledges every segment received so far, the ones delayed included*/
+static int send_ack(microtcp_sock_t *socket)
+{
+    if(socket->ack_pending > 1)
+    {
+        socket->acks_saved += socket->ack_pending - 1;
+    }
+    socket->ack_pending = 0;
+    return send_control(socket, ACK);
+}
+
+/*Answers a path MTU probe of size bytes*/
+static int send_probe_ack(microtcp_sock_t *socket, size_t size)
+{
+    microtcp_header_t header;
+
+    header_init(&header);
+    header.control = PROBE_ACK;
+    header.seq_number = socket->seq_number;
+    header.ack_number = socket->ack_number;
+    header.window = advertised_window(socket);
+    header.future_use1 = size;
+    header.future_use2 = size;
+    header.checksum = crc32((uint8_t*)&header, sizeof(microtcp_header_t));
+    header_hton(&header);
+
+    return tx_queue(socket, &header, NULL, 0, 0, 0);
+}
+
+/*The SYN_ACK of the peer once more, so the ACK that ended the handshake got
+  lost and the peer waits for it before sending anything of its own*/
+static int send_handshake_ack(microtcp_sock_t *socket, const microtcp_header_t *syn_ack)
+{
+    microtcp_header_t header;
+
+    if(socket->caller != CLIENT || syn_ack->seq_number + 1 != socket->ack_number || syn_ack->ack_number != socket->snd_una)
+    {
+        return 0;
+    }
+
+    header_init(&header);
+    header.control = ACK;
+    header.seq_number = socket->snd_una;
+    header.ack_number = socket->ack_number;
+    header.window = advertised_window(socket);
+    header.checksum = crc32((uint8_t*)&header, sizeof(microtcp_header_t));
+    header_hton(&header);
+
+    return tx_queue(socket, &header, NULL, 0, 0, 0);
+}
+
+/**
+*   PATH MTU DISCOVERY (RFC 8899)
+*   While there is data to send, a probe padded past the MSS goes out now and
+*   then. When the peer answers it the MSS grows to its size, a size lost
+*   MICROTCP_PLPMTU_PROBES times is given up. The search halves the range
+*   between what is known to get through and the max_mss of the two ends.
+*/
+
+/*Padding of the probes, the peer never reads it*/
+static uint8_t probe_pad[MICROTCP_MAX_MSS];
+
+/*Done with the probe size, the search goes on right away or, once the
+  bounds meet, starts over after MICROTCP_PLPMTU_RAISE_US*/
+static void plpmtu_next(microtcp_sock_t *socket, uint64_t now)
+{
+    microtcp_plpmtu_t *p = &socket->plpmtu;
+
+    p->probe = 0;
+    p->attempts = 0;
+    p->next_us = p->high < p->low + MICROTCP_PLPMTU_STEP ? now + MICROTCP_PLPMTU_RAISE_US : now;
+}
+
+/*Sends a probe when one is due. Returns -1 on error*/
+static int plpmtu_probe(microtcp_sock_t *socket)
+{
+    microtcp_plpmtu_t *p = &socket->plpmtu;
+    struct microtcp_tx_batch *batch = socket->txb;
+    microtcp_header_t header;
+    struct iovec iov;
+    uint64_t now = now_us();
+
+    if(p->probe != 0 && now < p->sent_us + socket->rto_us)
+    {
+        return 0;
+    }
+
+    /*Not answered in time, the probe is lost*/
+    if(p->probe != 0 && ++p->attempts == MICROTCP_PLPMTU_PROBES)
+    {
+        p->high = p->probe - 1;
+        plpmtu_next(socket, now);
+    }
+
+    if(p->probe == 0)
+    {
+        if(now < p->next_us)
+        {
+            return 0;
+        }
+
+        /*The search is over, see whether the path has grown since*/
+        if(p->high < p->low + MICROTCP_PLPMTU_STEP)
+        {
+            p->high = p->max;
+        }
+        if(p->high < p->low + MICROTCP_PLPMTU_STEP)
+        {
+            p->next_us = now + MICROTCP_PLPMTU_RAISE_US;
+            return 0;
+        }
+        p->probe = p->low + (p->high - p->low + 1) / 2;
+    }
+
+    header_init(&header);
+    header.control = PROBE;
+    header.seq_number = socket->seq_number;
+    header.ack_number = socket->ack_number;
+    header.window = advertised_window(socket);
+    header.data_len = p->probe;
+    iov.iov_base = probe_pad;
+    iov.iov_len = p->probe;
+    header.checksum = segment_crc32(&header, &iov, 0, p->probe);
+    header_hton(&header);
+
+    /*Queued behind the segments already batched, in a message of its own so
+      that nothing else is refused with it*/
+    p->sent_us = now;
+    if(tx_queue(socket, &header, &iov, 0, p->probe, 0) == -1)
+    {
+        return -1;
+    }
+    batch->run_segs[batch->len - 1] = GSO_MAX_SEGS;
+    batch->probe = batch->len - 1;
+    return 0;
+}
+
+/*The probe in flight is larger than the interface takes*/
+static void plpmtu_too_big(microtcp_sock_t *socket)
+{
+    if(socket->plpmtu.probe == 0)
+    {
+        return;
+    }
+    socket->plpmtu.high = socket->plpmtu.probe - 1;
+    plpmtu_next(socket, now_us());
+}
+
+/*The peer got a probe of size bytes, segments that large get through*/
+static void plpmtu_probe_acked(microtcp_sock_t *socket, size_t size)
+{
+    microtcp_plpmtu_t *p = &socket->plpmtu;
+
+    /*A late answer to a probe given up*/
+    if(p->probe == 0 || size != p->probe)
+    {
+        return;
+    }
+
+    p->low = size;
+    socket->mss = size;
+    plpmtu_next(socket, now_us());
+}
+
+static microtcp_segment_t *sndq_at(microtcp_sock_t *socket, size_t i)
+{
+    return &socket->sndq[(socket->sndq_head + i) & (socket->sndq_cap - 1)];
+}
+
+/*Appends a slot at the tail of the retransmission queue, growing the ring if it is full*/
+static microtcp_segment_t *sndq_push(microtcp_sock_t *socket)
+{
+    microtcp_segment_t *ring;
+
+    if(socket->sndq_len == socket->sndq_cap)
+    {
+        /*Zero-copy sends still reference the headers of the old ring*/
+        if(socket->zc_active && (tx_flush(socket) == -1 || zc_wait(socket) == -1))
+        {
+            return NULL;
+        }
+
+        ring = (microtcp_segment_t*) malloc(2 * socket->sndq_cap * sizeof(microtcp_segment_t));
+        if(ring == NULL)
+        {
+            return NULL;
+        }
+        socket->heap_allocs++;
+
+        for(size_t i = 0; i < socket->sndq_len; i++)
+        {
+            ring[i] = *sndq_at(socket, i);
+        }
+
+        free(socket->sndq);
+        socket->sndq = ring;
+        socket->sndq_cap *= 2;
+        socket->sndq_head = 0;
+    }
+
+    socket->sndq_len++;
+    return sndq_at(socket, socket->sndq_len - 1);
+}
+
+static void sndq_pop(microtcp_sock_t *socket)
+{
+    socket->sndq_head = (socket->sndq_head + 1) & (socket->sndq_cap - 1);
+    socket->sndq_len--;
+}
+
+/**
+*   TIMERS
+*   The timers of a connection are on the wheel of the thread, see
+*   microtcp_timer.c. They follow the deadlines of the connection, which are
+*   still what conn_timers() goes by, and only wake up whoever waits on it.
+*/
+
+/*Arms the delayed ACK, retransmission, window probe and close timers for the
+  deadlines of the connection, and stops the ones it has no use for. Once
+  only the FIN handshake is left, the one of the close is all it needs*/
+static void conn_arm(microtcp_sock_t *socket)
+{
+    struct microtcp_timer *timers = socket->timers;
+
+    if(timers == NULL)
+    {
+        return;
+    }
+
+    if(socket->ack_pending > 0 && !conn_closing(socket))
+    {
+        timer_arm(&timers[TIMER_DELACK], socket->ack_deadline_us);
+    }
+    else
+    {
+        timer_cancel(&timers[TIMER_DELACK]);
+    }
+
+    if(socket->sndq_len > 0 && !conn_closing(socket))
+    {
+        timer_arm(&timers[TIMER_RTO], socket->rto_deadline_us);
+    }
+    else
+    {
+        timer_cancel(&timers[TIMER_RTO]);
+    }
+
+    if(socket->persist_us != 0 && !conn_closing(socket))
+    {
+        timer_arm(&timers[TIMER_PERSIST], socket->persist_us);
+    }
+    else
+    {
+        timer_cancel(&timers[TIMER_PERSIST]);
+    }
+
+    if(socket->close_us != 0)
+    {
+        timer_arm(&timers[TIMER_CLOSE], socket->close_us);
+    }
+    else
+    {
+        timer_cancel(&timers[TIMER_CLOSE]);
+    }
+}
+
+/*Stops every timer of the connection*/
+static void conn_disarm(microtcp_sock_t *socket)
+{
+    if(socket->timers == NULL)
+    {
+        return;
+    }
+    for(int i = 0; i < TIMER_COUNT; i++)
+    {
+        timer_cancel(&socket->timers[i]);
+    }
+    socket->timers_due = 0;
+}
+
+/**
+*   Validates a single segment of len bytes at buf and keeps it in the ring.
+*   The checksum of a segment with payload is only started here, over the
+*   header. It is finished over the payload by whoever takes the segment, so
+*   the payload can be checked while it is copied to its destination.
+*/
+static void rx_keep(struct microtcp_rx_ring *ring, uint8_t *buf, size_t len)
+{
+    microtcp_header_t *header = &ring->headers[ring->len];
+    uint32_t checksum;
+
+    if(len < sizeof(microtcp_header_t) || ring->len == RX_SEGMENTS)
+    {
+        return;
+    }
+
+    memcpy(header, buf, sizeof(microtcp_header_t));
+    header_ntoh(header);
+
+    /*The datagram is the segment, so the length the kernel reports vouches for data_len*/
+    if(header->data_len != len - sizeof(microtcp_header_t))
+    {
+        return;
+    }
+
+    if(header->data_len == 0)
+    {
+        if(!check_sum(header))
+        {
+            return;
+        }
+    }
+    else
+    {
+        checksum = header->checksum;
+        header->checksum = 0;
+        ring->crcs[ring->len] = update_crc32(0xffffffff, (const uint8_t*)header, sizeof(microtcp_header_t));
+        header->checksum = checksum;
+    }
+
+    ring->payloads[ring->len] = buf + sizeof(microtcp_header_t);
+    ring->len++;
+}
+
+/*A datagram of len bytes cut short by the slots. If it is a path MTU probe,
+  only its size matters, and the kernel reports it, so it is answered as if
+  it had fit. The probes of a search going up do not get lost one by one*/
+static int rx_probe(microtcp_sock_t *socket, const uint8_t *buf, size_t len)
+{
+    microtcp_header_t header;
+
+    memcpy(&header, buf, sizeof(microtcp_header_t));
+    header_ntoh(&header);
+    if(header.control != PROBE || header.data_len != len - sizeof(microtcp_header_t))
+    {
+        return 0;
+    }
+    return send_probe_ack(socket, header.data_len);
+}
+
+/*The peer sends segments larger than the slots, the path MTU went up. The
+  slots grow to the largest datagram that did not fit, the ones that did not
+  are lost and sent again*/
+static int rx_grow(microtcp_sock_t *socket)
+{
+    struct microtcp_rx_ring *ring = socket->rxr;
+    uint8_t *slab;
+
+    slab = (uint8_t*) malloc(ring->nslots * ring->want_len);
+    if(slab == NULL)
+    {
+        perror("ERROR AT Receive ring Memory Allocation");
+        return -1;
+    }
+    socket->heap_allocs++;
+
+    free(ring->slab);
+    ring->slab = slab;
+    ring->slot_len = ring->want_len;
+    ring->want_len = 0;
+    for(unsigned int i = 0; i < ring->nslots; i++)
+    {
+        ring->slots[i] = slab + i * ring->slot_len;
+    }
+
+    /*The buffers of the io_uring have the size of the slots too*/
+    if(socket->uring != NULL)
+    {
+        uring_close(socket->uring);
+        socket->uring = NULL;
+        setup_uring(socket);
+    }
+    return 0;
+}
+
+/**
+*   Pulls as many datagrams as are queued on the socket, up to one per slot,
+*   with one recvmmsg() and keeps the valid segments in the ring. A socket of
+*   a demux first takes what was stashed for it, and hands the segments of
+*   other peers to their own socket.
+*   Returns the number of valid segments, which may be 0, or -1 on error.
+*/
+static int rx_fill(microtcp_sock_t *socket)
+{
+    struct microtcp_rx_ring *ring = socket->rxr;
+    struct microtcp_dgram *dgram;
+    struct cmsghdr *cmsg;
+    microtcp_sock_t *owner = socket;
+    unsigned int datagrams = 0;
+    uint8_t *slot;
+    size_t gso_size, len;
+    size_t max_len = sizeof(microtcp_header_t) + (socket->max_mss > socket->mss ? socket->max_mss : socket->mss);
+    int ret;
+
+    ring->head = 0;
+    ring->len = 0;
+
+    /*Segments the other sockets of the demux read for this one come first*/
+    if(socket->demux != NULL)
+    {
+        stash_free(socket->demux, socket->stash_held);
+        socket->stash_held = NULL;
+
+        while(socket->stash != NULL && ring->len < RX_SEGMENTS)
+        {
+            dgram = stash_pop(socket);
+            dgram->next = socket->stash_held;
+            socket->stash_held = dgram;
+            rx_keep(ring, dgram->data, dgram->len);
+        }
+        if(ring->len > 0)
+        {
+            return ring->len;
+        }
+    }
+
+    if(ring->want_len > ring->slot_len && rx_grow(socket) == -1)
+    {
+        return -1;
+    }
+
+    for(unsigned int i = 0; i < ring->nslots; i++)
+    {
+        ring->iov[i].iov_base = ring->slots[i];
+        ring->iov[i].iov_len = ring->slot_len;
+        memset(&ring->msgs[i], 0, sizeof(struct mmsghdr));
+        ring->msgs[i].msg_hdr.msg_iov = &ring->iov[i];
+        ring->msgs[i].msg_hdr.msg_iovlen = 1;
+        if(socket->offload)
+        {
+            ring->msgs[i].msg_hdr.msg_control = ring->control[i].buf;
+            ring->msgs[i].msg_hdr.msg_controllen = sizeof(ring->control[i].buf);
+        }
+        if(socket->demux != NULL)
+        {
+            ring->msgs[i].msg_hdr.msg_name = &ring->names[i];
+            ring->msgs[i].msg_hdr.msg_namelen = sizeof(ring->names[i]);
+        }
+    }
+
+    /*The ring points the iovecs at the buffers it received into*/
+    do
+    {
+        ret = socket->uring != NULL ? uring_recvmmsg(socket->uring, ring->msgs, ring->nslots)
+            : recvmmsg(socket->sd, ring->msgs, ring->nslots, MSG_DONTWAIT | MSG_TRUNC, NULL);
+    } while(ret == -1 && errno == EINTR);
+
+    if(ret == -1)
+    {
+        if(errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            return 0;
+        }
+        perror("ERROR AT Segment batch download");
+        return -1;
+    }
+
+    /*Validate the whole batch, silently dropping anything that is not a valid microTCP segment*/
+    for(int i = 0; i < ret; i++)
+    {
+        slot = ring->iov[i].iov_base;
+        len = ring->msgs[i].msg_len;
+        gso_size = len;
+
+        /*A coalesced super-datagram, made of gso_size segments and maybe a shorter last one*/
+        for(cmsg = socket->offload ? CMSG_FIRSTHDR(&ring->msgs[i].msg_hdr) : NULL; cmsg != NULL; cmsg = CMSG_NXTHDR(&ring->msgs[i].msg_hdr, cmsg))
+        {
+            if(cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+            {
+                gso_size = *(int*)CMSG_DATA(cmsg);
+            }
+        }
+
+        /*A datagram of another connection of the demux is handed over to it*/
+        if(socket->demux != NULL)
+        {
+            owner = demux_lookup(socket->demux, (struct sockaddr*)&ring->names[i]);
+        }
+
+        /*Cut short, len is the length of the whole datagram. The slots grow
+          before the next batch, up to the largest segment that is valid*/
+        if(ring->msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+        {
+            if(len > max_len)
+            {
+                continue;
+            }
+            if(len > ring->want_len)
+            {
+                ring->want_len = len;
+            }
+            if(owner == socket && rx_probe(socket, slot, len) == -1)
+            {
+                return -1;
+            }
+            continue;
+        }
+
+        for(size_t off = 0; off < len; off += gso_size)
+        {
+            if(owner == socket)
+            {
+                rx_keep(ring, slot + off, min(gso_size, len - off, SIZE_MAX));
+            }
+            else
+            {
+                demux_deliver(socket->demux, owner, slot + off, min(gso_size, len - off, SIZE_MAX), (struct sockaddr*)&ring->names[i], ring->msgs[i].msg_hdr.msg_namelen);
+            }
+            datagrams++;
+        }
+    }
+
+    /*The ring takes them with no system call at all*/
+    if(datagrams > 0)
+    {
+        socket->rx_syscalls_saved += socket->uring != NULL ? datagrams : datagrams - 1;
+    }
+
+    return ring->len;
+}
+
+/**
+*   Flushes any batched segments and then waits up to timeout_us (forever if
+*   negative) for a valid segment, or until a timer of the connection goes
+*   off. The timers of the other connections of the thread that go off in
+*   the meantime are left to them.
+*   The header is returned in host byte order, the payload stays in the receive
+*   ring and is valid until the next call.
+*   The payload is checked too, unless crc is set. It then gets the CRC-32 of
+*   the header, the caller goes on with update_crc32() over the payload and
+*   drops the segment if the result, inverted, is not header->checksum.
+*   Returns 1 if a segment was received, 0 on timeout or with timers_due set
+*   and -1 on error.
+*/
+static int recv_segment(microtcp_sock_t *socket, microtcp_header_t *header, const uint8_t **payload, int64_t timeout_us, uint32_t *crc)
+{
+    struct microtcp_rx_ring *ring = socket->rxr;
+    struct pollfd pfd[2] = { { .fd = microtcp_fd(socket), .events = POLLIN }, { .fd = -1, .events = POLLIN } };
+    struct timespec ts;
+    uint64_t deadline = timeout_us >= 0 ? now_us() + timeout_us : UINT64_MAX;
+    uint64_t now, wait;
+    int ret;
+
+    if(tx_flush(socket) == -1)
+    {
+        return -1;
+    }
+
+    for(;;)
+    {
+        while(ring->head == ring->len)
+        {
+            ret = rx_fill(socket);
+            if(ret == -1)
+            {
+                return -1;
+            }
+            if(ret > 0)
+            {
+                break;
+            }
+
+            now = now_us();
+            wait = deadline;
+
+            /*The timerfd of the thread wakes up the connections that have timers*/
+            if(socket->timers != NULL)
+            {
+                timer_expire(now);
+                if(socket->timers_due != 0)
+                {
+                    return 0;
+                }
+                pfd[1].fd = timer_fd(now);
+                if(pfd[1].fd < 0 && timer_next() < wait)
+                {
+                    wait = timer_next();
+                }
+            }
+
+            if(now >= deadline)
+            {
+                return 0;
+            }
+            if(wait != UINT64_MAX)
+            {
+                ts.tv_sec = (wait - now) / 1000000;
+                ts.tv_nsec = ((wait - now) % 1000000) * 1000;
+            }
+
+            ret = ppoll(pfd, 2, wait != UINT64_MAX ? &ts : NULL, NULL);
+            if(ret == -1 && errno != EINTR)
+            {
+                perror("ERROR AT Segment poll");
+                return -1;
+            }
+
+            /*Zero-copy completions wake us up through the error queue*/
+            if(ret > 0 && (pfd[0].revents & POLLERR) && zc_reap(socket) == -1)
+            {
+                return -1;
+            }
+        }
+
+        *header = ring->headers[ring->head];
+        *payload = ring->payloads[ring->head];
+        ring->head++;
+
+        if(crc != NULL)
+        {
+            *crc = ring->crcs[ring->head - 1];
+            return 1;
+        }
+        if(header->data_len == 0 || (update_crc32(ring->crcs[ring->head - 1], *payload, header->data_len) ^ 0xffffffff) == header->checksum)
+        {
+            return 1;
+        }
+        /*A corrupted payload, dropped like any invalid segment*/
+    }
+}
+
+/*Resends a segment of the retransmission queue that is considered lost*/
+static int retransmit_segment(microtcp_sock_t *socket, microtcp_segment_t *segment)
+{
+    microtcp_header_t header;
+
+    segment->retransmissions++;
+    socket->packets_lost++;
+    socket->bytes_lost += segment->data_len;
+
+    if(!(socket->options & MICROTCP_OPT_TIMESTAMPS))
+    {
+        return transmit_segment(socket, segment);
+    }
+
+    /*A fresh timestamp, so the echo measures this transmission and not the first one.
+      It goes in a copy that the batch sends from, a zero-copy send of the first
+      transmission may still be reading the header of the segment*/
+    header = segment->header;
+    header_ntoh(&header);
+    header.future_use0 = (uint32_t)now_us();
+    header.checksum = segment_crc32(&header, segment->iov, segment->iov_offset, segment->data_len);
+    header_hton(&header);
+    return queue_segment(socket, segment, &header, 0);
+}
+
+/*Smooths an RTT sample into SRTT and RTTVAR and computes the RTO from them (RFC 6298)*/
+static void rtt_update(microtcp_sock_t *socket, uint64_t rtt_us)
+{
+    uint64_t delta;
+
+    if(socket->srtt_us == 0)
+    {
+        socket->srtt_us = rtt_us;
+        socket->rttvar_us = rtt_us / 2;
+    }
+    else
+    {
+        delta = socket->srtt_us > rtt_us ? socket->srtt_us - rtt_us : rtt_us - socket->srtt_us;
+        socket->rttvar_us = (3 * socket->rttvar_us + delta) / 4;
+        socket->srtt_us = (7 * socket->srtt_us + rtt_us) / 8;
+    }
+
+    /*A zero sample would look like no sample at all*/
+    if(socket->srtt_us == 0)
+    {
+        socket->srtt_us = 1;
+    }
+
+    socket->rto_us = socket->srtt_us + (socket->rttvar_us > 0 ? 4 * socket->rttvar_us : 1);
+    if(socket->rto_us < socket->min_rto_us)
+    {
+        socket->rto_us = socket->min_rto_us;
+    }
+    if(socket->rto_us > socket->max_rto_us)
+    {
+        socket->rto_us = socket->max_rto_us;
+    }
+}
+
+/*Resends the segments lost in the current recovery that were not resent yet:
+  the oldest one, and every one before the highest SACKed data that the peer
+  does not hold*/
+static int resend_holes(microtcp_sock_t *socket)
+{
+    microtcp_segment_t *segment;
 
-    if(sock.sd == -1) 
+    for(size_t i = 0; i < socket->sndq_len; i++)
     {
-        perror("ERROR AT: Creation of socket");
-        sock.state = INVALID;
+        segment = sndq_at(socket, i);
+        if(i > 0 && SEQ_GEQ(segment->seq_number, socket->sack_high))
+        {
+            break;
+        }
+        if(segment->sacked || SEQ_LT(segment->seq_number, socket->high_rxt))
+        {
+            continue;
+        }
+
+        if(retransmit_segment(socket, segment) == -1)
+        {
+            return -1;
+        }
+        socket->high_rxt = segment->seq_number + segment->data_len;
+    }
+    return 0;
+}
+
+/**
+*   Handles an ACK of the peer. Releases every segment of the retransmission
+*   queue covered by the cumulative ACK, records the SACK block and updates
+*   cwnd through the congestion control of the socket, with fast retransmit
+*   on the third duplicate ACK and NewReno fast recovery. Partial ACKs after
+*   a timeout resend the next hole as well.
+*   unsent is the data of the caller not yet transmitted. Without it a short
+*   flight can not produce three duplicates, so fewer are enough (early
+*   retransmit, RFC 5827).
+*   New data acknowledged also gives an RTT sample, from the echoed timestamp
+*   or else, following Karn's rule, from a segment that was never resent.
+*   Returns -1 if a retransmission fails.
+*/
+static int process_ack(microtcp_sock_t *socket, microtcp_header_t *header, size_t unsent)
+{
+    microtcp_segment_t *segment;
+    microtcp_rate_sample_t rs;
+    size_t acked, dupthresh, window;
+    uint64_t now, rtt_us = 0;
+    int window_update;
+
+    if(SEQ_LT(header->ack_number, socket->snd_una) || SEQ_GT(header->ack_number, socket->seq_number))
+    {
+        return 0;
+    }
+
+    now = now_us();
+    memset(&rs, 0, sizeof(rs));
+    acked = (uint32_t)(header->ack_number - socket->snd_una);
+    while(socket->sndq_len > 0)
+    {
+        segment = sndq_at(socket, 0);
+        if(SEQ_GT(segment->seq_number + segment->data_len, header->ack_number))
+        {
+            break;
+        }
+        if(segment->retransmissions == 0)
+        {
+            rtt_us = now - segment->sent_time_us;
+        }
+        rs.prior_delivered = segment->delivered;
+        rs.interval_us = now - segment->delivered_time_us;
+        rs.is_app_limited = segment->app_limited;
+        sndq_pop(socket);
+    }
+
+    if(acked > 0 && (socket->options & MICROTCP_OPT_TIMESTAMPS) && header->future_use0 != 0)
+    {
+        rtt_us = (uint32_t)((uint32_t)now - header->future_use0);
+    }
+    if(acked > 0 && rtt_us > 0)
+    {
+        rtt_update(socket, rtt_us);
+        if(socket->cc->on_rtt_sample != NULL)
+        {
+            socket->cc->on_rtt_sample(socket, rtt_us);
+        }
+    }
+
+    /*New data acknowledged restarts the retransmission timer (RFC 6298 5.3)*/
+    if(acked > 0)
+    {
+        socket->rto_deadline_us = now + socket->rto_us;
+    }
+
+    /*Delivery rate over the newest segment acknowledged*/
+    if(acked > 0)
+    {
+        socket->delivered += acked;
+        socket->delivered_time_us = now;
+        if(socket->app_limited != 0 && socket->delivered > socket->app_limited)
+        {
+            socket->app_limited = 0;
+        }
+
+        if(socket->cc->on_rate_sample != NULL && rs.interval_us > 0 && socket->delivered > rs.prior_delivered)
+        {
+            rs.delivered = socket->delivered - rs.prior_delivered;
+            rs.rtt_us = rtt_us;
+            socket->cc->on_rate_sample(socket, &rs);
+        }
+    }
+
+    socket->snd_una = header->ack_number;
+    if(SEQ_LT(socket->sack_high, socket->snd_una))
+    {
+        socket->sack_high = socket->snd_una;
+    }
+    window = (size_t)header->window << socket->snd_wscale;
+    window_update = window != socket->curr_win_size;
+    socket->curr_win_size = window;
+
+    /*The scoreboard, segments the peer holds past a hole are not resent*/
+    if((socket->options & MICROTCP_OPT_SACK) && SEQ_LT(header->future_use1, header->future_use2)
+       && SEQ_LT(socket->snd_una, header->future_use2) && SEQ_LEQ(header->future_use2, socket->seq_number))
+    {
+        if(SEQ_GT(header->future_use2, socket->sack_high))
+        {
+            socket->sack_high = header->future_use2;
+        }
+        for(size_t i = 0; i < socket->sndq_len; i++)
+        {
+            segment = sndq_at(socket, i);
+            if(SEQ_GEQ(segment->seq_number, header->future_use2))
+            {
+                break;
+            }
+            if(SEQ_LEQ(header->future_use1, segment->seq_number)
+               && SEQ_LEQ(segment->seq_number + segment->data_len, header->future_use2))
+            {
+                segment->sacked = 1;
+            }
+        }
+    }
+
+    if(acked == 0)
+    {
+        /*A duplicate ACK, the peer got a segment past a hole. One that moves
+          the window only tells that the application read (RFC 5681)*/
+        if(socket->sndq_len == 0 || window_update)
+        {
+            return 0;
+        }
+
+        dupthresh = MICROTCP_DUPACK_THRESH;
+        if(unsent == 0 && socket->sndq_len <= MICROTCP_DUPACK_THRESH)
+        {
+            dupthresh = socket->sndq_len - 1;
+        }
+
+        socket->dup_acks++;
+        if(socket->rto_recovery)
+        {
+            /*The data sent before the timeout is being resent already,
+              only the holes a SACK block shows are new*/
+            return resend_holes(socket);
+        }
+        else if(socket->in_recovery)
+        {
+            /*Each duplicate means one more segment has left the network,
+              its SACK block may show more holes*/
+            socket->cwnd += socket->mss;
+            return resend_holes(socket);
+        }
+        else if(socket->dup_acks == dupthresh)
+        {
+            /*Fast retransmit, then go on with the reduced window instead of slow start*/
+            socket->cc->on_loss(socket);
+            socket->cwnd = socket->ssthresh + dupthresh * socket->mss;
+            socket->recover = socket->seq_number;
+            socket->in_recovery = 1;
+            socket->high_rxt = socket->snd_una;
+            return resend_holes(socket);
+        }
+        return 0;
+    }
+
+    socket->dup_acks = 0;
+    if(socket->in_recovery)
+    {
+        /*Everything sent before the loss is acknowledged, deflate the window*/
+        if(SEQ_GEQ(header->ack_number, socket->recover))
+        {
+            socket->in_recovery = 0;
+            socket->cwnd = socket->ssthresh;
+            return 0;
+        }
+
+        /*Partial ACK, the segment at the next hole is lost as well*/
+        socket->cwnd = (socket->cwnd > acked ? socket->cwnd - acked : 0) + socket->mss;
+        return resend_holes(socket);
+    }
+
+    socket->cc->on_ack(socket, acked, now);
+    if(socket->rto_recovery)
+    {
+        if(SEQ_GEQ(header->ack_number, socket->recover))
+        {
+            socket->rto_recovery = 0;
+            return 0;
+        }
+
+        /*Partial ACK after a timeout, the segment at the next hole was lost
+          with the one resent, resend it now instead of after another timeout
+          (RFC 6582 3.2)*/
+        return resend_holes(socket);
+    }
+    return 0;
+}
+
+/*Clips len so that the payload starting at offset of iov spans at most MICROTCP_SEG_IOV slices*/
+static size_t iov_clip(const struct iovec *iov, size_t offset, size_t len)
+{
+    size_t covered = 0, take;
+    int slices = 0;
+
+    while(covered < len && slices < MICROTCP_SEG_IOV)
+    {
+        take = min(iov->iov_len - offset, len - covered, SIZE_MAX);
+        if(take > 0)
+        {
+            covered += take;
+            slices++;
+        }
+        iov++;
+        offset = 0;
+    }
+
+    return covered;
+}
+
+/*Moves an iovec cursor len bytes forward*/
+static void iov_advance(const struct iovec **iov, size_t *offset, size_t len)
+{
+    *offset += len;
+    while(*offset > 0 && *offset >= (*iov)->iov_len)
+    {
+        *offset -= (*iov)->iov_len;
+        (*iov)++;
+    }
+}
+
+/*Scatters len bytes into the caller's iovecs at the cursor, which moves forward*/
+static void iov_scatter(const struct iovec **iov, size_t *offset, const uint8_t *src, size_t len, uint32_t *crc)
+{
+    size_t take;
+
+    while(len > 0)
+    {
+        take = min((*iov)->iov_len - *offset, len, SIZE_MAX);
+        if(crc != NULL)
+        {
+            *crc = update_crc32_copy(*crc, (uint8_t*)(*iov)->iov_base + *offset, src, take);
+        }
+        else
+        {
+            memcpy((uint8_t*)(*iov)->iov_base + *offset, src, take);
+        }
+        src += take;
+        len -= take;
+        *offset += take;
+        if(*offset == (*iov)->iov_len)
+        {
+            (*iov)++;
+            *offset = 0;
+        }
+    }
+}
+
+static size_t iov_length(const struct iovec *iov, int iovcnt)
+{
+    size_t length = 0;
+
+    for(int i = 0; i < iovcnt; i++)
+    {
+        length += iov[i].iov_len;
+    }
+
+    return length;
+}
+
+/*Stores len bytes of the stream, starting at sequence number seq, in the receive buffer*/
+static void recvbuf_write(microtcp_sock_t *socket, uint32_t seq, const uint8_t *src, size_t len, uint32_t *crc)
+{
+    size_t at = RECVBUF_AT(socket, seq);
+    size_t first = min(len, socket->recvbuf_len - at, SIZE_MAX);
+
+    if(crc != NULL)
+    {
+        *crc = update_crc32_copy(*crc, socket->recvbuf + at, src, first);
+        *crc = update_crc32_copy(*crc, socket->recvbuf, src + first, len - first);
+        return;
+    }
+    memcpy(socket->recvbuf + at, src, first);
+    memcpy(socket->recvbuf, src + first, len - first);
+}
+
+/*Hands the oldest len in order bytes of the receive buffer to the caller*/
+static void recvbuf_read(microtcp_sock_t *socket, const struct iovec **iov, size_t *iov_offset, size_t len)
+{
+    size_t at = RECVBUF_AT(socket, socket->ack_number - socket->fin_gap - socket->buf_fill_level);
+    size_t first = min(len, socket->recvbuf_len - at, SIZE_MAX);
+
+    iov_scatter(iov, iov_offset, socket->recvbuf + at, first, NULL);
+    iov_scatter(iov, iov_offset, socket->recvbuf, len - first, NULL);
+    socket->buf_fill_level -= len;
+}
+
+/*Records that [start, end) is held out of order, merging it with the ranges it
+  overlaps or touches. Returns -1 when it needs a new range and there is no room*/
+static int ooo_insert(microtcp_sock_t *socket, uint32_t start, uint32_t end)
+{
+    microtcp_range_t *ooo = socket->ooo;
+    size_t i = 0, j;
+
+    /*Skip the ranges that end before this one starts*/
+    while(i < socket->ooo_len && SEQ_LT(ooo[i].end, start))
+    {
+        i++;
+    }
+
+    /*Absorb the ones it reaches*/
+    for(j = i; j < socket->ooo_len && SEQ_LEQ(ooo[j].start, end); j++)
+    {
+        if(SEQ_LT(ooo[j].start, start))
+        {
+            start = ooo[j].start;
+        }
+        if(SEQ_GT(ooo[j].end, end))
+        {
+            end = ooo[j].end;
+        }
+    }
+
+    if(i == j)
+    {
+        if(socket->ooo_len == MICROTCP_OOO_RANGES)
+        {
+            return -1;
+        }
+        memmove(&ooo[i + 1], &ooo[i], (socket->ooo_len - i) * sizeof(microtcp_range_t));
+        socket->ooo_len++;
     }
     else
     {
-        sock.state = UNKNOWN;
-        sock.init_win_size = 0 ;
-        sock.curr_win_size = 0;
-        sock.recvbuf = NULL;
-        sock.buf_fill_level = 0;
-        sock.cwnd =0;
-        sock.ssthresh =0;
-        sock.seq_number =0;
-        sock.ack_number =0;
-        sock.packets_send =0;
-        sock.packets_received =0;
-        sock.packets_lost =0;
-        sock.bytes_send =0;
-        sock.bytes_received =0;
-        sock.bytes_lost =0;
-	    memset(&sock.address, 0 , sizeof(struct  sockaddr));
-	    sock.address_len = 0;
+        memmove(&ooo[i + 1], &ooo[j], (socket->ooo_len - j) * sizeof(microtcp_range_t));
+        socket->ooo_len -= j - i - 1;
     }
-    
-    return sock;
+
+    ooo[i].start = start;
+    ooo[i].end = end;
+    return 0;
 }
 
-int microtcp_bind (microtcp_sock_t *socket, const struct sockaddr *address, socklen_t address_len)
+/*Moves ack_number over the out of order data that the last segment made contiguous*/
+static void ooo_advance(microtcp_sock_t *socket)
 {
-    if(socket->state == INVALID)
+    size_t done = 0;
+
+    while(done < socket->ooo_len && SEQ_LEQ(socket->ooo[done].start, socket->ack_number))
+    {
+        if(SEQ_GT(socket->ooo[done].end, socket->ack_number))
+        {
+            socket->buf_fill_level += (uint32_t)(socket->ooo[done].end - socket->ack_number);
+            socket->ack_number = socket->ooo[done].end;
+        }
+        done++;
+    }
+
+    memmove(&socket->ooo[0], &socket->ooo[done], (socket->ooo_len - done) * sizeof(microtcp_range_t));
+    socket->ooo_len -= done;
+}
+
+/*Fills a new segment of the retransmission queue with len bytes at seq, taken from offset of iov*/
+static void segment_init(microtcp_sock_t *socket, microtcp_segment_t *segment, uint16_t control, uint32_t seq, const struct iovec *iov, size_t iov_offset, size_t len)
+{
+    header_init(&segment->header);
+    segment->header.control = control;
+    segment->header.seq_number = seq;
+    segment->header.ack_number = socket->ack_number;
+    segment->header.window = advertised_window(socket);
+    segment->header.data_len = len;
+    if(socket->options & MICROTCP_OPT_TIMESTAMPS)
+    {
+        segment->header.future_use0 = (uint32_t)now_us();
+    }
+    segment->header.checksum = segment_crc32(&segment->header, iov, iov_offset, len);
+    header_hton(&segment->header);
+    segment->iov = iov;
+    segment->iov_offset = iov_offset;
+    segment->data_len = len;
+    segment->seq_number = seq;
+    segment->retransmissions = 0;
+    segment->sacked = 0;
+}
+
+/**
+*   Segments of the MSS keep getting lost while smaller ones got through, the
+*   path MTU shrank. The MSS goes back to the one the connection started with,
+*   the segments in flight are split to it and a new search starts below the
+*   old MSS. Returns -1 if the queue can not be rebuilt.
+*/
+static int plpmtu_blackhole(microtcp_sock_t *socket)
+{
+    microtcp_segment_t *old, *segment;
+    const struct iovec *iov;
+    size_t n = socket->sndq_len, iov_offset, left, len;
+    uint16_t control;
+    uint32_t seq;
+
+    socket->plpmtu.high = socket->mss - 1;
+    socket->plpmtu.low = socket->base_mss;
+    socket->mss = socket->base_mss;
+    plpmtu_next(socket, now_us());
+
+    /*Zero-copy sends still reference the headers about to be rewritten*/
+    if(socket->zc_active && (tx_flush(socket) == -1 || zc_wait(socket) == -1))
     {
-        perror("ERROR AT: Bind of socket");
         return -1;
     }
 
-    return bind(socket->sd, address, address_len);
+    old = (microtcp_segment_t*) malloc(n * sizeof(microtcp_segment_t));
+    if(old == NULL)
+    {
+        return -1;
+    }
+    socket->heap_allocs++;
+    for(size_t i = 0; i < n; i++)
+    {
+        old[i] = *sndq_at(socket, i);
+    }
+    socket->sndq_len = 0;
+
+    for(size_t i = 0; i < n; i++)
+    {
+        iov = old[i].iov;
+        iov_offset = old[i].iov_offset;
+        seq = old[i].seq_number;
+        left = old[i].data_len;
+        control = ntohs(old[i].header.control);
+
+        while(left > 0)
+        {
+            len = iov_clip(iov, iov_offset, min(left, socket->mss, SIZE_MAX));
+            segment = sndq_push(socket);
+            if(segment == NULL)
+            {
+                free(old);
+                return -1;
+            }
+
+            segment_init(socket, segment, len == left ? control : 0, seq, iov, iov_offset, len);
+            segment->retransmissions = old[i].retransmissions;
+            segment->sacked = old[i].sacked;
+            segment->sent_time_us = old[i].sent_time_us;
+            segment->delivered = old[i].delivered;
+            segment->delivered_time_us = old[i].delivered_time_us;
+            segment->app_limited = old[i].app_limited;
+
+            iov_advance(&iov, &iov_offset, len);
+            seq += len;
+            left -= len;
+        }
+    }
+
+    free(old);
+    return 0;
 }
 
 /**
-*   CONNECT (3way handshake)
-*	Step 1: Client sends first package (SYN)
-*	Step 3: Client recieves second package (SYN,ACK) and sends thirds package (ACK)
+*   SEND (sliding window)
+*   New segments are transmitted as soon as cumulative ACKs open space in
+*   min(flow control window, cwnd). Every segment in flight stays in the
+*   retransmission queue until it is acknowledged.
 */
 
-int microtcp_connect (microtcp_sock_t *socket, const struct sockaddr *address, socklen_t address_len)
+/*Transmits the length bytes at iov as far as the window and the pacing allow,
+  offset counts the ones already out. pace_us gets how long the next paced
+  segment has to wait, 0 if none does*/
+static int send_fill(microtcp_sock_t *socket, const struct iovec **iov, size_t *iov_offset, size_t *offset, size_t length, uint64_t *pace_us)
 {
-	microtcp_header_t* header = malloc(sizeof(microtcp_header_t));
-	uint32_t tmp_seq, tmp_ack;
-	uint16_t tmp_win;
+	microtcp_segment_t *segment;
+	size_t window = min(socket->curr_win_size, socket->cwnd, SIZE_MAX);
+	size_t in_flight, bytes_to_send;
+
+	*pace_us = 0;
+	while(*offset < length)
+    {
+		in_flight = (uint32_t)(socket->seq_number - socket->snd_una);
+		if(in_flight >= window)
+        {
+			break;
+		}
+
+		/*Paced, a short gap is spun away once the segments before it are out*/
+		*pace_us = pacing_delay(socket);
+		if(*pace_us > 0 && *pace_us <= MICROTCP_PACING_SPIN_US)
+        {
+			if(tx_flush(socket) == -1)
+            {
+				socket->state = INVALID;
+				return -1;
+			}
+			while(now_us() < socket->pacing_next_us)
+            {
+			}
+			*pace_us = 0;
+		}
+		if(*pace_us > 0)
+        {
+			break;
+		}
+
+		bytes_to_send = min(window - in_flight, socket->mss, length - *offset);
+		bytes_to_send = iov_clip(*iov, *iov_offset, bytes_to_send);
+
+		/*Do not split the stream in small segments while the window is opening*/
+		if(bytes_to_send < socket->mss && bytes_to_send < length - *offset && in_flight > 0)
+        {
+			break;
+		}
+
+		segment = sndq_push(socket);
+		if(segment == NULL)
+        {
+			perror("ERROR AT Send: Retransmission queue Memory Allocation");
+			return -1;
+		}
+
+		segment_init(socket, segment, bytes_to_send == length - *offset ? PSH : 0, socket->seq_number, *iov, *iov_offset, bytes_to_send);
+
+		if(transmit_segment(socket, segment) == -1)
+        {
+			socket->state = INVALID;
+			return -1;
+		}
 
-	/*Malloc check*/
-	if(header == NULL)
-    {
-		perror("ERROR AT Connect: Header Memory Allocation");
-		return -1;
+		socket->seq_number = (uint32_t)(socket->seq_number + bytes_to_send);
+		*offset += bytes_to_send;
+		iov_advance(iov, iov_offset, bytes_to_send);
 	}
 
-	srand((uint32_t)time(NULL));
-
-	/*Socket check*/
-	if (socket->state != UNKNOWN) 
+	/*Everything is out with room to spare, rate samples until it is delivered
+	  measure the application and not the network*/
+	in_flight = (uint32_t)(socket->seq_number - socket->snd_una);
+	if(*offset == length && in_flight < window)
     {
-        perror("ERROR AT Connect: Invalid socket");
-        return -1;
-    }
-
-    /************ FIRST STEP *************/
-    /*First package creation*/
-    header_init(header);
-    header->seq_number = (rand()% (10000 - 1000 + 1)) + 1000;
-    header->control = SYN;
-    header->checksum = crc32((uint8_t*)header, sizeof(microtcp_header_t));
-	tmp_seq = header->seq_number;		
-
-	printf("\nSending 1st package (3way handshake)\n");
-    header_print(header);
-    printf("\n");
+		socket->app_limited = socket->delivered + in_flight > 0 ? socket->delivered + in_flight : 1;
+	}
+	return 0;
+}
 
-    /*Convert into network byte order  */
-    header_hton(header);
+/*Nothing came back in time. A peer with no room for anything gets a window
+  probe, else the timer backs off and the lost segments are resent*/
+static int send_timeout(microtcp_sock_t *socket)
+{
+	microtcp_segment_t *segment;
 
-	/*First package transmition*/
-    if(sendto(socket->sd, header, sizeof(microtcp_header_t),0,address ,address_len) == -1 ) 
+	/*The peer has no room for anything, probe its window*/
+	if(socket->sndq_len == 0)
     {
-        perror("ERROR AT Connect: Step1 Send");
-        socket->state = INVALID;
-        return -1;
-   	}
+		if(send_control(socket, 0) == -1)
+        {
+			socket->state = INVALID;
+			return -1;
+		}
+		return 0;
+	}
 
-    /************ THIRD STEP *************/
+	/*Timeout, back off the timer and start over from slow start*/
+	socket->rto_us = socket->rto_us * 2 < socket->max_rto_us ? socket->rto_us * 2 : socket->max_rto_us;
+	socket->rto_deadline_us = now_us() + socket->rto_us;
+	socket->cc->on_timeout(socket);
+	socket->in_recovery = 0;
+	socket->dup_acks = 0;
+	socket->recover = socket->seq_number;
+	socket->rto_recovery = 1;
 
-	/*Second package download*/
-    if(recvfrom(socket->sd,header, sizeof(microtcp_header_t), 0, (struct sockaddr*)address, &address_len) == -1)
+	/*The oldest segment is lost again and again, it may no longer fit the path*/
+	segment = sndq_at(socket, 0);
+	if(segment->retransmissions + 1 >= MICROTCP_PLPMTU_PROBES && segment->data_len > socket->base_mss
+		&& plpmtu_blackhole(socket) == -1)
     {
-	    perror("ERROR AT Connect: Step3 Recieve");
-        socket->state = INVALID;
-        return -1;
+		perror("ERROR AT Send: Retransmission queue Memory Allocation");
+		socket->state = INVALID;
+		return -1;
 	}
 
-	/*Convert into host byte order*/
-    header_ntoh(header);
-
-	printf("\n2nd package recieved (3way handshake)\n");
-    header_print(header);
-    printf("\n");
+	/*Resend the oldest segment and, when SACK tells where they are,
+	  the other holes. The receiver keeps what came after them*/
+	socket->high_rxt = socket->snd_una;
+	if(resend_holes(socket) == -1)
+    {
+		socket->state = INVALID;
+		return -1;
+	}
+	return 0;
+}
 
-    /*Second package checks*/
-    if(!check_sum(header))
+/*Takes an ACK of the data sent, or the answer to a path MTU probe. unsent is
+  the data waiting for the window*/
+static int send_input(microtcp_sock_t *socket, microtcp_header_t *header, size_t unsent)
+{
+	if(header->control == PROBE_ACK)
     {
-        perror("ERROR AT Connect: Step3 Checksum");
-        socket->state = INVALID;
-        return -1;
-    }
+		plpmtu_probe_acked(socket, header->future_use2);
+		return 0;
+	}
 
-    if(header->control != SYN_ACK)
+	if(header->control == SYN_ACK)
     {
-        perror("ERROR AT Connect: Step3 Control");
-        socket->state = INVALID;
-        return -1;
-    }
+		if(send_handshake_ack(socket, header) == -1)
+        {
+			socket->state = INVALID;
+			return -1;
+		}
+		return 0;
+	}
 
-    if(header->ack_number != (tmp_seq + 1))
+	if((header->control & ACK) && process_ack(socket, header, unsent) == -1)
     {
-        perror("ERROR AT Connect: Step3 Seq_number");
-        socket->state = INVALID;
-        return -1;
-    }
+		socket->state = INVALID;
+		return -1;
+	}
+	return 0;
+}
 
-	tmp_seq = header->seq_number;		
-    tmp_ack = header->ack_number;		
-	tmp_win = header->window;
+/*Sends the length bytes at iov_offset of iov and blocks until every segment
+  in flight, these and any sent before, is acknowledged*/
+static ssize_t send_stream(microtcp_sock_t *socket, const struct iovec *iov, size_t iov_offset, size_t length, int flags)
+{
+	const uint8_t *payload;
+	microtcp_header_t header;
+	size_t offset = 0;
+	uint64_t pace_us;
+	int64_t timeout;
+	unsigned int due;
+	int ret;
 
-	/*Third package creation */
-    header_init(header);
-    header->control =ACK;
-    header->seq_number = tmp_ack;		
-    header->ack_number = tmp_seq + 1;   
-    header->window = tmp_win;
-    header->checksum = crc32((uint8_t*)header, sizeof(microtcp_header_t));
+	/*Zero-copy pays off only for large writes, anything smaller is copied*/
+	socket->zc_active = 0;
+	if((flags & MICROTCP_ZEROCOPY) && length >= MICROTCP_ZEROCOPY_MIN)
+    {
+		if(socket->zc_enabled == 0)
+        {
+			int one = 1;
+			socket->zc_enabled = setsockopt(socket->sd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0 ? 1 : -1;
+		}
+		socket->zc_active = socket->zc_enabled == 1;
+	}
 
-	printf("\nTransmition 3rd package (3way handshake)\n");
-    header_print(header);
-    printf("\n");
+	while(offset < length || socket->sndq_len > 0)
+    {
+		/*Probe for a larger MSS while there is data to carry with it*/
+		if(offset < length && plpmtu_probe(socket) == -1)
+        {
+			socket->state = INVALID;
+			return -1;
+		}
 
-	/*Convert header into network byte order */
-	header_hton(header);
+		/*Fill the window*/
+		if(send_fill(socket, &iov, &iov_offset, &offset, length, &pace_us) == -1)
+        {
+			return -1;
+		}
 
-    /*Third package transmition */
-    if(sendto(socket->sd, header, sizeof(microtcp_header_t),0,address ,address_len) == -1 ){	
-        perror("Connect: Step3 Send");
-        socket->state = INVALID;
-        return -1;
- 	}
+		/*Wait for ACKs until the retransmission timer goes off, or the
+		  pacing timer for the next segment. With nothing in flight, a
+		  closed window is probed after an RTO*/
+		conn_arm(socket);
+		if(pace_us > 0)
+        {
+			timer_arm(&socket->timers[TIMER_PACING], socket->pacing_next_us);
+		}
+		timeout = socket->sndq_len > 0 || pace_us > 0 ? -1 : (int64_t)socket->rto_us;
 
+		ret = recv_segment(socket, &header, &payload, timeout, NULL);
+		timer_cancel(&socket->timers[TIMER_PACING]);
+		if(ret == -1)
+        {
+			socket->state = INVALID;
+			return -1;
+		}
 
-    /*Socket initiation*/
-	socket->caller = CLIENT;
-    socket->state = ESTABLISHED;
-	socket->ssthresh = MICROTCP_INIT_SSTHRESH; 
-	socket->cwnd = MICROTCP_INIT_CWND;    
-	socket->seq_number = tmp_seq+1;	
-    socket->ack_number = tmp_ack;		
-	socket->init_win_size = tmp_win;
-	socket->curr_win_size = tmp_win;
-	socket->address = *address;
-	socket->address_len = address_len;
-	socket->recvbuf = (uint8_t*) calloc(MICROTCP_RECVBUF_LEN,sizeof(uint8_t));
+		if(ret == 0)
+        {
+			due = socket->timers_due;
+			if(conn_timers(socket) == -1)
+            {
+				return -1;
+			}
+			if(due == 0 && send_timeout(socket) == -1)
+            {
+				return -1;
+			}
+			continue;
+		}
+
+		if(send_input(socket, &header, length - offset) == -1)
+        {
+			return -1;
+		}
+	}
 
-	/*Calloc check*/
-	if(socket->recvbuf == NULL)
+	/*The caller may reuse the buffer only when the kernel is done with it*/
+	if(socket->zc_active)
     {
-		perror("ERROR AT Connect: Recvbuf Memory Allocation");
-		return -1;
+		socket->zc_active = 0;
+		if(zc_wait(socket) == -1)
+        {
+			socket->state = INVALID;
+			return -1;
+		}
 	}
 
-	free(header);
-	return 0;
+    return length;
 }
 
 /**
-*   ACCEPT (3way handshake)
-*   Step 2: Server recieves first package (SYN) and sends second package (SYN,ACK)
-*   Step 4: Server recieves third package (ACK)
+*   The data of non-blocking sends is copied to the send buffer, where it
+*   stays until it is acknowledged. Its segments address the buffer through
+*   sndb->iov, which is the buffer twice over, so a payload that wraps around
+*   the end of the buffer is simply two slices.
 */
 
-int microtcp_accept (microtcp_sock_t *socket, struct sockaddr *address, socklen_t address_len)
+static int sndbuf_alloc(microtcp_sock_t *socket)
 {
-	microtcp_header_t *header = malloc(sizeof(microtcp_header_t));
-	uint32_t tmp_seq, tmp_ack;
+    struct microtcp_sndbuf *sndb;
+    size_t len = 1;
 
-	/*Malloc check*/
-	if(header == NULL)
+    while(len < socket->sndbuf_len || len < 2 * socket->mss)
     {
-		perror("ERROR AT Accept: Header Memory allocation");
-		return -1;
-	}
-
-	srand((uint32_t)time(NULL));
-
-    /************ SECOND STEP *************/
+        len <<= 1;
+    }
+    socket->sndbuf_len = len;
 
-    /* First package download*/
-	if(recvfrom(socket->sd, header, sizeof(microtcp_header_t), 0, address, &address_len) == -1)
+    sndb = (struct microtcp_sndbuf*) malloc(sizeof(struct microtcp_sndbuf) + len);
+    if(sndb == NULL)
     {
-        perror("ERROR AT Accept: Step2 Recieve");
-        socket->state = INVALID;
         return -1;
     }
+    sndb->len = len;
+    sndb->iov[0].iov_base = sndb->data;
+    sndb->iov[0].iov_len = len;
+    sndb->iov[1] = sndb->iov[0];
 
-	/*Convert into host byte order*/
-    header_ntoh(header);
+    socket->sndb = sndb;
+    socket->snd_end = socket->seq_number;
+    return 0;
+}
 
-   	printf("\nRecieved 1st package (3way handshake)\n");
-   	header_print(header);
-    printf("\n");
+/*Transmits the data of non-blocking sends the window has room for now*/
+static int send_pending(microtcp_sock_t *socket)
+{
+    const struct iovec *iov;
+    size_t length = sndbuf_unsent(socket);
+    size_t iov_offset, offset = 0;
+    uint64_t pace_us;
 
-    /* First package checks*/
-    if(!check_sum(header))
+    if(length == 0)
+    {
+        socket->persist_us = 0;
+        timer_cancel(&socket->timers[TIMER_PACING]);
+        return 0;
+    }
+
+    if(plpmtu_probe(socket) == -1)
     {
         socket->state = INVALID;
         return -1;
     }
 
-	if(header->control != SYN)
+    iov = socket->sndb->iov;
+    iov_offset = SNDBUF_AT(socket->sndb, socket->seq_number);
+    if(send_fill(socket, &iov, &iov_offset, &offset, length, &pace_us) == -1)
     {
-        socket->state = INVALID;
         return -1;
     }
 
-	tmp_seq = header->seq_number;	
+    if(pace_us > 0)
+    {
+        timer_arm(&socket->timers[TIMER_PACING], socket->pacing_next_us);
+    }
+    else
+    {
+        timer_cancel(&socket->timers[TIMER_PACING]);
+    }
 
-    /*Second package creation*/
-	header_init(header);
-   	header->seq_number = (rand()% (20000 - 11000 + 1)) + 1000;
-	header->ack_number = tmp_seq + 1;
-    header->control = SYN_ACK;
-    header->window = MICROTCP_WIN_SIZE;
-    header->checksum = crc32((uint8_t*)header, sizeof(microtcp_header_t));
-    tmp_seq = header->seq_number;		
-    tmp_ack = header->ack_number;		
-    printf("\nTransmition 2nd package (3way handshake)\n");
-    header_print(header);
-    printf("\n");
+    /*Nothing in flight to bring an ACK, a closed window is probed after an RTO*/
+    if(offset < length && socket->sndq_len == 0 && pace_us == 0)
+    {
+        if(socket->persist_us == 0)
+        {
+            socket->persist_us = now_us() + socket->rto_us;
+        }
+    }
+    else
+    {
+        socket->persist_us = 0;
+    }
+    return 0;
+}
 
-    /*Convert into network byte order */
-	header_hton(header);
+/*Fires the timers of the connection that have expired, the delayed ACK, the
+  retransmission timeout, the window probe and the one of the close. The
+  pacing timer only wakes up the sender*/
+static int conn_timers(microtcp_sock_t *socket)
+{
+    uint64_t now = now_us();
 
-    /*Second package transmition*/
-    if(sendto(socket->sd, header, sizeof(microtcp_header_t), 0, address, address_len) == -1)
-    {			
+    socket->timers_due = 0;
+
+    if(socket->close_us != 0 && now >= socket->close_us)
+    {
+        return close_timeout(socket);
+    }
+    if(conn_closing(socket))
+    {
+        return 0;
+    }
+
+    if(socket->ack_pending > 0 && now >= socket->ack_deadline_us && send_ack(socket) == -1)
+    {
         socket->state = INVALID;
         return -1;
     }
 
+    if(socket->sndq_len > 0 && now >= socket->rto_deadline_us)
+    {
+        return send_timeout(socket);
+    }
 
-	/************ FOURTH STEP *************/
+    if(socket->persist_us != 0 && now >= socket->persist_us)
+    {
+        /*A blocking send may have moved on since it was armed*/
+        if(socket->sndq_len > 0 || sndbuf_unsent(socket) == 0)
+        {
+            socket->persist_us = 0;
+            return 0;
+        }
+        socket->persist_us = now + socket->rto_us;
+        return send_timeout(socket);
+    }
+    return 0;
+}
 
-	/*  Third package download */
-    if(recvfrom(socket->sd, header, sizeof(microtcp_header_t), 0, address, &address_len) == -1)
-    {	
-        socket->state = INVALID;
+/*Microseconds until a timer of the connection goes off, -1 if none is armed*/
+static int64_t conn_next(microtcp_sock_t *socket)
+{
+    uint64_t next = UINT64_MAX;
+    uint64_t now;
+
+    if(socket->timers == NULL)
+    {
         return -1;
     }
+    for(int i = 0; i < TIMER_COUNT; i++)
+    {
+        if(timer_armed(&socket->timers[i]) && socket->timers[i].expires_us < next)
+        {
+            next = socket->timers[i].expires_us;
+        }
+    }
 
-    /* Convert into host byte order */
-    header_ntoh(header);
+    if(next == UINT64_MAX)
+    {
+        return -1;
+    }
+    now = now_us();
+    return next > now ? (int64_t)(next - now) : 0;
+}
 
-    printf("\nRecieved 3rd package (3way handshake)\n");
-    header_print(header);
-    printf("\n");
+/*Copies to the send buffer as much of the caller's data as it has room for
+  and transmits what the window allows, without blocking*/
+static ssize_t send_nonblock(microtcp_sock_t *socket, const struct iovec *iov, int iovcnt)
+{
+    struct microtcp_sndbuf *sndb;
+    size_t length = iov_length(iov, iovcnt);
+    size_t room, take, at, first, copied = 0;
 
-    /* Third package checks*/
-    if(!check_sum(header))
+    if(socket->sndb == NULL && sndbuf_alloc(socket) == -1)
     {
-        perror("ERROR AT: checksum");
-        socket->state = INVALID;
+        perror("ERROR AT Send: Send buffer Memory Allocation");
         return -1;
     }
-    
-    if(header->control != ACK) 
+
+    /*Room is made by the ACKs that have arrived*/
+    if(conn_drive(socket) == -1)
     {
-        perror("ERROR AT: ACK");
-        socket->state = INVALID;
         return -1;
     }
-    
-    if(header->seq_number != tmp_ack) 
-    {
-        perror("ERROR AT: seq");
-        socket->state = INVALID;
+    if(socket->state != ESTABLISHED)
+    {
+        errno = EPIPE;
         return -1;
     }
 
-    if(header->ack_number != (tmp_seq + 1)) 
+    sndb = socket->sndb;
+    room = sndb->len - (uint32_t)(socket->snd_end - socket->snd_una);
+    for(int i = 0; i < iovcnt && room > 0; i++)
     {
-        socket->state =INVALID;
-        return -1;
+        take = min(iov[i].iov_len, room, SIZE_MAX);
+        at = SNDBUF_AT(sndb, socket->snd_end);
+        first = min(take, sndb->len - at, SIZE_MAX);
+        memcpy(sndb->data + at, iov[i].iov_base, first);
+        memcpy(sndb->data, (const uint8_t*)iov[i].iov_base + first, take - first);
+        socket->snd_end = (uint32_t)(socket->snd_end + take);
+        room -= take;
+        copied += take;
     }
 
-    /*  Socket initiation*/
-	socket->caller = SERVER;
-    socket->state = ESTABLISHED;
-	socket->ssthresh = MICROTCP_INIT_SSTHRESH; 
-	socket->cwnd = MICROTCP_INIT_CWND;	
-	socket->init_win_size = MICROTCP_WIN_SIZE;
-    socket->curr_win_size = MICROTCP_WIN_SIZE;
-    socket->seq_number = header->ack_number;
-    socket->ack_number = header->seq_number + 1;
-	socket->address = *address;
-	socket->address_len = address_len;
-	socket->recvbuf = (uint8_t*) calloc(MICROTCP_RECVBUF_LEN,sizeof(uint8_t));
+    if(copied == 0 && length > 0)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
 
-    /*Calloc check*/
-    if(socket->recvbuf == NULL)
+    if(send_pending(socket) == -1 || tx_flush(socket) == -1)
     {
-            perror("ERROR AT Connect: Recvbuf Memory Allocation");
-            return -1;
+        socket->state = INVALID;
+        return -1;
     }
+    return copied;
+}
 
-	free(header);
-    return socket->sd;
+ssize_t microtcp_send (microtcp_sock_t *socket, const void *buffer, size_t length, int flags)
+{
+	struct iovec iov = { .iov_base = (void*)buffer, .iov_len = length };
+
+	return microtcp_sendv(socket, &iov, 1, flags);
 }
 
-int microtcp_shutdown (microtcp_sock_t *socket, int how)
+ssize_t microtcp_sendv (microtcp_sock_t *socket, const struct iovec *iov, int iovcnt, int flags)
 {
-	srand((uint32_t)time(NULL));
-	microtcp_header_t *header = malloc(sizeof(microtcp_header_t));
-	uint32_t tmp_seq, tmp_ack;
+	size_t length = iov_length(iov, iovcnt);
+	ssize_t ret;
 
-	/*Malloc check*/
-	if(header == NULL)
+	/*Nothing goes after the FIN, once microtcp_shutdown() was called*/
+	if(socket->state != ESTABLISHED || socket->closing)
     {
-		perror("ERROR AT: Memory allocation error in accept h1");
+		errno = EPIPE;
+		perror("ERROR AT Send: Invalid socket");
 		return -1;
 	}
 
+	if(flags & MSG_DONTWAIT)
+    {
+		return send_nonblock(socket, iov, iovcnt);
+	}
 
-	if(socket->caller == CLIENT)
-    {		
-		/*First package creation*/
-		header_init(header);
-		header->control = FIN_ACK;
-		header->seq_number = (uint32_t)socket->seq_number+1;
-		header->window = socket->curr_win_size;
-		header->checksum = crc32((uint8_t*)header, sizeof(microtcp_header_t));
-
-		tmp_seq = header->seq_number;
-
-		printf("\nSending first package (shutdown)\n");
-    	header_print(header);
-    	printf("\n");
-
-		/*Convert into network byte order*/
-		header_hton(header);
+	/*What non-blocking sends left in the send buffer goes first*/
+	if(sndbuf_unsent(socket) > 0
+		&& send_stream(socket, socket->sndb->iov, SNDBUF_AT(socket->sndb, socket->seq_number), sndbuf_unsent(socket), 0) == -1)
+    {
+		return -1;
+	}
 
-		/*First package transmition*/
-		if(sendto(socket->sd, header, sizeof(microtcp_header_t), 0, &socket->address, socket->address_len) == -1 )
-        {
-			socket->state=INVALID;
-			perror("Shutdown Packet1 Send");
-			return -1;
-		}
+	ret = send_stream(socket, iov, 0, length, flags);
+	if(socket->sndb != NULL)
+    {
+		socket->snd_end = socket->seq_number;
+	}
+	return ret;
+}
 
-		/*Second package download*/
-		if(recvfrom(socket->sd, header,sizeof(microtcp_header_t), 0, &socket->address, &socket->address_len) == -1)
-        {
-			socket->state=INVALID;
-			perror("ERROR AT Shutdown Packet2 Recieve");
-			return -1;
-		}
+/**
+*   RECEIVE
+*   Blocks until some data is available and then keeps consuming segments that
+*   are already queued on the socket, so one call may return the payload of
+*   many segments, up to length bytes.
+*/
 
-		/*Convert into host byte order*/
-		header_ntoh(header);
+/**
+*   Takes in a segment that is not an ACK of the data sent. In order data
+*   fills the caller's iovecs at the cursor, up to room bytes, and the
+*   receive buffer after that. Out of order data waits in the receive buffer.
+*   taken gets the bytes handed to the caller, pushed is set when the sender
+*   pushed them.
+*   Returns 1 for the FIN of the peer, 0 for anything else and -1 on error.
+*/
+static int recv_input(microtcp_sock_t *socket, microtcp_header_t *header, const uint8_t *payload, uint32_t crc,
+    const struct iovec **iov, size_t *iov_offset, size_t room, size_t *taken, int *pushed)
+{
+    const struct iovec *iov_start;
+    size_t direct, skip, iov_start_offset;
+    int delay, fused;
 
-		printf("\nRecieved 2nd package (shutdown)\n");
-    	header_print(header);
-    	printf("\n");
+    *taken = 0;
 
-		/*Second package checks*/
-		if(!check_sum(header)) 
-        {
-        	perror("ERRROR AT Shutdown Packet2 Recieve CHECKSUM");
-        	socket->state = INVALID;
-        	return -1;
-    	}
+    /*In order data with nothing held after it is checked while it is copied
+      to where it goes, which is free space until the checksum matches.
+      Any other payload is checked right away*/
+    fused = header->data_len > 0 && header->seq_number == socket->ack_number && socket->ooo_len == 0
+        && (header->control & ~PSH) == 0 && header->data_len <= recv_window(socket);
+    if(header->data_len > 0 && !fused && (update_crc32(crc, payload, header->data_len) ^ 0xffffffff) != header->checksum)
+    {
+        return 0;
+    }
 
-		if(header->control != ACK) 
+    /*The peer closes the connection, ACK its FIN so microtcp_shutdown() goes on from there.
+      Data not read yet stays where it is, before the sequence numbers of the FIN*/
+    if(header->control & FIN)
+    {
+        if(socket->state != CLOSING_BY_PEER)
         {
-        		perror("ERRROR AT Shutdown Packet2 Recieve CONTROL");
-        		socket->state = INVALID;
-        		return -1;
-    		}
-		
-        if(header->ack_number != (tmp_seq +1)) 
+            socket->fin_gap = (uint32_t)(header->seq_number + 1 - socket->ack_number);
+            socket->ack_number = header->seq_number + 1;
+            socket->state = CLOSING_BY_PEER;
+        }
+        if(send_ack(socket) == -1)
         {
-        	perror("ERRROR AT Shutdown Packet2 Recieve ACK NUMBER");
-        	socket->state = INVALID;
-        	return -1;
-    	}
+            socket->state = INVALID;
+            return -1;
+        }
+        return 1;
+    }
 
-		socket->state = CLOSING_BY_HOST;
+    /*A path MTU probe, only its size matters*/
+    if(header->control == PROBE)
+    {
+        if(send_probe_ack(socket, header->data_len) == -1)
+        {
+            socket->state = INVALID;
+            return -1;
+        }
+        return 0;
+    }
 
-		/*Third package download*/
-		if(recvfrom(socket->sd, header ,sizeof(microtcp_header_t), 0, &socket->address, &socket->address_len) == -1)
+    if(header->control == SYN_ACK)
+    {
+        if(send_handshake_ack(socket, header) == -1)
         {
-			socket->state=INVALID;
-			perror("ERRROR AT Shutdown Packet3 Recieve");
-			return -1;
-		}
+            socket->state = INVALID;
+            return -1;
+        }
+        return 0;
+    }
 
-		/*Convert into host byte order*/
-		header_ntoh(header);
+    if(header->control & ACK)
+    {
+        return 0;
+    }
 
-		printf("\nRecieved 3rd package (shutdown)\n");
-    	header_print(header);
-    	printf("\n");
+    /*Only in order data that leaves no hole behind may wait for the ACK*/
+    delay = 0;
 
-		tmp_ack = header->seq_number;	
+    /*Drop the part that has already been received*/
+    if(SEQ_LT(header->seq_number, socket->ack_number))
+    {
+        skip = min((uint32_t)(socket->ack_number - header->seq_number), header->data_len, SIZE_MAX);
+        header->seq_number += skip;
+        header->data_len -= skip;
+        payload += skip;
+    }
 
-		/*Third package checks*/
-		if(!check_sum(header)) 
+    /*Keep whatever fits in the window, anything else gets a duplicate ACK*/
+    if(header->data_len > 0 && (uint32_t)(header->seq_number + header->data_len - socket->ack_number) <= recv_window(socket))
+    {
+        if(header->seq_number == socket->ack_number)
         {
-        	perror("ERRROR AT Shutdown Packet3 Recieve CHECKSUM");
-        	socket->state = INVALID;
-        	return -1;
-    	}
+            /*Straight to the caller, only what does not fit is buffered*/
+            direct = socket->buf_fill_level == 0 ? min(header->data_len, room, SIZE_MAX) : 0;
+            iov_start = *iov;
+            iov_start_offset = *iov_offset;
+            iov_scatter(iov, iov_offset, payload, direct, fused ? &crc : NULL);
+            recvbuf_write(socket, header->seq_number + direct, payload + direct, header->data_len - direct, fused ? &crc : NULL);
+            if(fused && (crc ^ 0xffffffff) != header->checksum)
+            {
+                /*Corrupted, nothing of it is taken in*/
+                *iov = iov_start;
+                *iov_offset = iov_start_offset;
+                return 0;
+            }
+            socket->buf_fill_level += header->data_len - direct;
+            *taken = direct;
 
-		if(header->control != FIN_ACK) 
+            delay = socket->ooo_len == 0 && !(header->control & PSH);
+            *pushed = header->control & PSH;
+            socket->ack_number = (uint32_t)(socket->ack_number + header->data_len);
+            ooo_advance(socket);
+            socket->packets_received++;
+            socket->bytes_received += header->data_len;
+        }
+        else if(ooo_insert(socket, header->seq_number, header->seq_number + header->data_len) == 0)
         {
-        	perror("ERRROR AT Shutdown Packet3 Recieve CONTROL");
-        	socket->state = INVALID;
-        	return -1;
-    	}
-
-		/*Forth package creation*/
-		header_init(header);
-		header->control = ACK;
-		header->ack_number = tmp_ack + 1;
-		header->seq_number = tmp_seq + 1;
-		header->checksum = crc32((uint8_t*)header, sizeof(microtcp_header_t));
-
-		printf("\nTransmting 4th package (shutdown)\n");
-    	header_print(header);
-    	printf("\n");
-
-		/*Convert into network byte order*/
-		header_hton(header);
+            /*Ahead of a hole, keep it until the hole is filled*/
+            recvbuf_write(socket, header->seq_number, payload, header->data_len, NULL);
+            socket->ooo_recent = header->seq_number;
+            socket->packets_received++;
+            socket->packets_reordered++;
+            socket->bytes_received += header->data_len;
+        }
+    }
 
-		/*Forth package transmiting*/
-		if(sendto(socket->sd, header, sizeof(microtcp_header_t), 0, &socket->address, socket->address_len) == -1 ){
-			socket->state=INVALID;
-			perror("ERRROR AT Shutdown Packet4 Send");
-			return -1;
-		}
-	}
-	else if (socket->caller == SERVER)
-    {		
-		header_init(header);
+    /*The echo of a delayed ACK is the one of the oldest segment it covers,
+      so the sender's RTT includes the delay (RFC 7323)*/
+    if(socket->ack_pending == 0)
+    {
+        socket->ts_recent = header->future_use0;
+    }
 
-		/*First package download**/
-		if(recvfrom(socket->sd, header,sizeof(microtcp_header_t), 0, &socket->address, &socket->address_len) == -1)
+    /*Holes, duplicates, window probes and pushed data are acknowledged at once*/
+    socket->ack_pending++;
+    if(delay && socket->ack_pending < socket->ack_every)
+    {
+        if(socket->ack_pending == 1)
         {
-			socket->state=INVALID;
-			perror("ERRROR AT  Shutdown Packet1 Recieve");
-			return -1;
-		}
+            socket->ack_deadline_us = now_us() + socket->delack_us;
+        }
+        return 0;
+    }
+
+    if(send_ack(socket) == -1)
+    {
+        socket->state = INVALID;
+        return -1;
+    }
+    return 0;
+}
 
-		/*Convert into host byte order*/
-		header_ntoh(header);
+ssize_t microtcp_recv (microtcp_sock_t *socket, void *buffer, size_t length, int flags)
+{
+    struct iovec iov = { .iov_base = buffer, .iov_len = length };
 
-		printf("\nRecieved 1st package (shutdown)\n");
-    	header_print(header);
-    	printf("\n");
+    return microtcp_recvv(socket, &iov, 1, flags);
+}
 
-		tmp_seq = header->seq_number;
+ssize_t microtcp_recvv (microtcp_sock_t *socket, const struct iovec *iov, int iovcnt, int flags)
+{
+    size_t length = iov_length(iov, iovcnt);
+    size_t iov_offset = 0;
+    const uint8_t *payload;
+    microtcp_header_t header;
+    size_t bytes = 0, direct;
+    int64_t timeout;
+    size_t window = recv_window(socket);
+    uint32_t crc;
+    int ret, pushed = 0;
 
-		/*First package checks*/
-		if(!check_sum(header)) 
+    while(bytes < length)
+    {
+        /*Data buffered by a previous call, or made contiguous by the last segment, goes first*/
+        if(socket->buf_fill_level > 0)
         {
-        	perror("ERRROR AT Shutdown Packet1 Recieve CHECKSUM");
-        	socket->state = INVALID;
-        	return -1;
-    	}
+            direct = min(length - bytes, socket->buf_fill_level, SIZE_MAX);
+            recvbuf_read(socket, &iov, &iov_offset, direct);
+            bytes += direct;
+            continue;
+        }
 
-		if(header->control != FIN_ACK) 
+        /*End of stream, or a socket that never connected*/
+        if(socket->state != ESTABLISHED)
         {
-        	perror("ERRROR AT Shutdown Packet1 Recieve CONTROL");
-        	socket->state = INVALID;
-        	return -1;
-    	}
-
-		/*Second package creation*/
-		header_init(header);
-		header->control = ACK;
-		header->ack_number = tmp_seq + 1;
-		header->checksum = crc32((uint8_t*)header, sizeof(microtcp_header_t));
+            break;
+        }
 
-		printf("\nTransmiting 2nd package (shutdown)\n");
-    	header_print(header);
-    	printf("\n");
+        /*Block only while nothing has been received, then take what is already there.
+          While an ACK is delayed, the segments that may still come before it goes out
+          are waited for too, until its timer goes off, unless the sender pushed the end
+          of a write. Non-blocking sends in flight keep their timers running*/
+        timeout = bytes > 0 || (flags & MSG_DONTWAIT) ? 0 : -1;
+        if(socket->ack_pending > 0 && !pushed && !(flags & MSG_DONTWAIT))
+        {
+            timeout = -1;
+        }
+        conn_arm(socket);
 
-		/*Convert into network byte order*/
-		header_hton(header);
+        ret = recv_segment(socket, &header, &payload, timeout, &crc);
+        if(ret == -1)
+        {
+            socket->state = INVALID;
+            return -1;
+        }
+        if(ret == 0)
+        {
+            /*Delayed ACK timeout*/
+            if(socket->ack_pending > 0 && send_ack(socket) == -1)
+            {
+                socket->state = INVALID;
+                return -1;
+            }
+            if(conn_timers(socket) == -1 || (socket->sndb != NULL && send_pending(socket) == -1))
+            {
+                return -1;
+            }
+            if(bytes > 0 || (flags & MSG_DONTWAIT))
+            {
+                break;
+            }
+            continue;
+        }
 
-		/*Second package transmiting*/
-		if(sendto(socket->sd, header, sizeof(microtcp_header_t), 0, &socket->address, socket->address_len) == -1 )
-        {	
-			socket->state=INVALID;
-			perror("ERRROR AT Shutdown Packet2 Send");
-			return -1;
-		}
+        /*An ACK of non-blocking sends*/
+        if(socket->sndb != NULL && !(header.control & FIN) && (header.control & ACK))
+        {
+            if(send_input(socket, &header, sndbuf_unsent(socket)) == -1 || send_pending(socket) == -1)
+            {
+                return -1;
+            }
+            continue;
+        }
 
-		socket->state = CLOSING_BY_PEER;
+        ret = recv_input(socket, &header, payload, crc, &iov, &iov_offset, length - bytes, &direct, &pushed);
+        if(ret == -1)
+        {
+            return -1;
+        }
+        bytes += direct;
+        if(ret == 1)
+        {
+            break;
+        }
+    }
 
-		/*Third package creation*/
-		header_init(header);
-		header->control = FIN_ACK;
-		header->seq_number = (rand()% (11000 - 1000 + 1)) + 1000;
-		header->checksum = crc32((uint8_t*)header, sizeof(microtcp_header_t));
-		tmp_ack = header->seq_number;
+    /*Nothing would send a delayed ACK while the application is away. Neither
+      would anything tell a sender stopped by a window too small for a segment
+      that reading has opened it, but for its next window probe*/
+    if((socket->ack_pending > 0 || (window < socket->mss && recv_window(socket) >= socket->mss && socket->state == ESTABLISHED))
+        && send_ack(socket) == -1)
+    {
+        socket->state = INVALID;
+        return -1;
+    }
 
-		printf("\nTransmiting 3rd package (shutdown)\n");
-    	header_print(header);
-    	printf("\n");
+    if(tx_flush(socket) == -1)
+    {
+        socket->state = INVALID;
+        return -1;
+    }
 
-		/*Convert into network byte order*/
-		header_hton(header);
+    if(bytes == 0 && length > 0 && socket->state == ESTABLISHED && (flags & MSG_DONTWAIT))
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    return bytes;
+}
 
-		/*Transmiting third package*/
-		if(sendto(socket->sd, header, sizeof(microtcp_header_t), 0, &socket->address, socket->address_len) == -1 )
-        {
-			socket->state=INVALID;
-			perror("ERRROR AT Shutdown Packet3 Send");
-			return -1;
-		}
+/**
+*   READINESS
+*   A connection makes progress only while a call runs on it. Without a
+*   blocking call in progress it is driven by microtcp_events(), which does
+*   what is due and reports what the socket is ready for.
+*/
 
-		/*Forth package download **/
-		if(recvfrom(socket->sd, header,sizeof(microtcp_header_t), 0, &socket->address, &socket->address_len) == -1)
-        {
-			socket->state=INVALID;
-			perror("ERRROR AT Shutdown Packet4 Recieve");
-			return -1;
-		}
+/*Takes a segment that has arrived on the connection, an ACK of the data sent,
+  data, or a segment of the FIN handshake. The receive buffer gets the data.
+  Returns -1 on error*/
+static int conn_input(microtcp_sock_t *socket, microtcp_header_t *header, const uint8_t *payload, uint32_t crc)
+{
+    const struct iovec *iov = NULL;
+    size_t iov_offset = 0, taken;
+    int pushed;
 
-		/*Convert into host byte order*/
-		header_ntoh(header);
+    if(conn_closing(socket))
+    {
+        return close_input(socket, header);
+    }
+    if(!(header->control & FIN) && (header->control & ACK))
+    {
+        return send_input(socket, header, sndbuf_unsent(socket));
+    }
+    return recv_input(socket, header, payload, crc, &iov, &iov_offset, 0, &taken, &pushed) == -1 ? -1 : 0;
+}
 
-		printf("\nRecieved 4th package (shutdown)\n");
-    	header_print(header);
-    	printf("\n");
+/**
+*   Takes every segment already queued on the connection, ACKs and data
+*   alike, fires the expired timers and transmits what the window has room
+*   for, without blocking. Once microtcp_shutdown() was called it moves the
+*   FIN handshake on. Returns -1 on error.
+*/
+static int conn_drive(microtcp_sock_t *socket)
+{
+    const uint8_t *payload;
+    microtcp_header_t header;
+    uint32_t crc;
+    int ret;
 
-		/*Forth package checks*/
-		if(!check_sum(header)) 
-        {
-        	perror("ERRROR AT Shutdown Packet4 Recieve CHECKSUM");
-        	socket->state = INVALID;
-        	return -1;
-    	}
-		
-        if(header->control != ACK) 
+    for(;;)
+    {
+        ret = recv_segment(socket, &header, &payload, 0, &crc);
+        if(ret == -1)
         {
-        	perror("ERRROR AT Shutdown Packet4 Recieve CONTROL");
-        	socket->state = INVALID;
-        	return -1;
-    	}
-		
-        if(header->seq_number != (tmp_seq +1)) 
+            socket->state = INVALID;
+            return -1;
+        }
+        if(ret == 0)
         {
-        	perror("ERRROR AT Shutdown Packet4 Recieve SEQ NUMBER");
-        	socket->state = INVALID;
-        	return -1;
-    	}
+            break;
+        }
 
-		if(header->ack_number != (tmp_ack +1)) 
+        if(conn_input(socket, &header, payload, crc) == -1)
         {
-        	perror("ERRROR AT Shutdown Packet4 Recieve ACK NUMBER");
-        	socket->state = INVALID;
-        	return -1;
-    	}
-	
+            return -1;
+        }
     }
-    else
+
+    if(socket->state == ESTABLISHED && send_pending(socket) == -1)
     {
-		return -1;
-	}
+        return -1;
+    }
+    if(close_drive(socket) == -1)
+    {
+        return -1;
+    }
+    if(conn_timers(socket) == -1)
+    {
+        return -1;
+    }
+    conn_arm(socket);
 
-	socket->state = CLOSED;
-	free(header);
-	free(socket->recvbuf);
-	return 0;
+    if(tx_flush(socket) == -1)
+    {
+        socket->state = INVALID;
+        return -1;
+    }
+    return 0;
 }
 
-ssize_t microtcp_send (microtcp_sock_t *socket, const void *buffer, size_t length, int flags)
-{	
-	size_t remaining, data_sent, bytes_to_send, chunks;
-	microtcp_header_t *header = malloc(sizeof(microtcp_header_t));
-	void *segment = malloc(MICROTCP_MSS);
-	int ack_count = 0;
-	data_sent = 0;
-	remaining = length;	
-
-	while(data_sent < length )
-    {		
-
-		bytes_to_send = min(socket->curr_win_size , socket->cwnd , remaining ); 
-		chunks = bytes_to_send / MICROTCP_MSS ;  
-		
-        for(int i = 0; i < chunks; i++){	
-			header_init(header);
-			header->seq_number = (uint8_t) socket->seq_number + data_sent + i*(MICROTCP_MSS - sizeof(microtcp_header_t));	
-			header->ack_number = (uint8_t) socket->ack_number + ack_count;
-			header->data_len = MICROTCP_MSS - sizeof(microtcp_header_t);	
-			memcpy(segment, header, sizeof(microtcp_header_t));
-			memcpy(segment + sizeof(microtcp_header_t), buffer+data_sent , MICROTCP_MSS - sizeof(microtcp_header_t) );
-			header->checksum = crc32(segment, sizeof(microtcp_header_t));
-			header_hton(header);
-			memcpy(segment, header, sizeof(microtcp_header_t));
-			
-            if( sendto(socket->sd, segment, MICROTCP_MSS, 0, &socket->address, socket->address_len) == -1 ) 
-            {
-				socket->state=INVALID;
-				perror("ERRROR AT Shutdown Packet3 Send");
-				return -1;
-			}
-		}
+int microtcp_fd (microtcp_sock_t *socket)
+{
+    return socket->uring != NULL ? uring_fd(socket->uring) : socket->sd;
+}
 
-		data_sent =+ bytes_to_send;
-		free(segment);
-		segment = malloc(bytes_to_send % MICROTCP_MSS);
-	
-		if(bytes_to_send % MICROTCP_MSS){ 
-			header_init(header);
-			header->seq_number = (uint8_t) socket->seq_number + data_sent + chunks*(MICROTCP_MSS - sizeof(microtcp_header_t));
-			chunks ++;
-			header->data_len = bytes_to_send % MICROTCP_MSS;
-			memcpy(segment, header, sizeof(microtcp_header_t));
-			memcpy(segment + sizeof(microtcp_header_t), buffer+data_sent , MICROTCP_MSS - sizeof(microtcp_header_t) );
-			header->checksum = crc32(segment, sizeof(microtcp_header_t));
-			header_hton(header);
-			memcpy(segment, header, sizeof(microtcp_header_t));
-			if( sendto(socket->sd, segment, MICROTCP_MSS, 0, &socket->address, socket->address_len) == -1 ) 
-            {
-				socket->state=INVALID;
-				perror("ERRROR AT Shutdown Packet3 Send");
-				return -1;
-			}
+int microtcp_events (microtcp_sock_t *socket, int64_t *timeout_us)
+{
+    int events = 0;
 
-		}
+    *timeout_us = -1;
+    switch(socket->state)
+    {
+        case LISTEN:
+            /*Moves the handshakes on, the connections that are done wait for accept*/
+            if(listen_drive(socket) == -1)
+            {
+                return POLLERR;
+            }
+            *timeout_us = listen_next(socket);
+            for(struct microtcp_half_open *half = socket->demux->half_open; half != NULL; half = half->next)
+            {
+                if(half->conn.state == ESTABLISHED)
+                {
+                    return POLLIN;
+                }
+            }
+            return 0;
+        case ESTABLISHED:
+        case CLOSING_BY_PEER:
+        case FIN_WAIT:
+        case CLOSING_BY_HOST:
+        case LAST_ACK:
+        case TIME_WAIT:
+            if(conn_drive(socket) == -1)
+            {
+                return POLLERR;
+            }
+            break;
+        case UNKNOWN:
+            return 0;
+        default:
+            break;
+    }
 
-		microtcp_header_t * recv_header = malloc(sizeof(microtcp_header_t));
-        int retrasmit = 0;
-        uint32_t temp_seq = 0, temp_ack = 0;
-        int counter = 0;
+    /*A connection being shut down is only waited on until the handshake is over*/
+    if(socket->closing && socket->state != CLOSED && socket->state != INVALID)
+    {
+        *timeout_us = conn_next(socket);
+        return 0;
+    }
 
-        for (int i = 0; i < chunks; i++)
-        {
-            if(recvfrom(socket->sd, recv_header, sizeof(microtcp_header_t), 0, &socket->address, &socket->address_len) == -1)
+    switch(socket->state)
+    {
+        case ESTABLISHED:
+            if(socket->buf_fill_level > 0)
             {
-                perror("ERRROR AT Time out");
-                retrasmit = 1;
-                break;
+                events |= POLLIN;
             }
-            
-            header_ntoh(recv_header);
-            
-            if(recv_header->control != ACK) 
+            if(socket->sndb == NULL || (uint32_t)(socket->snd_end - socket->snd_una) < socket->sndb->len)
             {
-                perror("ERRROR AT NOT ACK");
+                events |= POLLOUT;
             }
-            else  
-            {               
-                if (header->ack_number == temp_ack || header->seq_number == temp_seq) 
+            *timeout_us = conn_next(socket);
+            return events;
+        case CLOSING_BY_PEER:
+            *timeout_us = conn_next(socket);
+            return POLLIN | POLLHUP;
+        case INVALID:
+            return POLLERR;
+        default:
+            return POLLHUP;
+    }
+}
+
+int microtcp_poll (microtcp_pollfd_t *fds, nfds_t nfds, int timeout)
+{
+    struct pollfd stack_pfds[MICROTCP_POLL_FDS + 1];
+    struct pollfd *pfds = stack_pfds;
+    uint64_t deadline = now_us() + (int64_t)timeout * 1000;
+    uint64_t now;
+    struct timespec ts;
+    int64_t wait, next;
+    int ready, stashed, ret;
+
+    for(;;)
+    {
+        /*A socket may read the segments of another one of its demux, which
+          is then driven again before anything blocks*/
+        do
+        {
+            ready = 0;
+            stashed = 0;
+            next = -1;
+            for(nfds_t i = 0; i < nfds; i++)
+            {
+                fds[i].revents = microtcp_events(fds[i].socket, &wait) & (fds[i].events | POLLERR | POLLHUP);
+                if(fds[i].revents != 0)
                 {
-                    perror("ERRROR AT Wrong ack or seq");
-                    i -= 2;
-                    counter++;
+                    ready++;
                 }
-                else 
+                if(wait >= 0 && (next < 0 || wait < next))
                 {
-
-                    temp_seq = header->seq_number;  
-                    temp_ack = header->ack_number;    
-                    counter = 0;
+                    next = wait;
+                }
+                if(fds[i].socket->state == LISTEN ? listen_stashed(fds[i].socket) : fds[i].socket->stash != NULL)
+                {
+                    stashed = 1;
                 }
             }
+        } while(ready == 0 && stashed);
+
+        if(ready > 0 || timeout == 0)
+        {
+            break;
         }
 
+        now = now_us();
+        if(timeout > 0 && now >= deadline)
+        {
+            break;
+        }
 
-		/* Retransmissions, Update window, Update congestion control */
-		socket->curr_win_size = header->window;
-		remaining -= (bytes_to_send - chunks*sizeof(microtcp_header_t));
-		data_sent += (bytes_to_send - chunks*sizeof(microtcp_header_t));
-		ack_count++;
+        /*The timers of all the sockets go off on the timerfd of the thread.
+          The sockets are driven again for those that are already due*/
+        if(timer_expire(now) > 0)
+        {
+            continue;
+        }
 
-		}	
-    return 0;
-}
+        /*Only a call that blocks on more than MICROTCP_POLL_FDS sockets allocates*/
+        if(nfds > MICROTCP_POLL_FDS && pfds == stack_pfds)
+        {
+            pfds = (struct pollfd*) malloc((nfds + 1) * sizeof(struct pollfd));
+            if(pfds == NULL)
+            {
+                perror("ERROR AT Poll: Memory Allocation");
+                ready = -1;
+                break;
+            }
+        }
+        pfds[nfds].fd = timer_fd(now);
+        pfds[nfds].events = POLLIN;
+        if(pfds[nfds].fd >= 0)
+        {
+            next = -1;
+        }
 
-ssize_t microtcp_recv (microtcp_sock_t *socket, void *buffer, size_t length, int flags)
-{  
-    void* recv_segment = malloc(MICROTCP_MSS);
-    microtcp_header_t* header = malloc(sizeof(microtcp_header_t));
-    ssize_t total_data = 0;
-        
-    if (recvfrom(socket->sd, recv_segment, MICROTCP_MSS, 0, &socket->address, &socket->address_len) == -1)
-    {
-        perror("ERRROR AT Time out");
-        return  0;
-    }
-        
-    memcpy(header, recv_segment, sizeof(microtcp_header_t));    
-    header_ntoh(header);
-    header_print(header);
+        if(timeout > 0 && (next < 0 || deadline - now < (uint64_t)next))
+        {
+            next = deadline - now;
+        }
 
-    if (header->control == FIN_ACK) 
-    {
-        return total_data;
+        for(nfds_t i = 0; i < nfds; i++)
+        {
+            pfds[i].fd = microtcp_fd(fds[i].socket);
+            pfds[i].events = POLLIN;
+        }
+        ts.tv_sec = next / 1000000;
+        ts.tv_nsec = (next % 1000000) * 1000;
+        ret = ppoll(pfds, nfds + 1, next >= 0 ? &ts : NULL, NULL);
+        if(ret == -1 && errno != EINTR)
+        {
+            perror("ERROR AT Poll");
+            ready = -1;
+            break;
+        }
     }
-    
-    memcpy(buffer, recv_segment + 32, MICROTCP_MSS - 32);
-    total_data+= header->data_len;
 
-    return total_data;
+    if(pfds != stack_pfds)
+    {
+        free(pfds);
+    }
+    return ready;
 }
 
 void header_init(microtcp_header_t *header)
@@ -23,6 +23,8 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <poll.h>
 #include <stdint.h>
 #include "stdio.h"
 #include "stdlib.h"
@@ -30,14 +32,80 @@
 #include "string.h"
 
 /*
- * Several useful constants
+ * Several useful constants. The ones a socket option can change are only
+ * its defaults.
  */
-#define MICROTCP_ACK_TIMEOUT_US 200000
+#define MICROTCP_ACK_TIMEOUT_US 200000     /* RTO until the first RTT sample */
+#define MICROTCP_MIN_RTO_US 1000
+#define MICROTCP_MAX_RTO_US 60000000
 #define MICROTCP_MSS 1400
-#define MICROTCP_RECVBUF_LEN 8192
+#define MICROTCP_RECVBUF_LEN (256 * 1024) /* Default, must be a power of two */
+#define MICROTCP_SNDBUF_LEN (256 * 1024) /* Default of the buffer of non-blocking sends */
+#define MICROTCP_MAX_RECVBUF_LEN (1 << 30)
+#define MICROTCP_MAX_WSCALE 14
 #define MICROTCP_WIN_SIZE MICROTCP_RECVBUF_LEN
 #define MICROTCP_INIT_CWND (3 * MICROTCP_MSS)
 #define MICROTCP_INIT_SSTHRESH MICROTCP_WIN_SIZE
+#define MICROTCP_DUPACK_THRESH 3
+#define MICROTCP_ACK_EVERY 2            /* In order segments acknowledged by one ACK */
+#define MICROTCP_DELACK_US 200          /* Longest an ACK is delayed */
+#define MICROTCP_SNDQ_LEN 64
+#define MICROTCP_TX_BATCH 64
+#define MICROTCP_RX_BATCH 64
+#define MICROTCP_POLL_FDS 64           /* Sockets microtcp_poll() blocks on without a malloc() */
+#define MICROTCP_SEG_IOV 8
+#define MICROTCP_OOO_RANGES 16
+#define MICROTCP_ZEROCOPY_MIN 16384
+#define MICROTCP_PACING_SPIN_US 10
+#define MICROTCP_MIN_MSS 64
+#define MICROTCP_MAX_MSS (65507 - 32)   /* The largest UDP payload, less the header */
+#define MICROTCP_CC_NAME_MAX 16
+#define MICROTCP_PLPMTU_MAX_MSS (9000 - 20 - 8 - 32) /* A jumbo frame, less the IPv4,
+                                                        UDP and microTCP headers */
+#define MICROTCP_PLPMTU_PROBES 3        /* Losses of a probe size before giving up on it */
+#define MICROTCP_PLPMTU_STEP 16         /* The search ends when the bounds are this close */
+#define MICROTCP_PLPMTU_RAISE_US 600000000 /* Time before a finished search starts over */
+#define MICROTCP_LISTEN_BACKLOG 128     /* Pending connections when listen() is given none */
+#define MICROTCP_SYNACK_RETRIES 5       /* SYN_ACKs sent again before a half-open connection is dropped */
+#define MICROTCP_FIN_RETRIES 5          /* FINs sent again before microtcp_shutdown() gives up */
+#define MICROTCP_FIN_WAIT_US 60000000   /* Longest wait for the FIN of the peer */
+#define MICROTCP_TIME_WAIT_US 1000000  /* Least time TIME_WAIT answers a FIN of the peer
+                                           sent again, three lost ACKs at the initial RTO */
+#define MICROTCP_DEMUX_POOL_LEN 256     /* Preallocated datagrams routed between connections */
+#define MICROTCP_DEMUX_STASH_LEN 256    /* Routed segments a connection holds before dropping */
+
+/*
+ * Flags of microtcp_send() and microtcp_sendv(). MSG_DONTWAIT of
+ * sys/socket.h makes them, and microtcp_recv(), non-blocking
+ */
+#define MICROTCP_ZEROCOPY 0x4000000 /**< Send with MSG_ZEROCOPY if the write is
+                                          at least MICROTCP_ZEROCOPY_MIN bytes */
+#define MICROTCP_SEGMENT_LEN (sizeof(microtcp_header_t) + MICROTCP_MSS)
+
+/*
+ * Flag of the type of microtcp_socket(), like SOCK_NONBLOCK of socket()
+ */
+#define MICROTCP_SOCK_URING 0x40000000 /**< Move the datagrams of the connection
+                                            through io_uring, see microtcp_socket() */
+
+/*
+ * Options offered in future_use0 of SYN, and agreed in future_use0 of SYN_ACK
+ */
+#define MICROTCP_OPT_SACK 0x1   /**< Selective ACKs. A pure ACK carries in future_use1
+                                     and future_use2 the [start, end) of the out of order
+                                     range received last, or twice the same number if
+                                     there is none */
+#define MICROTCP_OPT_TIMESTAMPS 0x2 /**< A data segment carries in future_use0 the
+                                     sender's clock in microseconds, a pure ACK
+                                     echoes there the one of the segment it answers */
+#define MICROTCP_OPT_WSCALE 0x4 /**< Window scaling. SYN and SYN_ACK carry in future_use1
+                                     the shift the sender applies to every window it
+                                     advertises after them, their own are not scaled */
+/*
+ * SYN and SYN_ACK always carry in future_use2 the largest payload their sender
+ * receives, the MSS of the connection is the lower of the two ends.
+ */
+#define MICROTCP_OPT_ALL (MICROTCP_OPT_SACK | MICROTCP_OPT_TIMESTAMPS | MICROTCP_OPT_WSCALE)
 
 
 #define FIN     1   //0000000000000001
@@ -46,17 +114,27 @@
 #define ACK     8   //0000000000001000
 #define SYN_ACK 10  //0000000000001010
 #define FIN_ACK 9   //0000000000001001
+#define PROBE   16  //0000000000010000  Path MTU probe, its payload is padding
+#define PSH     32  //0000000000100000  Last segment of a write, acknowledged at once
+#define PROBE_ACK 24 //0000000000011000 Answer to a probe, future_use1 and future_use2
+                     //                 are both the probe's data_len
 
 /**
- * Possible states of the microTCP socket
+ * Possible states of the microTCP socket. microtcp_shutdown() takes the
+ * client through FIN_WAIT, CLOSING_BY_HOST and TIME_WAIT, and the server
+ * through CLOSING_BY_PEER and LAST_ACK
  */
 typedef enum
 {
   UNKNOWN,
   LISTEN,
+  SYN_RECEIVED,
   ESTABLISHED,
   CLOSING_BY_PEER,
   CLOSING_BY_HOST,
+  FIN_WAIT,
+  LAST_ACK,
+  TIME_WAIT,
   CLOSED,
   INVALID
 } mircotcp_state_t;
@@ -68,6 +146,110 @@ typedef enum
 } microtcp_caller;
 
 
+/**
+ * microTCP header structure
+ * NOTE: DO NOT CHANGE!
+ */
+typedef struct
+{
+  uint32_t seq_number;          /**< Sequence number */
+  uint32_t ack_number;          /**< ACK number */
+  uint16_t control;             /**< Control bits (e.g. SYN, ACK, FIN) */
+  uint16_t window;              /**< Window size in bytes */
+  uint32_t data_len;            /**< Data length in bytes (EXCLUDING header) */
+  uint32_t future_use0;         /**< 32-bits for future use */
+  uint32_t future_use1;         /**< 32-bits for future use */
+  uint32_t future_use2;         /**< 32-bits for future use */
+  uint32_t checksum;            /**< CRC-32 checksum, see crc32() in utils folder */
+} microtcp_header_t;
+
+/**
+ * A data segment that has been transmitted but not yet acknowledged.
+ * The header is kept in network byte order, so a retransmission puts
+ * exactly the same bytes on the wire without rebuilding the segment.
+ */
+typedef struct
+{
+  microtcp_header_t header;     /**< The header as it was sent on the wire */
+  const struct iovec *iov;      /**< The caller's iovec where the payload starts */
+  size_t iov_offset;            /**< Offset of the payload inside iov. The payload
+                                     may go on over at most MICROTCP_SEG_IOV iovecs */
+  size_t data_len;              /**< Payload length in bytes */
+  uint32_t seq_number;          /**< Sequence number of the first payload byte */
+  uint64_t sent_time_us;        /**< Time of the last (re)transmission */
+  uint64_t delivered;           /**< The socket's delivered when it was sent */
+  uint64_t delivered_time_us;   /**< The socket's delivered_time_us when it was sent */
+  int app_limited;              /**< Sent while the application had nothing more to send */
+  uint32_t retransmissions;     /**< How many times it has been retransmitted */
+  int sacked;                   /**< The peer holds it out of order, it is not resent */
+} microtcp_segment_t;
+
+/**
+ * A range [start, end) of sequence numbers
+ */
+typedef struct
+{
+  uint32_t start;
+  uint32_t end;
+} microtcp_range_t;
+
+/**
+ * State of the packetization layer path MTU discovery (RFC 8899). The search
+ * probes for a payload between low and high, one probe at a time, and raises
+ * the MSS to every size that gets through.
+ */
+typedef struct
+{
+  size_t low;                   /**< Largest payload known to get through */
+  size_t high;                  /**< Largest payload that may get through */
+  size_t max;                   /**< The lower max_mss of the two ends, where a new
+                                     search starts from */
+  size_t probe;                 /**< Payload of the probe in flight, 0 if there is none */
+  uint32_t attempts;            /**< Probes of this size lost so far */
+  uint64_t sent_us;             /**< When the probe in flight left */
+  uint64_t next_us;             /**< When the next search may start */
+} microtcp_plpmtu_t;
+
+/**
+ * Segments waiting to be flushed to the network with a single sendmmsg()
+ */
+struct microtcp_tx_batch;
+
+/**
+ * Segments pulled from the network with a single recvmmsg(), already validated
+ */
+struct microtcp_rx_ring;
+
+/**
+ * The data of non-blocking sends until it is acknowledged
+ */
+struct microtcp_sndbuf;
+
+/**
+ * The io_uring the datagrams of a connection go through, see microtcp_uring.c
+ */
+struct microtcp_uring;
+
+/**
+ * A timer of the wheel the connections of a thread share, see microtcp_timer.c
+ */
+struct microtcp_timer;
+
+/**
+ * A congestion control algorithm, see microtcp_cc.c
+ */
+struct microtcp_cc_ops;
+
+/**
+ * The connections of a listener, which share its UDP socket, by peer address
+ */
+struct microtcp_demux;
+
+/**
+ * A datagram read by one socket of a demux on behalf of another
+ */
+struct microtcp_dgram;
+
 /**
  * This is the microTCP socket structure. It holds all the necessary
  * information of each microTCP socket.
@@ -79,23 +261,141 @@ typedef struct
   size_t init_win_size;         /**< The window size negotiated at the 3-way handshake */
   size_t curr_win_size;         /**< The current window size */
 
+  size_t recvbuf_len;           /**< Set before connect/accept to the size of recvbuf, it is
+                                     rounded up to a power of two up to MICROTCP_MAX_RECVBUF_LEN */
+  uint8_t rcv_wscale;           /**< Shift of the windows this end advertises */
+  uint8_t snd_wscale;           /**< Shift of the windows the peer advertises */
   uint8_t *recvbuf;             /**< The *receive* buffer of the TCP
                                      connection. It is allocated during the connection establishment and
-                                     is freed at the shutdown of the connection. This buffer is used
-                                     to retrieve the data from the network. */
-  size_t buf_fill_level;        /**< Amount of data in the buffer */
+                                     is freed at the shutdown of the connection. It is a circular buffer
+                                     where each byte of the stream is kept at its sequence number modulo
+                                     recvbuf_len, so out of order segments wait there until
+                                     the holes before them are filled. */
+  size_t buf_fill_level;        /**< In order bytes not yet read, the ones right before ack_number */
+  uint32_t fin_gap;             /**< Sequence numbers the FIN of the peer took after them */
+  microtcp_range_t ooo[MICROTCP_OOO_RANGES]; /**< Out of order data held in recvbuf after
+                                     ack_number, sorted and never touching each other */
+  size_t ooo_len;               /**< Number of ranges in ooo */
+  uint32_t ooo_recent;          /**< Start of the last out of order segment */
+  uint32_t sack_turn;           /**< ACKs sent with a SACK block. Every other one reports
+                                     the range of ooo_recent, the others go over all
+                                     the ranges in turn */
 
   size_t cwnd;
   size_t ssthresh;
+  uint32_t dup_acks;            /**< Duplicate ACKs in a row */
+  uint32_t recover;             /**< Highest sequence number sent when fast recovery or
+                                     the last retransmission timeout started */
+  int in_recovery;              /**< Fast recovery is in progress */
+  int rto_recovery;             /**< The losses of a timeout are being resent, until
+                                     recover is acknowledged */
+  uint32_t sack_high;           /**< End of the highest data the peer SACKed, snd_una if none.
+                                     The segments before it that are not sacked are lost */
+  uint32_t high_rxt;            /**< Those lost segments before it were resent in the
+                                     current recovery */
+  uint32_t ts_recent;           /**< Timestamp of the oldest data segment not yet
+                                     acknowledged, echoed by the next ACK */
+  uint32_t ack_every;           /**< In order segments one ACK covers, 1 to ACK every one */
+  uint64_t delack_us;           /**< Longest an ACK waits for more segments */
+  uint32_t ack_pending;         /**< Segments received since the last ACK */
+  uint64_t ack_deadline_us;     /**< When the pending ACK has to go out */
+  uint64_t srtt_us;             /**< Smoothed RTT, 0 until the first sample */
+  uint64_t rttvar_us;           /**< RTT variation */
+  uint64_t rto_us;              /**< Retransmission timeout */
+  uint64_t rto_deadline_us;     /**< When the retransmission timer goes off while data is in flight */
+  const struct microtcp_cc_ops *cc; /**< Congestion control, Reno by default */
+  uint64_t cc_priv[20];         /**< Private state of the congestion control */
+  uint64_t pacing_rate;         /**< Bytes per second the congestion control wants
+                                     the segments spread at, 0 for no pacing */
+  uint64_t max_pacing_rate;     /**< Set to cap the pacing rate, in bytes per second.
+                                     0 paces only at the congestion control's rate */
+  size_t pacing_quantum;        /**< Set to the bytes that may leave back to back,
+                                     0 for about 1 ms of the rate and at least two segments */
+  uint64_t pacing_next_us;      /**< When the next segment may leave */
+  size_t mss;                   /**< Payload bytes per segment, never above the peer's
+                                     max_mss. Path MTU discovery raises it from there */
+  size_t max_mss;               /**< Set before connect/accept to the largest payload
+                                     this end receives and probes the path for */
+  size_t base_mss;              /**< mss when the connection started, the fallback
+                                     when larger segments stop getting through */
+  microtcp_plpmtu_t plpmtu;     /**< Path MTU search, off while high is not above low */
+  size_t init_cwnd;             /**< cwnd when the connection starts */
+  size_t init_ssthresh;         /**< ssthresh when the connection starts */
+  uint64_t min_rto_us;          /**< Lowest retransmission timeout */
+  uint64_t max_rto_us;          /**< Highest retransmission timeout, backoff included */
+  uint64_t delivered;           /**< Bytes acknowledged since the connection started */
+  uint64_t delivered_time_us;   /**< When delivered last grew */
+  uint64_t app_limited;         /**< While delivered has not reached it, the flight
+                                     is limited by the application, 0 if it is not */
 
   size_t seq_number;            /**< Keep the state of the sequence number */
   size_t ack_number;            /**< Keep the state of the ack number */
+  size_t snd_una;               /**< Oldest sequence number not yet acknowledged */
+
+  microtcp_segment_t *sndq;     /**< Retransmission queue. A ring of the
+                                     segments in flight, ordered by sequence number */
+  size_t sndq_cap;              /**< Capacity of the ring, always a power of two */
+  size_t sndq_head;             /**< Index of the oldest segment in flight */
+  size_t sndq_len;              /**< Number of segments in flight */
+  struct microtcp_rx_ring *rxr; /**< Incoming segments not yet processed */
+  size_t sndbuf_len;            /**< Set before the first non-blocking send to the
+                                     size of sndb, it is rounded up to a power of two */
+  struct microtcp_sndbuf *sndb; /**< Non-blocking sends, NULL until the first one */
+  size_t snd_end;               /**< Sequence number after the last byte in sndb */
+  uint64_t persist_us;          /**< When the peer's closed window is probed next,
+                                     0 while nothing waits on it */
+  int closing;                  /**< microtcp_shutdown() was called, the FIN goes out
+                                     once the data before it is acknowledged */
+  uint32_t fin_seq;             /**< Sequence number of the FIN of this end */
+  uint32_t fin_tries;           /**< Times the FIN was sent */
+  uint64_t close_us;            /**< When the FIN is sent again, the wait for the one of
+                                     the peer gives up or TIME_WAIT ends, 0 if none */
+  struct microtcp_timer *timers; /**< The delayed ACK, retransmission, window probe,
+                                     pacing and close timers, while the connection is up.
+                                     They are on the timer wheel of the thread that drives it */
+  unsigned int timers_due;      /**< A bit per timer that went off and was not dealt with */
+
+  int zc_enabled;               /**< SO_ZEROCOPY state of sd, 0 not yet requested,
+                                     1 enabled, -1 not supported by the kernel */
+  int zc_active;                /**< The send in progress uses MSG_ZEROCOPY */
+  uint32_t zc_sent;             /**< Zero-copy sends issued, the kernel numbers them from 0 */
+  uint32_t zc_completed;        /**< Zero-copy sends the kernel reported as done */
+
+  uint32_t options;             /**< MICROTCP_OPT_* flags offered at connect/accept,
+                                     the ones both ends agreed on afterwards */
+
+  int offload;                  /**< Set before connect/accept to hand runs of
+                                     segments to the kernel with UDP GSO, and take
+                                     them back coalesced with UDP GRO */
+  struct microtcp_tx_batch *txb; /**< Outgoing segments not yet handed to the kernel */
+  int io_uring;                 /**< Set by MICROTCP_SOCK_URING at creation, cleared
+                                     if the kernel can not do it */
+  struct microtcp_uring *uring; /**< The ring of the connection, NULL on the system
+                                     call path */
+
   uint64_t packets_send;
   uint64_t packets_received;
   uint64_t packets_lost;
   uint64_t bytes_send;
   uint64_t bytes_received;
   uint64_t bytes_lost;
+  uint64_t packets_reordered;   /**< Segments that arrived ahead of a hole and were kept */
+  uint64_t acks_saved;          /**< ACKs not sent, as one covered several segments */
+  uint64_t tx_syscalls_saved;   /**< sendto() calls avoided by batching segments in sendmmsg() */
+  uint64_t rx_syscalls_saved;   /**< recvfrom() calls avoided by batching segments in recvmmsg(),
+                                     or by taking them from the io_uring */
+  uint64_t zc_copied;           /**< Zero-copy sends the kernel had to copy after all */
+  uint64_t heap_allocs;         /**< malloc() calls of the connection once set up, the
+                                     retransmission queue growing or being split for a
+                                     smaller MSS. It stays 0 in steady state */
+
+  struct microtcp_demux *demux; /**< The connection table of the listener this
+                                     socket shares sd with, NULL if sd is its own */
+  struct microtcp_dgram *stash; /**< Segments for this socket read by another one of
+                                     the demux, oldest first. SYNs of new peers on a listener */
+  struct microtcp_dgram *stash_tail;
+  size_t stash_len;
+  struct microtcp_dgram *stash_held; /**< Stashed segments the receive ring points into */
 
   struct sockaddr address;
   socklen_t address_len;
@@ -103,25 +403,58 @@ typedef struct
 
 } microtcp_sock_t;
 
-
 /**
- * microTCP header structure
- * NOTE: DO NOT CHANGE!
+ * A delivery rate sample, measured over the newest segment an ACK covers
  */
 typedef struct
 {
-  uint32_t seq_number;          /**< Sequence number */
-  uint32_t ack_number;          /**< ACK number */
-  uint16_t control;             /**< Control bits (e.g. SYN, ACK, FIN) */
-  uint16_t window;              /**< Window size in bytes */
-  uint32_t data_len;            /**< Data length in bytes (EXCLUDING header) */
-  uint32_t future_use0;         /**< 32-bits for future use */
-  uint32_t future_use1;         /**< 32-bits for future use */
-  uint32_t future_use2;         /**< 32-bits for future use */
-  uint32_t checksum;            /**< CRC-32 checksum, see crc32() in utils folder */
-} microtcp_header_t;
+  uint64_t delivered;           /**< Bytes delivered while that segment was in flight */
+  uint64_t interval_us;         /**< Time they took */
+  uint64_t prior_delivered;     /**< The socket's delivered when that segment was sent */
+  uint64_t rtt_us;              /**< RTT sample of the ACK, 0 if there is none */
+  int is_app_limited;           /**< The application, not the network, limited the rate */
+} microtcp_rate_sample_t;
 
+/**
+ * The callbacks of a congestion control algorithm. They own cwnd and
+ * ssthresh, while fast recovery (window inflation, partial ACKs) stays in
+ * the protocol.
+ */
+typedef struct microtcp_cc_ops
+{
+  const char *name;
+  /** Called when the connection is established */
+  void (*init) (microtcp_sock_t *socket);
+  /** Called for every ACK of new data outside fast recovery */
+  void (*on_ack) (microtcp_sock_t *socket, size_t acked, uint64_t now_us);
+  /** Called when fast retransmit detects a loss, sets ssthresh and cwnd */
+  void (*on_loss) (microtcp_sock_t *socket);
+  /** Called when the retransmission timer expires, sets ssthresh and cwnd */
+  void (*on_timeout) (microtcp_sock_t *socket);
+  /** Called for every RTT sample, may be NULL */
+  void (*on_rtt_sample) (microtcp_sock_t *socket, uint64_t rtt_us);
+  /** Called for every ACK of new data, in fast recovery too and before
+      on_ack, may be NULL */
+  void (*on_rate_sample) (microtcp_sock_t *socket,
+                          const microtcp_rate_sample_t *rs);
+} microtcp_cc_ops_t;
+
+extern const microtcp_cc_ops_t microtcp_cc_reno;
+extern const microtcp_cc_ops_t microtcp_cc_cubic;
+extern const microtcp_cc_ops_t microtcp_cc_bbr;
 
+
+
+/**
+ * Opens a socket. type is SOCK_DGRAM, maybe with MICROTCP_SOCK_URING for
+ * the io_uring backend: once connected, the segments are sent and received
+ * through a ring shared with the kernel, with a multishot receive into
+ * buffers registered once, instead of sendmmsg() and recvmmsg(). Kernels
+ * without it, and the connections of microtcp_accept_conn() which share
+ * the socket of their listener, keep the system calls.
+ *
+ * @return the socket, its state is INVALID on failure
+ */
 microtcp_sock_t
 microtcp_socket (int domain, int type, int protocol);
 
@@ -146,15 +479,303 @@ int
 microtcp_accept (microtcp_sock_t *socket, struct sockaddr *address,
                  socklen_t address_len);
 
+/**
+ * Turns a bound socket into a listener for microtcp_accept_conn(). The
+ * connections it accepts share its UDP socket, every datagram is routed to
+ * its connection by the address and port of the peer. Socket options set
+ * on the listener before this call are inherited by its connections.
+ *
+ * The listener and its connections are not thread safe, they are meant to
+ * be driven by a single thread.
+ *
+ * @param socket the socket structure, bound and not connected
+ * @param backlog connections from new peers that may wait for
+ * microtcp_accept_conn(), MICROTCP_LISTEN_BACKLOG if not positive. Further
+ * SYNs are dropped
+ * @return 0 on success or -1 on failure, with errno set
+ */
+int
+microtcp_listen (microtcp_sock_t *socket, int backlog);
+
+/**
+ * Blocks until a new peer completes its handshake and sets its connection
+ * up in conn, which has to stay at the same address until it is shut down.
+ * The listener may be shut down before its connections, it then only stops
+ * accepting new ones.
+ *
+ * The handshakes of new peers go on while the listener is driven, by this
+ * call or microtcp_events(). A connection stays SYN_RECEIVED until the ACK
+ * of its peer arrives, its SYN_ACK is sent again when the RTO passes,
+ * backing off, and after MICROTCP_SYNACK_RETRIES of them it is dropped.
+ *
+ * @param socket the listener
+ * @param conn the socket structure of the new connection
+ * @param address pointer to store the address information of the connected peer
+ * @param address_len the length of the address structure.
+ * @return 0 on success or -1 on failure, with errno set. With SO_RCVTIMEO
+ * set on the listener it fails with EAGAIN when no new peer completes its
+ * handshake in time
+ */
+int
+microtcp_accept_conn (microtcp_sock_t *socket, microtcp_sock_t *conn,
+                      struct sockaddr *address, socklen_t address_len);
+
+/**
+ * Ends the connection with the FIN handshake and releases everything it
+ * holds, buffers, timers and its place among the connections of its
+ * listener, whether the handshake gets through or not. A connection that
+ * failed is only released, and a listener only stops accepting new peers.
+ *
+ * The server sends its FIN after the one of the client. A FIN is sent
+ * again when the RTO passes, at least the initial one, backing off, and
+ * after MICROTCP_FIN_RETRIES of them the handshake fails, as it does when
+ * the FIN of the peer does not come within MICROTCP_FIN_WAIT_US. The
+ * client stays in TIME_WAIT for four RTOs, at least MICROTCP_TIME_WAIT_US,
+ * from the last FIN of the server, to ACK it again if it comes again.
+ *
+ * With MSG_DONTWAIT in how the call never blocks. It starts the handshake,
+ * which goes on as the socket is driven by microtcp_poll() or
+ * microtcp_events(), and fails with EAGAIN until it is over. The socket
+ * then reports POLLHUP, or POLLERR if the handshake failed, and the call
+ * is repeated to release it.
+ *
+ * @return 0 on success or -1 if the handshake failed, with errno set. The
+ * connection is INVALID and released all the same
+ */
 int
 microtcp_shutdown(microtcp_sock_t *socket, int how);
 
+/**
+ * Receives up to length bytes. The call blocks until some data arrives and
+ * then takes whatever else is already there.
+ *
+ * With the MSG_DONTWAIT flag it never blocks, it takes only the data that
+ * has already arrived.
+ *
+ * @return the number of bytes received, 0 at the end of the stream or -1
+ * on failure. A non-blocking call with nothing to take fails with EAGAIN
+ */
+ssize_t
+microtcp_recv (microtcp_sock_t *socket, void *buffer, size_t length, int flags);
+
+/**
+ * Sends length bytes. The call returns once every byte is acknowledged by
+ * the peer.
+ *
+ * With the MICROTCP_ZEROCOPY flag large writes are sent with MSG_ZEROCOPY,
+ * the kernel then reads the payload straight from buffer, which is not
+ * released to the caller before the kernel reports it is done with it.
+ * Smaller writes, or kernels without SO_ZEROCOPY, use the copy path.
+ *
+ * With the MSG_DONTWAIT flag the call never blocks. It copies as much of
+ * buffer as the send buffer of the socket, MICROTCP_SO_SNDBUF bytes, has
+ * room for and transmits what the window allows. The rest goes out, and
+ * is retransmitted if need be, as the socket is driven by microtcp_poll()
+ * or microtcp_events(), or by any later call on it. microtcp_shutdown()
+ * delivers what is left before it closes the connection. MICROTCP_ZEROCOPY
+ * is ignored then.
+ *
+ * @return the number of bytes sent or -1 on failure. A non-blocking call
+ * that finds the send buffer full fails with EAGAIN
+ */
 ssize_t
 microtcp_send (microtcp_sock_t *socket, const void *buffer, size_t length,
                int flags);
 
+/**
+ * Gather version of microtcp_send(). The payload of the segments is taken
+ * straight from the iovecs, it is never copied in user space.
+ *
+ * @return the number of bytes sent or -1 on failure
+ */
 ssize_t
-microtcp_recv (microtcp_sock_t *socket, void *buffer, size_t length, int flags);
+microtcp_sendv (microtcp_sock_t *socket, const struct iovec *iov, int iovcnt,
+                int flags);
+
+/**
+ * Scatter version of microtcp_recv(). The received payload fills the
+ * iovecs in order.
+ *
+ * @return the number of bytes received, 0 at the end of the stream or -1
+ * on failure
+ */
+ssize_t
+microtcp_recvv (microtcp_sock_t *socket, const struct iovec *iov, int iovcnt,
+                int flags);
+
+/*
+ * Options of microtcp_setsockopt() and microtcp_getsockopt() at level
+ * SOL_MICROTCP. Their value is a uint64_t, except MICROTCP_SO_CONGESTION
+ * which is the name of the algorithm. The ones marked (*) can only be set
+ * before connect/accept.
+ */
+#define SOL_MICROTCP 0x4d54
+#define MICROTCP_SO_MSS 1               /**< (*) Payload bytes per segment to start with */
+#define MICROTCP_SO_RCVBUF 2            /**< (*) Receive buffer length in bytes */
+#define MICROTCP_SO_INIT_CWND 3         /**< (*) Initial cwnd in bytes */
+#define MICROTCP_SO_INIT_SSTHRESH 4     /**< (*) Initial ssthresh in bytes */
+#define MICROTCP_SO_RTO 5               /**< RTO in microseconds, until the first
+                                             RTT sample when set before connect/accept */
+#define MICROTCP_SO_MIN_RTO 6           /**< Lowest RTO in microseconds */
+#define MICROTCP_SO_MAX_RTO 7           /**< Highest RTO in microseconds */
+#define MICROTCP_SO_OPTIONS 8           /**< (*) MICROTCP_OPT_* flags to offer */
+#define MICROTCP_SO_OFFLOAD 9           /**< (*) 1 to use UDP GSO/GRO */
+#define MICROTCP_SO_MAX_PACING_RATE 10  /**< Pacing cap in bytes per second, 0 for none */
+#define MICROTCP_SO_PACING_QUANTUM 11   /**< Bytes paced back to back, 0 for automatic */
+#define MICROTCP_SO_CONGESTION 12       /**< "reno", "cubic" or "bbr" */
+#define MICROTCP_SO_MAX_MSS 13          /**< (*) Largest payload to receive and probe
+                                             the path for, mss to turn probing off */
+#define MICROTCP_SO_ACK_EVERY 14        /**< In order segments per ACK, 1 for no delay */
+#define MICROTCP_SO_DELACK 15           /**< Delayed ACK timeout in microseconds */
+#define MICROTCP_SO_SNDBUF 16           /**< Send buffer of non-blocking sends in bytes,
+                                             until the first one */
+
+/**
+ * Sets an option of the socket. Options of any level but SOL_MICROTCP,
+ * like SO_SNDBUF and SO_RCVBUF of SOL_SOCKET, go to the underlying UDP
+ * socket.
+ *
+ * @return 0 on success or -1 on failure, with errno set
+ */
+int
+microtcp_setsockopt (microtcp_sock_t *socket, int level, int optname,
+                     const void *optval, socklen_t optlen);
+
+/**
+ * Reads an option of the socket, see microtcp_setsockopt(). On entry
+ * optlen is the size of optval, on return the size of the value.
+ *
+ * @return 0 on success or -1 on failure, with errno set
+ */
+int
+microtcp_getsockopt (microtcp_sock_t *socket, int level, int optname,
+                     void *optval, socklen_t *optlen);
+
+/**
+ * Selects the congestion control algorithm of the socket, "reno",
+ * "cubic" or "bbr". It may be called before the connection or at any time during
+ * it, the new algorithm then starts from the current cwnd.
+ *
+ * @return 0 on success or -1 if there is no algorithm with that name
+ */
+int
+microtcp_set_congestion_control (microtcp_sock_t *socket, const char *name);
+
+/*
+ * Readiness of the sockets, for event loops. A socket reports POLLIN when
+ * microtcp_recv() would not block, for a listener when microtcp_accept_conn()
+ * has a new peer, and POLLOUT when a non-blocking microtcp_send() would take
+ * some data. POLLHUP follows the FIN of the peer, or the end of the
+ * connection, and POLLERR a failure. A listener reports POLLIN once the
+ * handshake of a new peer is over, its timeout covers the SYN_ACKs of those
+ * that are not.
+ */
+typedef struct
+{
+  microtcp_sock_t *socket;
+  short events;                 /**< POLLIN and POLLOUT, as for poll() */
+  short revents;                /**< The ones that are ready, POLLHUP and POLLERR included */
+} microtcp_pollfd_t;
+
+/**
+ * @return the descriptor that is readable when segments arrive for the
+ * socket, sd or the one of its io_uring
+ */
+int
+microtcp_fd (microtcp_sock_t *socket);
+
+/**
+ * Does whatever is due on the socket without blocking: takes in the
+ * segments that have arrived, fires the expired timers and transmits the
+ * data of non-blocking sends the window has room for.
+ *
+ * An event loop of its own watches microtcp_fd() for POLLIN, or EPOLLIN,
+ * and calls this when it is readable and once timeout_us has passed. A
+ * listener and its connections share their sd, all of them are driven when
+ * it is readable.
+ *
+ * @param socket the socket structure
+ * @param timeout_us set to the microseconds until the socket has to be
+ * driven again even if nothing arrives, -1 if it does not have to
+ * @return the POLL* events the socket is ready for
+ */
+int
+microtcp_events (microtcp_sock_t *socket, int64_t *timeout_us);
+
+/**
+ * poll() for microTCP sockets. Drives every socket with microtcp_events()
+ * and blocks until one is ready for its events or timeout milliseconds
+ * pass, forever if negative. The timers of all the connections of the
+ * calling thread wake it up through a single timerfd.
+ * Blocking on more than MICROTCP_POLL_FDS sockets costs a malloc() per
+ * call.
+ *
+ * @return the number of sockets with revents set, 0 on timeout or -1 on
+ * failure, with errno set
+ */
+int
+microtcp_poll (microtcp_pollfd_t *fds, nfds_t nfds, int timeout);
+
+/*
+ * A multi-core server, see microtcp_server.c. Every shard is a worker
+ * thread with a listener of its own, all of them bound to the same address
+ * with SO_REUSEPORT. The kernel picks the shard of a datagram by the hash
+ * of its addresses and ports, so all the segments of a peer reach the same
+ * shard. The shards share nothing, each has its connection table, timers
+ * and buffer pools. A worker drives its listener and all the connections
+ * it serves from one microtcp_poll() loop.
+ */
+typedef struct microtcp_server microtcp_server_t;
+
+typedef struct
+{
+  int shards;                   /**< Worker threads, 0 for one per CPU the process may run on */
+  int pin;                      /**< Pin every worker to a CPU of its own, in turn */
+  int backlog;                  /**< Of the listener of each shard, see microtcp_listen() */
+  /** Called on the listener of each shard before it listens, to set the
+      options its connections inherit. May be NULL */
+  int (*setup) (microtcp_sock_t *listener, int shard, void *arg);
+  /** Called in the worker for every connection it serves, first when it is
+      accepted, with revents 0, then whenever it is ready for the events
+      returned by the call before. It must not block, microtcp_recv() and
+      microtcp_send() are given MSG_DONTWAIT. *state belongs to the
+      callback, NULL at first. Returns the POLL* events to wait for next,
+      or -1 once done with the connection, which the worker then shuts
+      down, its FIN handshake driven by the same loop as the others.
+      After a call with POLLERR the connection is shut down in any case.
+      POLLHUP goes on being reported until the callback is done */
+  int (*serve) (microtcp_sock_t *conn, const struct sockaddr *peer,
+                short revents, void **state, int shard, void *arg);
+  void *arg;
+} microtcp_server_config_t;
+
+/**
+ * Opens the listeners of the shards on address and starts their workers.
+ *
+ * @return the server or NULL on failure, with errno set
+ */
+microtcp_server_t *
+microtcp_server_start (const struct sockaddr *address, socklen_t address_len,
+                       const microtcp_server_config_t *config);
+
+/**
+ * Stops accepting connections, waits for the workers to finish the ones
+ * they serve and releases the server.
+ */
+void
+microtcp_server_stop (microtcp_server_t *server);
+
+/**
+ * @return the number of shards of the server
+ */
+int
+microtcp_server_shards (const microtcp_server_t *server);
+
+/**
+ * @return the connections a shard has accepted so far
+ */
+uint64_t
+microtcp_server_accepted (const microtcp_server_t *server, int shard);
 
 void
 header_init(microtcp_header_t *header);
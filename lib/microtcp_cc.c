@@ -0,0 +1,586 @@
+#include "../lib/microtcp.h"
+#include <errno.h>
+#include <math.h>
+
+/**
+*   CONGESTION CONTROL
+*   Every algorithm is a microtcp_cc_ops_t. The protocol calls it on ACKs,
+*   losses, timeouts and RTT samples, and it keeps whatever state it needs
+*   in socket->cc_priv.
+*/
+
+static const microtcp_cc_ops_t *algorithms[] = { &microtcp_cc_reno, &microtcp_cc_cubic, &microtcp_cc_bbr };
+
+int microtcp_set_congestion_control (microtcp_sock_t *socket, const char *name)
+{
+    for(size_t i = 0; i < sizeof(algorithms) / sizeof(algorithms[0]); i++)
+    {
+        if(strcmp(algorithms[i]->name, name) == 0)
+        {
+            socket->cc = algorithms[i];
+            memset(socket->cc_priv, 0, sizeof(socket->cc_priv));
+            if(socket->state == ESTABLISHED)
+            {
+                socket->cc->init(socket);
+            }
+            return 0;
+        }
+    }
+
+    errno = EINVAL;
+    perror("ERROR AT Set congestion control: Unknown algorithm");
+    return -1;
+}
+
+/*Half of the data in flight, but no less than two segments*/
+static size_t half_flight(microtcp_sock_t *socket)
+{
+    size_t flight = (uint32_t)(socket->seq_number - socket->snd_una);
+
+    return flight / 2 > 2 * socket->mss ? flight / 2 : 2 * socket->mss;
+}
+
+/*Slow start grows cwnd by the bytes acknowledged and not by the ACKs (RFC 3465),
+  so a receiver that acknowledges many segments at once does not slow it down*/
+static void slow_start(microtcp_sock_t *socket, size_t acked)
+{
+    socket->cwnd = min(socket->cwnd + acked, socket->ssthresh, SIZE_MAX);
+}
+
+/**
+*   RENO
+*/
+
+struct reno
+{
+    size_t bytes_acked;         /*Acknowledged since cwnd last grew in congestion avoidance*/
+};
+
+_Static_assert(sizeof(struct reno) <= sizeof(((microtcp_sock_t*)0)->cc_priv), "cc_priv too small for Reno");
+
+static void reno_init(microtcp_sock_t *socket)
+{
+    struct reno *ca = (struct reno*)socket->cc_priv;
+
+    memset(ca, 0, sizeof(struct reno));
+}
+
+static void reno_on_ack(microtcp_sock_t *socket, size_t acked, uint64_t now_us)
+{
+    struct reno *ca = (struct reno*)socket->cc_priv;
+
+    (void)now_us;
+
+    if(socket->cwnd < socket->ssthresh)
+    {
+        slow_start(socket, acked);
+        return;
+    }
+
+    /*Congestion avoidance counts bytes too (RFC 3465), one segment more for
+      every window acknowledged, whatever the size of the window*/
+    ca->bytes_acked += acked;
+    if(ca->bytes_acked >= socket->cwnd)
+    {
+        ca->bytes_acked -= socket->cwnd;
+        socket->cwnd += socket->mss;
+    }
+}
+
+static void reno_on_loss(microtcp_sock_t *socket)
+{
+    struct reno *ca = (struct reno*)socket->cc_priv;
+
+    ca->bytes_acked = 0;
+    socket->ssthresh = half_flight(socket);
+    socket->cwnd = socket->ssthresh;
+}
+
+static void reno_on_timeout(microtcp_sock_t *socket)
+{
+    struct reno *ca = (struct reno*)socket->cc_priv;
+
+    ca->bytes_acked = 0;
+    socket->ssthresh = half_flight(socket);
+    socket->cwnd = socket->mss;
+}
+
+const microtcp_cc_ops_t microtcp_cc_reno =
+{
+    .name = "reno",
+    .init = reno_init,
+    .on_ack = reno_on_ack,
+    .on_loss = reno_on_loss,
+    .on_timeout = reno_on_timeout,
+    .on_rtt_sample = NULL,
+    .on_rate_sample = NULL,
+};
+
+/**
+*   CUBIC (RFC 9438)
+*   The window grows along a cubic curve of the time since the last loss,
+*   centered on the window where that loss happened. Windows are in
+*   segments inside the algorithm.
+*/
+
+#define CUBIC_C 0.4
+#define CUBIC_BETA 0.7
+
+struct cubic
+{
+    double w_max;               /*Window before the last reduction*/
+    double k;                   /*Seconds the curve takes to reach w_max again*/
+    double origin;              /*Window at the plateau of the curve*/
+    double w_est;               /*Window Reno would have, the curve never falls below it*/
+    double carry;               /*Growth in bytes not yet added to cwnd*/
+    uint64_t epoch_start_us;    /*Start of the current curve, 0 after a loss*/
+    uint64_t min_rtt_us;
+};
+
+_Static_assert(sizeof(struct cubic) <= sizeof(((microtcp_sock_t*)0)->cc_priv), "cc_priv too small for CUBIC");
+
+static void cubic_init(microtcp_sock_t *socket)
+{
+    struct cubic *ca = (struct cubic*)socket->cc_priv;
+
+    memset(ca, 0, sizeof(struct cubic));
+}
+
+static void cubic_on_ack(microtcp_sock_t *socket, size_t acked, uint64_t now_us)
+{
+    struct cubic *ca = (struct cubic*)socket->cc_priv;
+    double cwnd = (double)socket->cwnd / socket->mss;
+    double t, target;
+
+    if(socket->cwnd < socket->ssthresh)
+    {
+        slow_start(socket, acked);
+        return;
+    }
+
+    /*First ACK of congestion avoidance since the loss, start a new curve*/
+    if(ca->epoch_start_us == 0)
+    {
+        ca->epoch_start_us = now_us;
+        ca->w_est = cwnd;
+        if(ca->w_max > cwnd)
+        {
+            ca->k = cbrt((ca->w_max - cwnd) / CUBIC_C);
+            ca->origin = ca->w_max;
+        }
+        else
+        {
+            ca->k = 0;
+            ca->origin = cwnd;
+        }
+    }
+
+    /*Where the curve will be one RTT from now, but never more than 1.5 times the window*/
+    t = (double)(now_us - ca->epoch_start_us + ca->min_rtt_us) / 1e6;
+    target = ca->origin + CUBIC_C * (t - ca->k) * (t - ca->k) * (t - ca->k);
+    if(target > 1.5 * cwnd)
+    {
+        target = 1.5 * cwnd;
+    }
+
+    /*Where short RTTs keep the curve flat, do at least as well as Reno*/
+    ca->w_est += 3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA) * ((double)acked / socket->mss) / cwnd;
+    if(ca->w_est > target)
+    {
+        target = ca->w_est;
+    }
+
+    /*Spread the distance to the target over the ACKs of one window*/
+    if(target > cwnd)
+    {
+        ca->carry += (target - cwnd) * (double)acked / cwnd;
+        socket->cwnd += (size_t)ca->carry;
+        ca->carry -= (size_t)ca->carry;
+    }
+}
+
+static void cubic_reduce(microtcp_sock_t *socket)
+{
+    struct cubic *ca = (struct cubic*)socket->cc_priv;
+    double cwnd = (double)socket->cwnd / socket->mss;
+
+    /*Fast convergence, release bandwidth when the losses come earlier than last time*/
+    ca->w_max = cwnd < ca->w_max ? cwnd * (1 + CUBIC_BETA) / 2 : cwnd;
+    ca->epoch_start_us = 0;
+    ca->carry = 0;
+
+    socket->ssthresh = (size_t)(socket->cwnd * CUBIC_BETA);
+    if(socket->ssthresh < 2 * socket->mss)
+    {
+        socket->ssthresh = 2 * socket->mss;
+    }
+}
+
+static void cubic_on_loss(microtcp_sock_t *socket)
+{
+    cubic_reduce(socket);
+    socket->cwnd = socket->ssthresh;
+}
+
+static void cubic_on_timeout(microtcp_sock_t *socket)
+{
+    cubic_reduce(socket);
+    socket->cwnd = socket->mss;
+}
+
+static void cubic_on_rtt_sample(microtcp_sock_t *socket, uint64_t rtt_us)
+{
+    struct cubic *ca = (struct cubic*)socket->cc_priv;
+
+    if(ca->min_rtt_us == 0 || rtt_us < ca->min_rtt_us)
+    {
+        ca->min_rtt_us = rtt_us;
+    }
+}
+
+const microtcp_cc_ops_t microtcp_cc_cubic =
+{
+    .name = "cubic",
+    .init = cubic_init,
+    .on_ack = cubic_on_ack,
+    .on_loss = cubic_on_loss,
+    .on_timeout = cubic_on_timeout,
+    .on_rtt_sample = cubic_on_rtt_sample,
+    .on_rate_sample = NULL,
+};
+
+/**
+*   BBR
+*   Builds a model of the path, the bottleneck bandwidth as the highest
+*   delivery rate of the last rounds and the propagation delay as the lowest
+*   RTT of the last seconds, and sets the pacing rate and cwnd from it
+*   instead of reacting to losses. It goes from STARTUP, which doubles the
+*   rate every round until the bandwidth stops growing, to DRAIN, which
+*   empties the queue STARTUP built, to PROBE_BW, which cycles the pacing
+*   gain around 1 to find out if there is more bandwidth. Every
+*   BBR_MIN_RTT_WIN_US it spends a moment in PROBE_RTT with a tiny window to
+*   measure the delay again.
+*/
+
+#define BBR_HIGH_GAIN 2.885     /*2/ln(2), doubles the rate every round*/
+#define BBR_CWND_GAIN 2.0
+#define BBR_BW_ROUNDS 10
+#define BBR_MIN_RTT_WIN_US 10000000
+#define BBR_PROBE_RTT_US 200000
+#define BBR_MIN_CWND(socket) (4 * (socket)->mss)
+#define BBR_CYCLE_LEN 8
+
+enum bbr_mode
+{
+    BBR_STARTUP,
+    BBR_DRAIN,
+    BBR_PROBE_BW,
+    BBR_PROBE_RTT
+};
+
+static const double bbr_cycle_gain[BBR_CYCLE_LEN] = { 1.25, 0.75, 1, 1, 1, 1, 1, 1 };
+
+/*A windowed max of the bandwidth, the best three samples of different ages (Kathleen Nichols' algorithm)*/
+struct bbr_sample
+{
+    uint64_t round;
+    uint64_t bw;
+};
+
+struct bbr
+{
+    struct bbr_sample max_bw[3];
+    uint64_t min_rtt_us;
+    uint64_t min_rtt_stamp_us;  /*When min_rtt_us was measured*/
+    uint64_t round;             /*Round trips so far*/
+    uint64_t next_round_delivered;
+    uint64_t full_bw;           /*Bandwidth STARTUP has reached*/
+    uint64_t cycle_stamp_us;    /*Start of the current PROBE_BW gain*/
+    uint64_t probe_rtt_done_us; /*End of PROBE_RTT, 0 until the flight has shrunk*/
+    uint64_t prior_cwnd;        /*cwnd to restore after PROBE_RTT or a timeout*/
+    uint32_t recover_seq;       /*Highest sequence number sent when the timeout went off*/
+    uint32_t in_loss_recovery;  /*Repairing the losses of a timeout*/
+    uint32_t full_bw_rounds;    /*Rounds without the bandwidth growing 25%*/
+    uint32_t cycle_index;
+    uint32_t mode;
+    double pacing_gain;
+    double cwnd_gain;
+};
+
+_Static_assert(sizeof(struct bbr) <= sizeof(((microtcp_sock_t*)0)->cc_priv), "cc_priv too small for BBR");
+
+static uint64_t bbr_bw(struct bbr *bbr)
+{
+    return bbr->max_bw[0].bw;
+}
+
+static void bbr_bw_update(struct bbr *bbr, uint64_t bw)
+{
+    struct bbr_sample *m = bbr->max_bw;
+    struct bbr_sample val = { .round = bbr->round, .bw = bw };
+
+    /*A new maximum, or the whole window has expired*/
+    if(bw >= m[0].bw || bbr->round - m[2].round > BBR_BW_ROUNDS)
+    {
+        m[0] = m[1] = m[2] = val;
+        return;
+    }
+
+    if(bw >= m[1].bw)
+    {
+        m[1] = m[2] = val;
+    }
+    else if(bw >= m[2].bw)
+    {
+        m[2] = val;
+    }
+
+    /*Age the best samples out of the window*/
+    if(bbr->round - m[0].round > BBR_BW_ROUNDS)
+    {
+        m[0] = m[1];
+        m[1] = m[2];
+        m[2] = val;
+        if(bbr->round - m[0].round > BBR_BW_ROUNDS)
+        {
+            m[0] = m[1];
+            m[1] = m[2];
+        }
+    }
+    else if(m[1].round == m[0].round && bbr->round - m[1].round > BBR_BW_ROUNDS / 4)
+    {
+        m[1] = m[2] = val;
+    }
+    else if(m[2].round == m[1].round && bbr->round - m[2].round > BBR_BW_ROUNDS / 2)
+    {
+        m[2] = val;
+    }
+}
+
+/*Bandwidth-delay product in bytes, scaled by gain*/
+static uint64_t bbr_bdp(microtcp_sock_t *socket, struct bbr *bbr, double gain)
+{
+    if(bbr_bw(bbr) == 0 || bbr->min_rtt_us == 0)
+    {
+        return socket->init_cwnd;
+    }
+    return (uint64_t)(gain * bbr_bw(bbr) * bbr->min_rtt_us / 1000000);
+}
+
+static void bbr_set_mode(struct bbr *bbr, uint32_t mode, uint64_t now_us)
+{
+    bbr->mode = mode;
+    switch(mode)
+    {
+        case BBR_STARTUP:
+            bbr->pacing_gain = BBR_HIGH_GAIN;
+            bbr->cwnd_gain = BBR_HIGH_GAIN;
+            break;
+        case BBR_DRAIN:
+            bbr->pacing_gain = 1 / BBR_HIGH_GAIN;
+            bbr->cwnd_gain = BBR_HIGH_GAIN;
+            break;
+        case BBR_PROBE_BW:
+            /*Any phase but the draining one*/
+            bbr->cycle_index = (uint32_t)(now_us % (BBR_CYCLE_LEN - 1));
+            if(bbr->cycle_index >= 1)
+            {
+                bbr->cycle_index++;
+            }
+            bbr->cycle_stamp_us = now_us;
+            bbr->pacing_gain = bbr_cycle_gain[bbr->cycle_index];
+            bbr->cwnd_gain = BBR_CWND_GAIN;
+            break;
+        case BBR_PROBE_RTT:
+            bbr->pacing_gain = 1;
+            bbr->cwnd_gain = 1;
+            bbr->probe_rtt_done_us = 0;
+            break;
+    }
+}
+
+/*Remembers cwnd before it is cut. While PROBE_RTT or a timeout already cut it
+  the larger one is kept, the window of the model is the one to go back to*/
+static void bbr_save_cwnd(microtcp_sock_t *socket, struct bbr *bbr)
+{
+    if(bbr->mode == BBR_PROBE_RTT || bbr->in_loss_recovery)
+    {
+        bbr->prior_cwnd = socket->cwnd > bbr->prior_cwnd ? socket->cwnd : bbr->prior_cwnd;
+    }
+    else
+    {
+        bbr->prior_cwnd = socket->cwnd;
+    }
+}
+
+static void bbr_init(microtcp_sock_t *socket)
+{
+    struct bbr *bbr = (struct bbr*)socket->cc_priv;
+
+    memset(bbr, 0, sizeof(struct bbr));
+    bbr_set_mode(bbr, BBR_STARTUP, 0);
+    bbr->prior_cwnd = socket->cwnd;
+    socket->ssthresh = SIZE_MAX;
+}
+
+static void bbr_on_rate_sample(microtcp_sock_t *socket, const microtcp_rate_sample_t *rs)
+{
+    struct bbr *bbr = (struct bbr*)socket->cc_priv;
+    uint64_t now = socket->delivered_time_us;
+    uint64_t bw, in_flight;
+
+    /*A round ends when a segment sent after it started is acknowledged*/
+    if(rs->prior_delivered >= bbr->next_round_delivered)
+    {
+        bbr->next_round_delivered = socket->delivered;
+        bbr->round++;
+
+        /*STARTUP is over when three rounds bring less than 25% more bandwidth*/
+        if(bbr->mode == BBR_STARTUP && !rs->is_app_limited)
+        {
+            if(bbr_bw(bbr) >= bbr->full_bw + bbr->full_bw / 4)
+            {
+                bbr->full_bw = bbr_bw(bbr);
+                bbr->full_bw_rounds = 0;
+            }
+            else if(++bbr->full_bw_rounds >= 3)
+            {
+                bbr_set_mode(bbr, BBR_DRAIN, now);
+            }
+        }
+    }
+
+    /*The application can hide the bandwidth, but never inflate it*/
+    bw = rs->delivered * 1000000 / rs->interval_us;
+    if(!rs->is_app_limited || bw >= bbr_bw(bbr))
+    {
+        bbr_bw_update(bbr, bw);
+    }
+
+    if(rs->rtt_us > 0 && (bbr->min_rtt_us == 0 || rs->rtt_us <= bbr->min_rtt_us
+                          || now - bbr->min_rtt_stamp_us > BBR_MIN_RTT_WIN_US))
+    {
+        bbr->min_rtt_us = rs->rtt_us;
+        bbr->min_rtt_stamp_us = now;
+    }
+
+    in_flight = (uint32_t)(socket->seq_number - socket->snd_una);
+    switch(bbr->mode)
+    {
+        case BBR_DRAIN:
+            if(in_flight <= bbr_bdp(socket, bbr, 1))
+            {
+                bbr_set_mode(bbr, BBR_PROBE_BW, now);
+            }
+            break;
+        case BBR_PROBE_BW:
+            /*Next gain after a min RTT, but a probe lasts until the flight has grown
+              and a drain until it has shrunk back to the BDP*/
+            if(now - bbr->cycle_stamp_us > bbr->min_rtt_us
+               && !(bbr->pacing_gain > 1 && in_flight < bbr_bdp(socket, bbr, bbr->pacing_gain))
+               && !(bbr->pacing_gain < 1 && in_flight > bbr_bdp(socket, bbr, 1)))
+            {
+                bbr->cycle_index = (bbr->cycle_index + 1) % BBR_CYCLE_LEN;
+                bbr->cycle_stamp_us = now;
+                bbr->pacing_gain = bbr_cycle_gain[bbr->cycle_index];
+            }
+            break;
+        case BBR_PROBE_RTT:
+            if(bbr->probe_rtt_done_us == 0 && in_flight <= BBR_MIN_CWND(socket))
+            {
+                bbr->probe_rtt_done_us = now + BBR_PROBE_RTT_US;
+            }
+            else if(bbr->probe_rtt_done_us != 0 && now > bbr->probe_rtt_done_us)
+            {
+                bbr->min_rtt_stamp_us = now;
+                socket->cwnd = bbr->prior_cwnd;
+                bbr_set_mode(bbr, bbr->full_bw_rounds >= 3 ? BBR_PROBE_BW : BBR_STARTUP, now);
+            }
+            break;
+    }
+
+    /*The delay has not been measured for too long, shrink the flight to see it*/
+    if(bbr->mode != BBR_PROBE_RTT && bbr->min_rtt_us > 0 && now - bbr->min_rtt_stamp_us > BBR_MIN_RTT_WIN_US)
+    {
+        bbr_save_cwnd(socket, bbr);
+        bbr_set_mode(bbr, BBR_PROBE_RTT, now);
+    }
+
+    if(bbr_bw(bbr) > 0)
+    {
+        socket->pacing_rate = (uint64_t)(bbr->pacing_gain * bbr_bw(bbr));
+    }
+}
+
+static void bbr_on_ack(microtcp_sock_t *socket, size_t acked, uint64_t now_us)
+{
+    struct bbr *bbr = (struct bbr*)socket->cc_priv;
+    uint64_t target;
+
+    (void)now_us;
+
+    /*Everything sent before the timeout is acknowledged, the losses are repaired
+      and the flight goes back to the window it had*/
+    if(bbr->in_loss_recovery && (int32_t)(socket->snd_una - bbr->recover_seq) >= 0)
+    {
+        bbr->in_loss_recovery = 0;
+        if(bbr->mode != BBR_PROBE_RTT && socket->cwnd < bbr->prior_cwnd)
+        {
+            socket->cwnd = bbr->prior_cwnd;
+        }
+    }
+
+    if(bbr->mode == BBR_PROBE_RTT)
+    {
+        socket->cwnd = BBR_MIN_CWND(socket);
+        return;
+    }
+
+    /*Grow toward the model, but only as fast as data gets delivered*/
+    target = bbr_bdp(socket, bbr, bbr->cwnd_gain) + 3 * socket->mss;
+    if(socket->cwnd < target)
+    {
+        socket->cwnd = socket->cwnd + acked < target ? socket->cwnd + acked : target;
+    }
+    else if(bbr->full_bw_rounds >= 3)
+    {
+        socket->cwnd = target;
+    }
+    if(socket->cwnd < BBR_MIN_CWND(socket))
+    {
+        socket->cwnd = BBR_MIN_CWND(socket);
+    }
+}
+
+/*Losses do not drive the model, only fast recovery bounds the flight for a while*/
+static void bbr_on_loss(microtcp_sock_t *socket)
+{
+    struct bbr *bbr = (struct bbr*)socket->cc_priv;
+
+    bbr_save_cwnd(socket, bbr);
+    socket->ssthresh = socket->cwnd;
+}
+
+/*A timeout empties the pipe, the flight starts over from BBR_MIN_CWND and gets
+  its window back once the losses are repaired. The model stays as it was*/
+static void bbr_on_timeout(microtcp_sock_t *socket)
+{
+    struct bbr *bbr = (struct bbr*)socket->cc_priv;
+
+    bbr_save_cwnd(socket, bbr);
+    bbr->recover_seq = socket->seq_number;
+    bbr->in_loss_recovery = 1;
+    socket->ssthresh = socket->cwnd;
+    socket->cwnd = BBR_MIN_CWND(socket);
+}
+
+const microtcp_cc_ops_t microtcp_cc_bbr =
+{
+    .name = "bbr",
+    .init = bbr_init,
+    .on_ack = bbr_on_ack,
+    .on_loss = bbr_on_loss,
+    .on_timeout = bbr_on_timeout,
+    .on_rtt_sample = NULL,
+    .on_rate_sample = bbr_on_rate_sample,
+};
@@ -0,0 +1,405 @@
+#define _GNU_SOURCE
+#include "../lib/microtcp.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+/**
+*   MULTI-CORE SERVER
+*   One listener per shard on the same address, bound with SO_REUSEPORT, and
+*   one worker thread per listener. The kernel spreads the peers over the
+*   listeners by the hash of the 4-tuple, which keeps every peer on one
+*   shard for as long as the set of listeners does not change. A worker
+*   touches nothing but its own listener and connections, so the shards
+*   never contend with each other.
+*/
+
+#define SERVER_STOP_POLL_MS 100     /* How often an idle worker checks for microtcp_server_stop() */
+#define SERVER_CONNS_MIN 16         /* Connections a shard makes room for at first */
+
+/*A connection of a shard, it stays at the same address while the demux points at it*/
+struct shard_conn
+{
+    microtcp_sock_t sock;
+    struct sockaddr_storage peer;
+    void *state;                    /**< Of the serve callback */
+    int closing;                    /**< Serve is done with it, its FIN handshake goes on */
+};
+
+struct microtcp_shard
+{
+    struct microtcp_server *server;
+    int index;
+    int cpu;                        /**< CPU the worker is pinned to, -1 if it is not */
+    int started;
+    pthread_t thread;
+    microtcp_sock_t listener;
+    struct shard_conn **conns;      /**< The connections being served */
+    microtcp_pollfd_t *fds;         /**< The listener, then the connections in the same order */
+    size_t nconns;
+    size_t cap;
+    uint64_t accepted;              /**< Written by the worker only */
+};
+
+struct microtcp_server
+{
+    microtcp_server_config_t config;
+    int stopping;
+    int nshards;
+    struct microtcp_shard shards[];
+};
+
+/*Doubles the room for connections of a shard*/
+static int shard_grow(struct microtcp_shard *shard)
+{
+    size_t cap = shard->cap > 0 ? 2 * shard->cap : SERVER_CONNS_MIN;
+    struct shard_conn **conns;
+    microtcp_pollfd_t *fds;
+
+    conns = (struct shard_conn**) realloc(shard->conns, cap * sizeof(struct shard_conn*));
+    if(conns == NULL)
+    {
+        return -1;
+    }
+    shard->conns = conns;
+
+    fds = (microtcp_pollfd_t*) realloc(shard->fds, (cap + 1) * sizeof(microtcp_pollfd_t));
+    if(fds == NULL)
+    {
+        return -1;
+    }
+    shard->fds = fds;
+    shard->cap = cap;
+    return 0;
+}
+
+/*Shuts connection i down without blocking. It stays in the poll loop until
+  its FIN handshake is over, then it is released and the last one takes its
+  place*/
+static void shard_close(struct microtcp_shard *shard, size_t i)
+{
+    struct shard_conn *conn = shard->conns[i];
+
+    conn->closing = 1;
+    shard->fds[i + 1].events = 0;
+    if(microtcp_shutdown(&conn->sock, SHUT_RDWR | MSG_DONTWAIT) == -1 && errno == EAGAIN)
+    {
+        return;
+    }
+    free(conn);
+
+    shard->nconns--;
+    shard->conns[i] = shard->conns[shard->nconns];
+    shard->fds[i + 1] = shard->fds[shard->nconns + 1];
+}
+
+/*Takes the connection the listener has ready and hands it to serve*/
+static void shard_accept(struct microtcp_shard *shard)
+{
+    struct microtcp_server *server = shard->server;
+    struct shard_conn *conn;
+    int events;
+
+    if(shard->nconns == shard->cap && shard_grow(shard) == -1)
+    {
+        perror("ERROR AT Server: Memory Allocation");
+        return;
+    }
+
+    conn = (struct shard_conn*) calloc(1, sizeof(struct shard_conn));
+    if(conn == NULL)
+    {
+        perror("ERROR AT Server: Memory Allocation");
+        return;
+    }
+
+    if(microtcp_accept_conn(&shard->listener, &conn->sock, (struct sockaddr*)&conn->peer, sizeof(conn->peer)) == -1)
+    {
+        perror("WARNING AT Server: Accept");
+        free(conn);
+        return;
+    }
+    __atomic_store_n(&shard->accepted, shard->accepted + 1, __ATOMIC_RELAXED);
+
+    shard->conns[shard->nconns] = conn;
+    shard->fds[shard->nconns + 1].socket = &conn->sock;
+    shard->nconns++;
+
+    events = server->config.serve(&conn->sock, (struct sockaddr*)&conn->peer, 0, &conn->state, shard->index, server->config.arg);
+    if(events == -1)
+    {
+        shard_close(shard, shard->nconns - 1);
+        return;
+    }
+    shard->fds[shard->nconns].events = events;
+}
+
+/**
+*   The worker of a shard. Its listener and every connection it serves are
+*   driven by one microtcp_poll(), whose timerfd wakes it up for the timers
+*   of all of them, the FIN handshakes of the connections being shut down
+*   included. Once the server stops, the listener is shut down and the
+*   worker goes on until its connections are done.
+*/
+static void *shard_run(void *arg)
+{
+    struct microtcp_shard *shard = (struct microtcp_shard*) arg;
+    struct microtcp_server *server = shard->server;
+    struct shard_conn *conn;
+    int listening = 1;
+    int events;
+    size_t i;
+
+    if(shard_grow(shard) == -1)
+    {
+        perror("ERROR AT Server: Memory Allocation");
+        microtcp_shutdown(&shard->listener, SHUT_RDWR);
+        return NULL;
+    }
+    shard->fds[0].socket = &shard->listener;
+    shard->fds[0].events = POLLIN;
+
+    while(listening || shard->nconns > 0)
+    {
+        if(listening && __atomic_load_n(&server->stopping, __ATOMIC_ACQUIRE))
+        {
+            microtcp_shutdown(&shard->listener, SHUT_RDWR);
+            listening = 0;
+        }
+
+        if(microtcp_poll(listening ? shard->fds : shard->fds + 1, shard->nconns + listening, SERVER_STOP_POLL_MS) == -1)
+        {
+            break;
+        }
+
+        /*Backwards, so the last connection that takes the place of a closed one has been served already*/
+        for(i = shard->nconns; i-- > 0; )
+        {
+            if(shard->fds[i + 1].revents == 0)
+            {
+                continue;
+            }
+
+            /*POLLHUP or POLLERR, the FIN handshake is over*/
+            conn = shard->conns[i];
+            if(conn->closing)
+            {
+                shard_close(shard, i);
+                continue;
+            }
+
+            events = server->config.serve(&conn->sock, (struct sockaddr*)&conn->peer, shard->fds[i + 1].revents, &conn->state, shard->index, server->config.arg);
+            if(events == -1 || (shard->fds[i + 1].revents & POLLERR))
+            {
+                shard_close(shard, i);
+                continue;
+            }
+            shard->fds[i + 1].events = events;
+        }
+
+        if(listening && (shard->fds[0].revents & POLLERR))
+        {
+            perror("ERROR AT Server: Accept");
+            break;
+        }
+        if(listening && (shard->fds[0].revents & POLLIN))
+        {
+            shard_accept(shard);
+        }
+    }
+
+    /*A worker that fails lets serve know before it drops the connections.
+      Their FIN handshakes end here, within the bounds of their timers*/
+    while(shard->nconns > 0)
+    {
+        conn = shard->conns[shard->nconns - 1];
+        if(!conn->closing)
+        {
+            server->config.serve(&conn->sock, (struct sockaddr*)&conn->peer, POLLERR, &conn->state, shard->index, server->config.arg);
+        }
+        microtcp_shutdown(&conn->sock, SHUT_RDWR);
+        free(conn);
+        shard->nconns--;
+    }
+    if(listening)
+    {
+        microtcp_shutdown(&shard->listener, SHUT_RDWR);
+    }
+
+    free(shard->conns);
+    free(shard->fds);
+    shard->conns = NULL;
+    shard->fds = NULL;
+    return NULL;
+}
+
+/*Opens the listener of a shard, with the options of the caller*/
+static int shard_listen(struct microtcp_shard *shard, const struct sockaddr *address, socklen_t address_len)
+{
+    const microtcp_server_config_t *config = &shard->server->config;
+    int one = 1;
+
+    shard->listener = microtcp_socket(address->sa_family, SOCK_DGRAM, 0);
+    if(shard->listener.state == INVALID)
+    {
+        return -1;
+    }
+
+    if(setsockopt(shard->listener.sd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1)
+    {
+        perror("ERROR AT Server: Socket options");
+        return -1;
+    }
+
+    if(microtcp_bind(&shard->listener, address, address_len) == -1)
+    {
+        perror("ERROR AT Server: Bind");
+        return -1;
+    }
+
+    if(config->setup != NULL && config->setup(&shard->listener, shard->index, config->arg) == -1)
+    {
+        return -1;
+    }
+
+    return microtcp_listen(&shard->listener, config->backlog);
+}
+
+/*Starts the worker of a shard, on its CPU when pinned*/
+static int shard_start(struct microtcp_shard *shard)
+{
+    pthread_attr_t attr;
+    cpu_set_t cpus;
+    int ret;
+
+    pthread_attr_init(&attr);
+    if(shard->cpu >= 0)
+    {
+        CPU_ZERO(&cpus);
+        CPU_SET(shard->cpu, &cpus);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpus);
+    }
+
+    ret = pthread_create(&shard->thread, &attr, shard_run, shard);
+    pthread_attr_destroy(&attr);
+    if(ret != 0)
+    {
+        errno = ret;
+        perror("ERROR AT Server: Worker creation");
+        return -1;
+    }
+
+    shard->started = 1;
+    return 0;
+}
+
+microtcp_server_t *microtcp_server_start (const struct sockaddr *address, socklen_t address_len, const microtcp_server_config_t *config)
+{
+    struct microtcp_server *server;
+    cpu_set_t allowed;
+    int ncpus, cpu, nshards, i;
+
+    if(config->serve == NULL)
+    {
+        errno = EINVAL;
+        perror("ERROR AT Server: No serve callback");
+        return NULL;
+    }
+
+    /*The CPUs the process may run on, in order*/
+    CPU_ZERO(&allowed);
+    if(sched_getaffinity(0, sizeof(cpu_set_t), &allowed) == -1)
+    {
+        CPU_SET(0, &allowed);
+    }
+    ncpus = CPU_COUNT(&allowed);
+
+    nshards = config->shards > 0 ? config->shards : ncpus;
+    server = (struct microtcp_server*) calloc(1, sizeof(struct microtcp_server) + nshards * sizeof(struct microtcp_shard));
+    if(server == NULL)
+    {
+        perror("ERROR AT Server: Memory Allocation");
+        return NULL;
+    }
+    server->config = *config;
+    server->nshards = nshards;
+
+    for(i = 0, cpu = -1; i < nshards; i++)
+    {
+        server->shards[i].server = server;
+        server->shards[i].index = i;
+        server->shards[i].cpu = -1;
+        server->shards[i].listener.sd = -1;
+
+        if(config->pin)
+        {
+            do
+            {
+                cpu = (cpu + 1) % CPU_SETSIZE;
+            } while(!CPU_ISSET(cpu, &allowed));
+            server->shards[i].cpu = cpu;
+        }
+    }
+
+    /*Every listener is bound before any worker runs, so the kernel hashes
+      the first peers over all of them*/
+    for(i = 0; i < nshards; i++)
+    {
+        if(shard_listen(&server->shards[i], address, address_len) == -1)
+        {
+            microtcp_server_stop(server);
+            return NULL;
+        }
+    }
+
+    for(i = 0; i < nshards; i++)
+    {
+        if(shard_start(&server->shards[i]) == -1)
+        {
+            microtcp_server_stop(server);
+            return NULL;
+        }
+    }
+
+    return server;
+}
+
+void microtcp_server_stop (microtcp_server_t *server)
+{
+    struct microtcp_shard *shard;
+    int err = errno;
+
+    __atomic_store_n(&server->stopping, 1, __ATOMIC_RELEASE);
+
+    for(int i = 0; i < server->nshards; i++)
+    {
+        shard = &server->shards[i];
+        if(shard->started)
+        {
+            pthread_join(shard->thread, NULL);
+        }
+        else if(shard->listener.state == LISTEN)
+        {
+            microtcp_shutdown(&shard->listener, SHUT_RDWR);
+        }
+
+        if(shard->listener.sd >= 0)
+        {
+            close(shard->listener.sd);
+        }
+    }
+
+    free(server);
+    errno = err;
+}
+
+int microtcp_server_shards (const microtcp_server_t *server)
+{
+    return server->nshards;
+}
+
+uint64_t microtcp_server_accepted (const microtcp_server_t *server, int shard)
+{
+    return __atomic_load_n(&server->shards[shard].accepted, __ATOMIC_RELAXED);
+}
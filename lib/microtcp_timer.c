@@ -0,0 +1,306 @@
+#define _GNU_SOURCE
+#include "microtcp_timer.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+*   TIMER WHEEL
+*   The timers of all the connections of a thread hang off one hierarchical
+*   wheel and one timerfd, whatever their number. Every level has 64 slots,
+*   a slot of level 0 is a microsecond and one of level n covers 64 of level
+*   n-1. A timer is linked in the lowest level that reaches its expiry, so
+*   arming and cancelling it is a list operation. The timers of a slot of an
+*   upper level come down when its time starts, and only level 0 fires, at
+*   the exact microsecond. A bitmap per level tells which slots are in use,
+*   so the next expiry is found without walking the empty ones.
+*/
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 6              /* 2^36 us, about 19 hours. Later timers wait at the top */
+
+struct microtcp_wheel
+{
+    int init;
+    int fd;                                 /**< -1 until it is first needed, -2 if it can not be created */
+    uint64_t programmed;                    /**< When fd goes off, UINT64_MAX if it does not */
+    uint64_t clock;                         /**< Every microsecond before it has been dealt with,
+                                                 timers that are due already go off at it */
+    size_t count;                           /**< Armed timers */
+    uint64_t occupied[WHEEL_LEVELS];        /**< A bit per slot with timers in it */
+    struct microtcp_timer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+static __thread struct microtcp_wheel wheel;
+
+/*Closes the timerfd of a thread when it exits*/
+static pthread_key_t wheel_key;
+static pthread_once_t wheel_once = PTHREAD_ONCE_INIT;
+
+static void wheel_fd_close(void *fd)
+{
+    close((int)(intptr_t)fd - 1);
+}
+
+static void wheel_key_create(void)
+{
+    pthread_key_create(&wheel_key, wheel_fd_close);
+}
+
+static struct microtcp_wheel *wheel_get(void)
+{
+    struct timespec ts;
+
+    if(!wheel.init)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        wheel.init = 1;
+        wheel.fd = -1;
+        wheel.programmed = UINT64_MAX;
+        wheel.clock = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    }
+    return &wheel;
+}
+
+/*The first slot of the level that starts at or after the clock*/
+static uint64_t level_first(const struct microtcp_wheel *w, unsigned int level)
+{
+    unsigned int shift = level * WHEEL_BITS;
+
+    return (w->clock + ((uint64_t)1 << shift) - 1) >> shift;
+}
+
+static void wheel_link(struct microtcp_wheel *w, struct microtcp_timer *timer)
+{
+    uint64_t expires = timer->expires_us > w->clock ? timer->expires_us : w->clock;
+    uint64_t first, tick;
+    unsigned int level, slot;
+    struct microtcp_timer **head;
+
+    /*The lowest level whose next 64 slots reach the expiry*/
+    for(level = 0; ; level++)
+    {
+        first = level_first(w, level);
+        tick = expires >> (level * WHEEL_BITS);
+        if(tick >= first && tick - first < WHEEL_SLOTS)
+        {
+            break;
+        }
+        if(level == WHEEL_LEVELS - 1)
+        {
+            /*Beyond the wheel, it comes down from the last slot and is linked again*/
+            tick = first + WHEEL_SLOTS - 1;
+            break;
+        }
+    }
+
+    slot = tick & (WHEEL_SLOTS - 1);
+    head = &w->slots[level][slot];
+    timer->next = *head;
+    if(*head != NULL)
+    {
+        (*head)->pprev = &timer->next;
+    }
+    *head = timer;
+    timer->pprev = head;
+    timer->wheel = w;
+    timer->slot = level * WHEEL_SLOTS + slot;
+    w->occupied[level] |= (uint64_t)1 << slot;
+    w->count++;
+}
+
+static void wheel_unlink(struct microtcp_timer *timer)
+{
+    struct microtcp_wheel *w = timer->wheel;
+    unsigned int level = timer->slot / WHEEL_SLOTS;
+    unsigned int slot = timer->slot % WHEEL_SLOTS;
+
+    *timer->pprev = timer->next;
+    if(timer->next != NULL)
+    {
+        timer->next->pprev = timer->pprev;
+    }
+    if(w->slots[level][slot] == NULL)
+    {
+        w->occupied[level] &= ~((uint64_t)1 << slot);
+    }
+    timer->pprev = NULL;
+    w->count--;
+}
+
+/*Unlinks every timer of a slot at once*/
+static struct microtcp_timer *wheel_take(struct microtcp_wheel *w, unsigned int level, unsigned int slot)
+{
+    struct microtcp_timer *list = w->slots[level][slot];
+
+    w->slots[level][slot] = NULL;
+    w->occupied[level] &= ~((uint64_t)1 << slot);
+    for(struct microtcp_timer *timer = list; timer != NULL; timer = timer->next)
+    {
+        timer->pprev = NULL;
+        w->count--;
+    }
+    return list;
+}
+
+/*When the next slot fires or comes down a level, UINT64_MAX if none will*/
+static uint64_t wheel_next(const struct microtcp_wheel *w)
+{
+    uint64_t next = UINT64_MAX;
+    uint64_t first, bits, tick;
+    unsigned int s;
+
+    for(unsigned int level = 0; level < WHEEL_LEVELS; level++)
+    {
+        if(w->occupied[level] == 0)
+        {
+            continue;
+        }
+
+        /*The slots in use, rotated so that bit 0 is the first one*/
+        first = level_first(w, level);
+        s = first & (WHEEL_SLOTS - 1);
+        bits = (w->occupied[level] >> s) | (w->occupied[level] << ((WHEEL_SLOTS - s) & (WHEEL_SLOTS - 1)));
+        tick = (first + __builtin_ctzll(bits)) << (level * WHEEL_BITS);
+        if(tick < next)
+        {
+            next = tick;
+        }
+    }
+    return next;
+}
+
+void timer_arm (struct microtcp_timer *timer, uint64_t expires_us)
+{
+    struct microtcp_wheel *w = wheel_get();
+
+    if(timer->pprev != NULL)
+    {
+        if(timer->wheel == w && timer->expires_us == expires_us)
+        {
+            return;
+        }
+        wheel_unlink(timer);
+    }
+    timer->expires_us = expires_us;
+    wheel_link(w, timer);
+}
+
+void timer_cancel (struct microtcp_timer *timer)
+{
+    if(timer->pprev != NULL)
+    {
+        wheel_unlink(timer);
+    }
+}
+
+int timer_armed (const struct microtcp_timer *timer)
+{
+    return timer->pprev != NULL;
+}
+
+int timer_expire (uint64_t now_us)
+{
+    struct microtcp_wheel *w = wheel_get();
+    struct microtcp_timer *list, *timer;
+    uint64_t tick;
+    unsigned int shift;
+    int fired = 0;
+
+    while(w->count > 0 && (tick = wheel_next(w)) <= now_us)
+    {
+        w->clock = tick;
+
+        /*The upper slots that start now come down*/
+        for(unsigned int level = WHEEL_LEVELS - 1; level > 0; level--)
+        {
+            shift = level * WHEEL_BITS;
+            if((tick & (((uint64_t)1 << shift) - 1)) != 0)
+            {
+                continue;
+            }
+            list = wheel_take(w, level, (tick >> shift) & (WHEEL_SLOTS - 1));
+            while(list != NULL)
+            {
+                timer = list;
+                list = timer->next;
+                wheel_link(w, timer);
+            }
+        }
+
+        list = wheel_take(w, 0, tick & (WHEEL_SLOTS - 1));
+        while(list != NULL)
+        {
+            timer = list;
+            list = timer->next;
+            if(timer->expires_us > tick)
+            {
+                wheel_link(w, timer);
+                continue;
+            }
+            timer->fire(timer);
+            fired++;
+        }
+    }
+
+    if(now_us > w->clock)
+    {
+        w->clock = now_us;
+    }
+    return fired;
+}
+
+uint64_t timer_next (void)
+{
+    struct microtcp_wheel *w = wheel_get();
+
+    return w->count > 0 ? wheel_next(w) : UINT64_MAX;
+}
+
+int timer_fd (uint64_t now_us)
+{
+    struct microtcp_wheel *w = wheel_get();
+    struct itimerspec its;
+    uint64_t next;
+
+    if(w->fd == -1)
+    {
+        w->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if(w->fd == -1)
+        {
+            perror("WARNING AT Timer wheel, falling back to poll timeouts");
+            w->fd = -2;
+            return -1;
+        }
+        pthread_once(&wheel_once, wheel_key_create);
+        pthread_setspecific(wheel_key, (void*)(intptr_t)(w->fd + 1));
+    }
+    if(w->fd < 0)
+    {
+        return -1;
+    }
+
+    /*Set again only when it would go off late, or went off already. Going
+      off early costs a wake up that finds nothing due and sets it again*/
+    next = timer_next();
+    if(next != w->programmed && (next < w->programmed || w->programmed <= now_us))
+    {
+        memset(&its, 0, sizeof(its));
+        if(next != UINT64_MAX)
+        {
+            its.it_value.tv_sec = next / 1000000;
+            its.it_value.tv_nsec = (next % 1000000) * 1000;
+        }
+        if(timerfd_settime(w->fd, TFD_TIMER_ABSTIME, &its, NULL) == -1)
+        {
+            return -1;
+        }
+        w->programmed = next;
+    }
+    return w->fd;
+}
@@ -0,0 +1,67 @@
+#ifndef LIB_MICROTCP_TIMER_H_
+#define LIB_MICROTCP_TIMER_H_
+
+#include <stdint.h>
+
+struct microtcp_wheel;
+
+/**
+ * A timer of the wheel of the thread that armed it, see microtcp_timer.c.
+ * Times are CLOCK_MONOTONIC microseconds, like now_us() of microtcp.c.
+ */
+struct microtcp_timer
+{
+  struct microtcp_timer *next;
+  struct microtcp_timer **pprev;    /**< NULL while the timer is not armed */
+  struct microtcp_wheel *wheel;
+  uint64_t expires_us;
+  unsigned int slot;                /**< Level and slot of the wheel it is linked in */
+  void (*fire)(struct microtcp_timer *timer); /**< Called by timer_expire(), it may
+                                     not arm or cancel the other timers */
+  void *arg;
+};
+
+/**
+ * Arms the timer, or moves it, to go off at expires_us. It takes no
+ * system call.
+ */
+void
+timer_arm (struct microtcp_timer *timer, uint64_t expires_us);
+
+/**
+ * Stops the timer if it is armed.
+ */
+void
+timer_cancel (struct microtcp_timer *timer);
+
+/**
+ * @return whether the timer is armed
+ */
+int
+timer_armed (const struct microtcp_timer *timer);
+
+/**
+ * Fires the timers of the calling thread that are due by now_us.
+ *
+ * @return the number of timers fired
+ */
+int
+timer_expire (uint64_t now_us);
+
+/**
+ * @return when the next timer of the calling thread is due, or an upper
+ * level of its wheel has to be looked at, UINT64_MAX if none is armed
+ */
+uint64_t
+timer_next (void);
+
+/**
+ * @return the timerfd of the calling thread, set to be readable when its
+ * next timer is due, or -1 if it can not be created and
+ * the caller has to wait no longer than timer_next(). Called after
+ * timer_expire() with the same now_us, before blocking on it
+ */
+int
+timer_fd (uint64_t now_us);
+
+#endif /* LIB_MICROTCP_TIMER_H_ */
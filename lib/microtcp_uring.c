@@ -0,0 +1,500 @@
+#define _GNU_SOURCE
+#include "microtcp_uring.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+
+/**
+*   IO_URING BACKEND
+*   The datagrams of a connection go through a ring shared with the kernel.
+*   The UDP socket is a registered file. A single multishot RECVMSG keeps
+*   receiving into a ring of provided buffers, registered with the kernel
+*   once, and every datagram shows up as a completion, so taking what has
+*   arrived costs no system call at all. The sends of a batch are SENDMSGs
+*   linked in order and submitted with one io_uring_enter().
+*/
+
+#define URING_SQ_ENTRIES 128    /* A whole tx batch and the receive, see MICROTCP_TX_BATCH */
+#define URING_RECV UINT64_MAX   /* user_data of the receive, a send carries its index */
+#define URING_BGID 0            /* The group of the receive buffers */
+
+struct microtcp_uring
+{
+    int fd;
+    void *sq_ring;
+    size_t sq_ring_len;
+    void *cq_ring;                          /**< sq_ring when the kernel maps both at once */
+    size_t cq_ring_len;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_array;
+    unsigned int sq_mask;
+    unsigned int sq_entries;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned int to_submit;                 /**< Queued entries the kernel has not seen yet */
+
+    struct io_uring_buf_ring *br;           /**< The provided buffers the kernel may fill */
+    size_t br_len;
+    uint16_t br_tail;
+    uint8_t *bufs;                          /**< nbufs buffers of buf_len bytes */
+    size_t buf_len;
+    unsigned int nbufs;                     /**< Always a power of two */
+    uint16_t *held;                         /**< Buffers handed out by the last uring_recvmmsg() */
+    unsigned int nheld;
+
+    struct msghdr rx_msg;                   /**< Layout of the name and control of a buffer */
+    int rx_armed;                           /**< The multishot receive is still running */
+
+    struct io_uring_cqe *pending;           /**< Receive completions met while waiting for sends */
+    unsigned int pending_head;
+    unsigned int pending_len;
+};
+
+/*Submits what is queued and waits for min_complete completions*/
+static int ring_enter(struct microtcp_uring *ur, unsigned int min_complete)
+{
+    int ret;
+
+    do
+    {
+        ret = syscall(__NR_io_uring_enter, ur->fd, ur->to_submit, min_complete, min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while(ret == -1 && errno == EINTR);
+
+    if(ret == -1)
+    {
+        return -1;
+    }
+    ur->to_submit -= ret;
+    return 0;
+}
+
+/*A cleared submission entry, NULL if the queue is full*/
+static struct io_uring_sqe *sqe_next(struct microtcp_uring *ur)
+{
+    unsigned int tail = *ur->sq_tail;
+    struct io_uring_sqe *sqe;
+
+    if(tail - __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE) == ur->sq_entries)
+    {
+        return NULL;
+    }
+    sqe = &ur->sqes[tail & ur->sq_mask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    return sqe;
+}
+
+/*Queues the entry sqe_next() returned*/
+static void sqe_commit(struct microtcp_uring *ur)
+{
+    unsigned int tail = *ur->sq_tail;
+
+    ur->sq_array[tail & ur->sq_mask] = tail & ur->sq_mask;
+    __atomic_store_n(ur->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ur->to_submit++;
+}
+
+/*Takes the oldest completion, returns 0 if there is none*/
+static int cqe_pop(struct microtcp_uring *ur, struct io_uring_cqe *cqe)
+{
+    unsigned int head = *ur->cq_head;
+
+    if(head == __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        return 0;
+    }
+    *cqe = ur->cqes[head & ur->cq_mask];
+    __atomic_store_n(ur->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/*Takes the oldest receive completion, the ones put aside by a send first*/
+static int rx_pop(struct microtcp_uring *ur, struct io_uring_cqe *cqe)
+{
+    if(ur->pending_len > 0)
+    {
+        *cqe = ur->pending[ur->pending_head];
+        ur->pending_head = (ur->pending_head + 1) % (ur->nbufs + 1);
+        ur->pending_len--;
+        return 1;
+    }
+    return cqe_pop(ur, cqe);
+}
+
+/*Puts a receive completion aside. Every one but the last of the receive
+  holds a buffer, so there are never more than nbufs + 1 of them*/
+static void rx_push(struct microtcp_uring *ur, const struct io_uring_cqe *cqe)
+{
+    ur->pending[(ur->pending_head + ur->pending_len) % (ur->nbufs + 1)] = *cqe;
+    ur->pending_len++;
+}
+
+/*Gives a receive buffer back to the kernel, visible once the tail is stored*/
+static void buf_give(struct microtcp_uring *ur, uint16_t bid)
+{
+    struct io_uring_buf *buf = &ur->br->bufs[ur->br_tail & (ur->nbufs - 1)];
+
+    buf->addr = (uintptr_t)(ur->bufs + (size_t)bid * ur->buf_len);
+    buf->len = ur->buf_len;
+    buf->bid = bid;
+    ur->br_tail++;
+}
+
+/*Starts the multishot receive, again after it stopped for lack of buffers*/
+static int rx_arm(struct microtcp_uring *ur)
+{
+    struct io_uring_sqe *sqe = sqe_next(ur);
+
+    if(sqe == NULL)
+    {
+        errno = EBUSY;
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = 0;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->addr = (uintptr_t)&ur->rx_msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_TRUNC;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = URING_RECV;
+    sqe_commit(ur);
+
+    if(ring_enter(ur, 0) == -1)
+    {
+        return -1;
+    }
+    ur->rx_armed = 1;
+    return 0;
+}
+
+struct microtcp_uring *uring_open(int sd, unsigned int nbufs, size_t data_len, size_t control_len)
+{
+    struct microtcp_uring *ur;
+    struct io_uring_params params;
+    struct io_uring_buf_reg reg;
+    struct io_uring_cqe cqe;
+    int err;
+
+    ur = (struct microtcp_uring*) calloc(1, sizeof(struct microtcp_uring));
+    if(ur == NULL)
+    {
+        return NULL;
+    }
+
+    ur->nbufs = 1;
+    while(ur->nbufs < nbufs)
+    {
+        ur->nbufs <<= 1;
+    }
+
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = 2 * (ur->nbufs + URING_SQ_ENTRIES);
+    ur->fd = syscall(__NR_io_uring_setup, URING_SQ_ENTRIES, &params);
+    if(ur->fd == -1)
+    {
+        free(ur);
+        return NULL;
+    }
+
+    /*The queues, mapped from the kernel*/
+    ur->sq_ring_len = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ur->cq_ring_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if((params.features & IORING_FEAT_SINGLE_MMAP) && ur->cq_ring_len > ur->sq_ring_len)
+    {
+        ur->sq_ring_len = ur->cq_ring_len;
+    }
+    ur->sq_ring = mmap(NULL, ur->sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQ_RING);
+    if(ur->sq_ring == MAP_FAILED)
+    {
+        ur->sq_ring = NULL;
+        goto fail;
+    }
+    if(params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        ur->cq_ring = ur->sq_ring;
+    }
+    else
+    {
+        ur->cq_ring = mmap(NULL, ur->cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_CQ_RING);
+        if(ur->cq_ring == MAP_FAILED)
+        {
+            ur->cq_ring = NULL;
+            goto fail;
+        }
+    }
+    ur->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ur->sqes = (struct io_uring_sqe*) mmap(NULL, ur->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQES);
+    if(ur->sqes == MAP_FAILED)
+    {
+        ur->sqes = NULL;
+        goto fail;
+    }
+
+    ur->sq_head = (unsigned int*)((uint8_t*)ur->sq_ring + params.sq_off.head);
+    ur->sq_tail = (unsigned int*)((uint8_t*)ur->sq_ring + params.sq_off.tail);
+    ur->sq_array = (unsigned int*)((uint8_t*)ur->sq_ring + params.sq_off.array);
+    ur->sq_mask = *(unsigned int*)((uint8_t*)ur->sq_ring + params.sq_off.ring_mask);
+    ur->sq_entries = params.sq_entries;
+    ur->cq_head = (unsigned int*)((uint8_t*)ur->cq_ring + params.cq_off.head);
+    ur->cq_tail = (unsigned int*)((uint8_t*)ur->cq_ring + params.cq_off.tail);
+    ur->cq_mask = *(unsigned int*)((uint8_t*)ur->cq_ring + params.cq_off.ring_mask);
+    ur->cqes = (struct io_uring_cqe*)((uint8_t*)ur->cq_ring + params.cq_off.cqes);
+
+    /*The socket, looked up once instead of at every operation*/
+    if(syscall(__NR_io_uring_register, ur->fd, IORING_REGISTER_FILES, &sd, 1) == -1)
+    {
+        goto fail;
+    }
+
+    /*Every receive buffer is the header of the kernel, the name, the control and the payload*/
+    ur->buf_len = (sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_storage) + control_len + data_len + 63) & ~(size_t)63;
+    ur->bufs = (uint8_t*) malloc(ur->nbufs * ur->buf_len);
+    ur->held = (uint16_t*) malloc(ur->nbufs * sizeof(uint16_t));
+    ur->pending = (struct io_uring_cqe*) malloc((ur->nbufs + 1) * sizeof(struct io_uring_cqe));
+    if(ur->bufs == NULL || ur->held == NULL || ur->pending == NULL)
+    {
+        errno = ENOMEM;
+        goto fail;
+    }
+
+    ur->br_len = ur->nbufs * sizeof(struct io_uring_buf);
+    ur->br = (struct io_uring_buf_ring*) mmap(NULL, ur->br_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(ur->br == MAP_FAILED)
+    {
+        ur->br = NULL;
+        goto fail;
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)ur->br;
+    reg.ring_entries = ur->nbufs;
+    reg.bgid = URING_BGID;
+    if(syscall(__NR_io_uring_register, ur->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+    {
+        goto fail;
+    }
+    for(unsigned int i = 0; i < ur->nbufs; i++)
+    {
+        buf_give(ur, i);
+    }
+    __atomic_store_n(&ur->br->tail, ur->br_tail, __ATOMIC_RELEASE);
+
+    ur->rx_msg.msg_namelen = sizeof(struct sockaddr_storage);
+    ur->rx_msg.msg_controllen = control_len;
+    if(rx_arm(ur) == -1)
+    {
+        goto fail;
+    }
+
+    /*A kernel without multishot receive fails it right away*/
+    if(cqe_pop(ur, &cqe))
+    {
+        if(cqe.res < 0 && !(cqe.flags & IORING_CQE_F_MORE))
+        {
+            errno = -cqe.res;
+            goto fail;
+        }
+        rx_push(ur, &cqe);
+    }
+    return ur;
+
+fail:
+    err = errno;
+    uring_close(ur);
+    errno = err;
+    return NULL;
+}
+
+void uring_close(struct microtcp_uring *ur)
+{
+    if(ur == NULL)
+    {
+        return;
+    }
+
+    /*Closing the ring cancels the receive and drops the registrations*/
+    if(ur->sqes != NULL)
+    {
+        munmap(ur->sqes, ur->sqes_len);
+    }
+    if(ur->cq_ring != NULL && ur->cq_ring != ur->sq_ring)
+    {
+        munmap(ur->cq_ring, ur->cq_ring_len);
+    }
+    if(ur->sq_ring != NULL)
+    {
+        munmap(ur->sq_ring, ur->sq_ring_len);
+    }
+    close(ur->fd);
+    if(ur->br != NULL)
+    {
+        munmap(ur->br, ur->br_len);
+    }
+    free(ur->bufs);
+    free(ur->held);
+    free(ur->pending);
+    free(ur);
+}
+
+int uring_fd(const struct microtcp_uring *ur)
+{
+    return ur->fd;
+}
+
+int uring_sendmmsg(struct microtcp_uring *ur, struct mmsghdr *msgs, unsigned int vlen, int flags)
+{
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe cqe;
+    unsigned int done = 0, sent = 0;
+    int err = 0;
+
+    /*Linked, so a send the socket has no room for yet holds back the ones after it*/
+    for(unsigned int i = 0; i < vlen; i++)
+    {
+        sqe = sqe_next(ur);
+        if(sqe == NULL)
+        {
+            errno = EBUSY;
+            return -1;
+        }
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = 0;
+        sqe->flags = IOSQE_FIXED_FILE | (i + 1 < vlen ? IOSQE_IO_LINK : 0);
+        sqe->addr = (uintptr_t)&msgs[i].msg_hdr;
+        sqe->len = 1;
+        sqe->msg_flags = flags;
+        sqe->user_data = i;
+        sqe_commit(ur);
+    }
+
+    /*The headers of the batch are reused once this returns, wait for the kernel to be done*/
+    if(ring_enter(ur, vlen) == -1)
+    {
+        return -1;
+    }
+    for(;;)
+    {
+        while(done < vlen && cqe_pop(ur, &cqe))
+        {
+            if(cqe.user_data == URING_RECV)
+            {
+                rx_push(ur, &cqe);
+                continue;
+            }
+            done++;
+            if(cqe.res < 0)
+            {
+                /*The cause, not the sends cancelled after it*/
+                if(err == 0 || err == ECANCELED)
+                {
+                    err = -cqe.res;
+                }
+                continue;
+            }
+            msgs[cqe.user_data].msg_len = cqe.res;
+            sent++;
+        }
+        if(done == vlen)
+        {
+            break;
+        }
+        if(ring_enter(ur, 1) == -1)
+        {
+            return -1;
+        }
+    }
+
+    /*The link breaks at the failed send, the ones before it are out*/
+    if(err != 0 && sent == 0)
+    {
+        errno = err;
+        return -1;
+    }
+    return sent;
+}
+
+int uring_recvmmsg(struct microtcp_uring *ur, struct mmsghdr *msgs, unsigned int vlen)
+{
+    struct io_uring_recvmsg_out *out;
+    struct io_uring_cqe cqe;
+    struct msghdr *msg;
+    unsigned int n = 0;
+    uint8_t *buf, *name, *control, *payload;
+    uint16_t bid;
+    int err = 0;
+
+    /*The buffers of the last call are free again*/
+    for(unsigned int i = 0; i < ur->nheld; i++)
+    {
+        buf_give(ur, ur->held[i]);
+    }
+    ur->nheld = 0;
+    __atomic_store_n(&ur->br->tail, ur->br_tail, __ATOMIC_RELEASE);
+
+    while(n < vlen && rx_pop(ur, &cqe))
+    {
+        if(!(cqe.flags & IORING_CQE_F_MORE))
+        {
+            ur->rx_armed = 0;
+        }
+
+        /*ENOBUFS only stops the receive until there are buffers again*/
+        if(cqe.res < 0)
+        {
+            if(cqe.res != -ENOBUFS)
+            {
+                err = -cqe.res;
+            }
+            continue;
+        }
+        if(!(cqe.flags & IORING_CQE_F_BUFFER))
+        {
+            continue;
+        }
+
+        bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+        ur->held[ur->nheld++] = bid;
+        buf = ur->bufs + (size_t)bid * ur->buf_len;
+        out = (struct io_uring_recvmsg_out*) buf;
+        name = buf + sizeof(struct io_uring_recvmsg_out);
+        control = name + ur->rx_msg.msg_namelen;
+        payload = control + ur->rx_msg.msg_controllen;
+
+        msg = &msgs[n].msg_hdr;
+        if(msg->msg_name != NULL)
+        {
+            msg->msg_namelen = out->namelen < msg->msg_namelen ? out->namelen : msg->msg_namelen;
+            memcpy(msg->msg_name, name, msg->msg_namelen);
+        }
+        msg->msg_control = out->controllen > 0 ? control : NULL;
+        msg->msg_controllen = out->controllen;
+        msg->msg_flags = out->flags;
+        msg->msg_iov[0].iov_base = payload;
+        msgs[n].msg_len = out->payloadlen;
+        n++;
+    }
+
+    if(!ur->rx_armed && rx_arm(ur) == -1)
+    {
+        return -1;
+    }
+
+    if(n == 0)
+    {
+        errno = err != 0 ? err : EAGAIN;
+        return -1;
+    }
+    return n;
+}
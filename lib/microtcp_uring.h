@@ -0,0 +1,61 @@
+#ifndef LIB_MICROTCP_URING_H_
+#define LIB_MICROTCP_URING_H_
+
+#include <stddef.h>
+#include <sys/socket.h>
+
+/**
+ * The io_uring backend of a connection, see microtcp_uring.c. It stands in
+ * for sendmmsg() and recvmmsg() on the UDP socket of the connection, with
+ * the same arguments and results.
+ */
+struct microtcp_uring;
+
+/**
+ * Sets up a ring for sd and starts receiving into nbufs buffers of
+ * data_len bytes of payload and control_len bytes of ancillary data each.
+ *
+ * @return the ring or NULL on failure, with errno set. ENOSYS, EPERM and
+ * EINVAL mean that the kernel can not do it
+ */
+struct microtcp_uring *
+uring_open (int sd, unsigned int nbufs, size_t data_len, size_t control_len);
+
+/**
+ * Stops receiving and releases the ring, sd stays open.
+ */
+void
+uring_close (struct microtcp_uring *ur);
+
+/**
+ * @return the descriptor of the ring, readable while something was received
+ */
+int
+uring_fd (const struct microtcp_uring *ur);
+
+/**
+ * sendmmsg() through the ring. The messages leave in order and the call
+ * returns once the kernel is done with all of them.
+ *
+ * @return the number of messages sent, which stops before the first that
+ * failed, or -1 with errno set if the first one did
+ */
+int
+uring_sendmmsg (struct microtcp_uring *ur, struct mmsghdr *msgs,
+                unsigned int vlen, int flags);
+
+/**
+ * recvmmsg() with MSG_DONTWAIT | MSG_TRUNC through the ring, the length of
+ * a datagram cut short is the one it had. It never copies: the
+ * first iovec and the control of every message are pointed at the buffer
+ * the datagram was received into, which the ring takes back at the next
+ * call.
+ *
+ * @return the number of messages, or -1 with errno EAGAIN if nothing has
+ * arrived, or another errno on failure
+ */
+int
+uring_recvmmsg (struct microtcp_uring *ur, struct mmsghdr *msgs,
+                unsigned int vlen);
+
+#endif /* LIB_MICROTCP_URING_H_ */
@@ -159,11 +159,13 @@ server_tcp (uint16_t listen_port, const char *file)
 }
 
 int
-server_microtcp (uint16_t listen_port, const char *file)
+server_microtcp (uint16_t listen_port, const char *file, uint8_t offload,
+                 uint8_t uring, const char *cc, uint64_t window)
 {
   uint8_t *buffer;
   FILE *fp;
-  microtcp_sock_t sock, accepted, received ;
+  microtcp_sock_t sock;
+  ssize_t received;
   ssize_t written;
   ssize_t total_bytes = 0;
   socklen_t client_addr_len;
@@ -188,9 +190,24 @@ server_microtcp (uint16_t listen_port, const char *file)
     return -EXIT_FAILURE;
   }
 
-  sock = microtcp_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  sock = microtcp_socket(AF_INET, SOCK_DGRAM | (uring ? MICROTCP_SOCK_URING : 0),
+                         IPPROTO_UDP);
   if (sock.sd == -1) {
-    perror ("Opening TCP socket");
+    perror ("Opening microTCP socket");
+    free (buffer);
+    fclose (fp);
+    return -EXIT_FAILURE;
+  }
+  sock.offload = offload;
+  if (window && (microtcp_setsockopt (&sock, SOL_MICROTCP, MICROTCP_SO_RCVBUF,
+                                      &window, sizeof(window)) == -1
+                 || microtcp_setsockopt (&sock, SOL_MICROTCP, MICROTCP_SO_SNDBUF,
+                                         &window, sizeof(window)) == -1)) {
+    free (buffer);
+    fclose (fp);
+    return -EXIT_FAILURE;
+  }
+  if (cc && microtcp_set_congestion_control (&sock, cc) == -1) {
     free (buffer);
     fclose (fp);
     return -EXIT_FAILURE;
@@ -203,24 +220,16 @@ server_microtcp (uint16_t listen_port, const char *file)
   sin.sin_addr.s_addr = INADDR_ANY;
 
   if (microtcp_bind (&sock, (struct sockaddr *) &sin, sizeof(struct sockaddr_in)) == -1) {
-    perror ("TCP bind");
+    perror ("microTCP bind");
     free (buffer);
     fclose (fp);
     return -EXIT_FAILURE;
   }
 
-  if (listen (sock.sd, 1000) == -1) {
-    perror ("TCP listen");
-    free (buffer);
-    fclose (fp);
-    return -EXIT_FAILURE;
-  }
-
-  /* Accept a connection from the client */
+  /* Accept a connection from the client. The bound socket becomes the connection */
   client_addr_len = sizeof(struct sockaddr);
-  accepted.sd = microtcp_accept (&sock, &client_addr, client_addr_len);
-  if (accepted.sd < 0) {
-    perror ("TCP accept");
+  if (microtcp_accept (&sock, &client_addr, client_addr_len) < 0) {
+    perror ("microTCP accept");
     free (buffer);
     fclose (fp);
     return -EXIT_FAILURE;
@@ -237,28 +246,25 @@ server_microtcp (uint16_t listen_port, const char *file)
    */
 
   clock_gettime (CLOCK_MONOTONIC_RAW, &start_time);
-  /**
-  while ((received = recv (accepted, buffer, CHUNK_SIZE, 0)) > 0) {
+  while ((received = microtcp_recv (&sock, buffer, CHUNK_SIZE, 0)) > 0) {
     written = fwrite (buffer, sizeof(uint8_t), received, fp);
     total_bytes += received;
     if (written * sizeof(uint8_t) != received) {
       printf ("Failed to write to the file the"
               " amount of data received from the network.\n");
-      shutdown (accepted, SHUT_RDWR);
-      shutdown (sock, SHUT_RDWR);
-      close (accepted);
-      close (sock);
+      microtcp_shutdown (&sock, SHUT_RDWR);
+      close (sock.sd);
       free (buffer);
       fclose (fp);
       return -EXIT_FAILURE;
     }
-  }**/
+  }
   clock_gettime (CLOCK_MONOTONIC_RAW, &end_time);
   print_statistics (total_bytes, start_time, end_time);
+  printf ("I/O: %s, receive syscalls saved: %lu\n",
+          sock.uring ? "io_uring" : "system calls", sock.rx_syscalls_saved);
 
-  microtcp_shutdown (&accepted, SHUT_RDWR);
   microtcp_shutdown (&sock, SHUT_RDWR);
-  close (accepted.sd);
   close (sock.sd);
   fclose (fp);
   free (buffer);
@@ -350,7 +356,9 @@ client_tcp (const char *serverip, uint16_t server_port, const char *file)
 }
 
 int
-client_microtcp (const char *serverip, uint16_t server_port, const char *file)
+client_microtcp (const char *serverip, uint16_t server_port, const char *file,
+                 uint8_t offload, uint8_t uring, const char *cc,
+                 uint64_t max_rate, uint64_t window)
 {
   uint8_t *buffer;
   microtcp_sock_t sock;
@@ -358,6 +366,8 @@ client_microtcp (const char *serverip, uint16_t server_port, const char *file)
   FILE *fp;
   size_t read_items = 0;
   ssize_t data_sent;
+  ssize_t ret;
+  microtcp_pollfd_t pfd;
 
   struct sockaddr *client_addr;
 
@@ -376,9 +386,31 @@ client_microtcp (const char *serverip, uint16_t server_port, const char *file)
     return -EXIT_FAILURE;
   }
 
-  sock = microtcp_socket (AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  sock = microtcp_socket (AF_INET, SOCK_DGRAM | (uring ? MICROTCP_SOCK_URING : 0),
+                          IPPROTO_UDP);
   if ( sock.sd == -1) {
-    perror ("Opening TCP socket");
+    perror ("Opening microTCP socket");
+    free (buffer);
+    fclose (fp);
+    return -EXIT_FAILURE;
+  }
+  sock.offload = offload;
+  if (max_rate && microtcp_setsockopt (&sock, SOL_MICROTCP,
+                                       MICROTCP_SO_MAX_PACING_RATE, &max_rate,
+                                       sizeof(max_rate)) == -1) {
+    free (buffer);
+    fclose (fp);
+    return -EXIT_FAILURE;
+  }
+  if (window && (microtcp_setsockopt (&sock, SOL_MICROTCP, MICROTCP_SO_RCVBUF,
+                                      &window, sizeof(window)) == -1
+                 || microtcp_setsockopt (&sock, SOL_MICROTCP, MICROTCP_SO_SNDBUF,
+                                         &window, sizeof(window)) == -1)) {
+    free (buffer);
+    fclose (fp);
+    return -EXIT_FAILURE;
+  }
+  if (cc && microtcp_set_congestion_control (&sock, cc) == -1) {
     free (buffer);
     fclose (fp);
     return -EXIT_FAILURE;
@@ -394,44 +426,59 @@ client_microtcp (const char *serverip, uint16_t server_port, const char *file)
 
   if (microtcp_connect (&sock, (struct sockaddr *) &sin, sizeof(struct sockaddr_in))
       == -1) {
-    perror ("TCP connect");
+    perror ("microTCP connect");
     exit (EXIT_FAILURE);
   }
 
   printf ("Starting sending data...\n");
   /* Start sending the data */
-  /*
   while (!feof (fp)) {
     read_items = fread (buffer, sizeof(uint8_t), CHUNK_SIZE, fp);
     if (read_items < 1) {
+      if (feof (fp)) {
+        break;
+      }
       perror ("Failed read from file");
-      shutdown (sock, SHUT_RDWR);
-      close (sock);
+      microtcp_shutdown (&sock, SHUT_RDWR);
+      close (sock.sd);
       free (buffer);
       fclose (fp);
       return -EXIT_FAILURE;
     }
 
-    data_sent = send (sock, buffer, read_items * sizeof(uint8_t), 0);
+    /*
+     * Queue the chunk in the send buffer, waiting only when it is full. A
+     * blocking send waits for every byte to be acknowledged, a round trip
+     * per chunk, and the window would never grow past it.
+     */
+    data_sent = 0;
+    while (data_sent >= 0 && (size_t) data_sent < read_items) {
+      ret = microtcp_send (&sock, buffer + data_sent, read_items - data_sent,
+                           MSG_DONTWAIT);
+      if (ret == -1 && errno == EAGAIN) {
+        pfd.socket = &sock;
+        pfd.events = POLLOUT;
+        ret = microtcp_poll (&pfd, 1, -1) == -1 ? -1 : 0;
+      }
+      data_sent = ret == -1 ? -1 : data_sent + ret;
+    }
     if (data_sent != read_items * sizeof(uint8_t)) {
       printf ("Failed to send the"
               " amount of data read from the file.\n");
-      shutdown (sock, SHUT_RDWR);
-      close (sock);
+      microtcp_shutdown (&sock, SHUT_RDWR);
+      close (sock.sd);
       free (buffer);
       fclose (fp);
       return -EXIT_FAILURE;
     }
 
   }
-*/
+
   printf ("Data sent. Terminating...\n");
   microtcp_shutdown (&sock, SHUT_RDWR);
   close (sock.sd);
   free (buffer);
   fclose (fp);
-
-
   return 0;
 }
 
@@ -445,9 +492,14 @@ main (int argc, char **argv)
   char *ipstr = NULL;
   uint8_t is_server = 0;
   uint8_t use_microtcp = 0;
+  uint8_t use_offload = 0;
+  uint8_t use_uring = 0;
+  char *ccstr = NULL;
+  uint64_t max_rate = 0;
+  uint64_t window = 0;
 
   /* A very easy way to parse command line arguments */
-  while ((opt = getopt (argc, argv, "hsmf:p:a:")) != -1) {
+  while ((opt = getopt (argc, argv, "hsmouc:r:w:f:p:a:")) != -1) {
     switch (opt)
       {
       /* If -s is set, program runs on server mode */
@@ -458,6 +510,26 @@ main (int argc, char **argv)
       case 'm':
         use_microtcp = 1;
         break;
+        /* if -o is set microTCP uses UDP segmentation offload (GSO/GRO) */
+      case 'o':
+        use_offload = 1;
+        break;
+        /* if -u is set microTCP moves its datagrams through io_uring */
+      case 'u':
+        use_uring = 1;
+        break;
+        /* if -c is set microTCP uses the given congestion control */
+      case 'c':
+        ccstr = strdup (optarg);
+        break;
+        /* if -r is set the microTCP client paces its segments at most at that rate */
+      case 'r':
+        max_rate = strtoull (optarg, NULL, 10) * 1024 * 1024;
+        break;
+        /* if -w is set microTCP uses send and receive buffers, and a window, of that many KB */
+      case 'w':
+        window = strtoull (optarg, NULL, 10) * 1024;
+        break;
       case 'f':
         filestr = strdup (optarg);
         /* A few checks will be nice here...*/
@@ -473,10 +545,15 @@ main (int argc, char **argv)
 
       default:
         printf (
-            "Usage: bandwidth_test [-s] [-m] -p port -f file"
+            "Usage: bandwidth_test [-s] [-m] [-o] [-u] [-c cc] [-r rate] [-w window] -p port -f file"
             "Options:\n"
             "   -s                  If set, the program runs as server. Otherwise as client.\n"
             "   -m                  If set, the program uses the microTCP implementation. Otherwise the normal TCP.\n"
+            "   -o                  If set, microTCP uses UDP segmentation offload (GSO/GRO).\n"
+            "   -u                  If set, microTCP sends and receives through io_uring.\n"
+            "   -c <string>         The congestion control of microTCP, reno (default), cubic or bbr.\n"
+            "   -r <int>            The microTCP client sends at most <int> MB/s, paced.\n"
+            "   -w <int>            The send and receive buffers, and so the window, of microTCP in KB (default 256).\n"
             "   -f <string>         If -s is set the -f option specifies the filename of the file that will be saved.\n"
             "                       If not, is the source file at the client side that will be sent to the server.\n"
             "   -p <int>            The listening port of the server\n"
@@ -496,7 +573,7 @@ main (int argc, char **argv)
   if (is_server) {
 
     if (use_microtcp) {
-      exit_code = server_microtcp (port, filestr);
+      exit_code = server_microtcp (port, filestr, use_offload, use_uring, ccstr, window);
     }
     else {
       exit_code = server_tcp (port, filestr);
@@ -504,7 +581,7 @@ main (int argc, char **argv)
   }
   else {
     if (use_microtcp) {
-      exit_code = client_microtcp (ipstr, port, filestr);
+      exit_code = client_microtcp (ipstr, port, filestr, use_offload, use_uring, ccstr, max_rate, window);
     }
     else {
       exit_code = client_tcp (ipstr, port, filestr);
@@ -513,6 +590,7 @@ main (int argc, char **argv)
 
   free (filestr);
   free (ipstr);
+  free (ccstr);
   return exit_code;
 }
 
@@ -0,0 +1,189 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks that every CRC-32 implementation of utils/crc32.h agrees with the
+ * byte at a time one and measures the throughput of each, in GB/s, for the
+ * sizes of a header, a segment, a jumbo segment and a large buffer. The
+ * copying forms are measured against plain memcpy().
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "../utils/crc32.h"
+
+#define BUF_LEN (1024 * 1024)
+#define BENCH_BYTES (256 * 1024 * 1024)
+
+struct variant
+{
+  const char *name;
+  crc32_impl_t impl;
+  crc32_copy_impl_t copy;
+};
+
+static uint32_t
+plain_memcpy (uint32_t crc, uint8_t *dst, const uint8_t *src, size_t len)
+{
+  memcpy (dst, src, len);
+  return crc;
+}
+
+static double
+now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Every length up to 1 KB and some larger ones, at every alignment up to 16 */
+static int
+check (const struct variant *v, const uint8_t *buf, uint8_t *dst)
+{
+  size_t len, off;
+  uint32_t ref;
+
+  for (off = 0; off < 16; off++) {
+    for (len = 0; len < BUF_LEN - 16; len = len < 1024 ? len + 1 : len * 3) {
+      ref = update_crc32_bytewise (0xffffffff, buf + off, len);
+      memset (dst, 0, len + 16);
+      if (v->impl (0xffffffff, buf + off, len) != ref
+          || v->copy (0xffffffff, dst + off, buf + off, len) != ref
+          || memcmp (dst + off, buf + off, len) != 0
+          || dst[off + len] != 0) {
+        fprintf (stderr, "%s: wrong CRC-32 or copy of %zu bytes at offset %zu\n",
+                 v->name, len, off);
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+/* GB/s of the checksum alone, or of the copy when dst is set */
+static double
+bench (const struct variant *v, const uint8_t *buf, uint8_t *dst, size_t len)
+{
+  volatile uint32_t sink = 0;
+  size_t i, rounds = BENCH_BYTES / len;
+  double start;
+
+  /* The byte at a time loop is slow enough with far less data */
+  if (v->impl == update_crc32_bytewise) {
+    rounds = rounds / 16 + 1;
+  }
+
+  start = now ();
+  for (i = 0; i < rounds; i++) {
+    if (dst) {
+      sink ^= v->copy (0xffffffff, dst, buf, len);
+    }
+    else {
+      sink ^= v->impl (0xffffffff, buf, len);
+    }
+  }
+  (void) sink;
+  return (double) rounds * len / (now () - start) / 1e9;
+}
+
+static void
+print_row (const char *name, const struct variant *v, const uint8_t *buf,
+           uint8_t *dst, const size_t *sizes, size_t nsizes)
+{
+  size_t s;
+
+  printf ("%-16s", name);
+  for (s = 0; s < nsizes; s++) {
+    printf ("%10.2f  ", bench (v, buf, dst, sizes[s]));
+  }
+  printf ("GB/s\n");
+}
+
+int
+main (void)
+{
+  static const size_t sizes[] = { 32, 1432, 8972, 65536, BUF_LEN };
+  const size_t nsizes = sizeof(sizes) / sizeof(sizes[0]);
+  const struct variant copy = { "memcpy", NULL, plain_memcpy };
+  struct variant variants[4];
+  char name[32];
+  int nvariants = 0;
+  uint8_t *buf, *dst;
+  int i, ret = EXIT_SUCCESS;
+  size_t s;
+
+  variants[nvariants++] = (struct variant) { "bytewise", update_crc32_bytewise, update_crc32_copy_bytewise };
+  variants[nvariants++] = (struct variant) { "slice16", update_crc32_slice16, update_crc32_copy_slice16 };
+#ifdef CRC32_HAVE_PCLMUL
+  if (__builtin_cpu_supports ("pclmul") && __builtin_cpu_supports ("sse4.1")) {
+    variants[nvariants++] = (struct variant) { "pclmul", update_crc32_pclmul, update_crc32_copy_pclmul };
+  }
+#endif
+  variants[nvariants++] = (struct variant) { "dispatched", update_crc32, update_crc32_copy };
+
+  buf = (uint8_t *) malloc (BUF_LEN);
+  dst = (uint8_t *) malloc (BUF_LEN);
+  if (!buf || !dst) {
+    perror ("Allocate benchmark buffers");
+    free (buf);
+    free (dst);
+    return EXIT_FAILURE;
+  }
+  srand (1);
+  for (s = 0; s < BUF_LEN; s++) {
+    buf[s] = rand ();
+  }
+
+  /* The check value of the CRC-32 */
+  if (crc32 ((const uint8_t *) "123456789", 9) != 0xCBF43926) {
+    fprintf (stderr, "crc32: wrong check value\n");
+    ret = EXIT_FAILURE;
+  }
+
+  for (i = 0; i < nvariants; i++) {
+    if (check (&variants[i], buf, dst) == -1) {
+      ret = EXIT_FAILURE;
+    }
+  }
+
+  printf ("%-16s", "bytes");
+  for (s = 0; s < nsizes; s++) {
+    printf ("%12zu", sizes[s]);
+  }
+  printf ("\n");
+
+  for (i = 0; i < nvariants; i++) {
+    print_row (variants[i].name, &variants[i], buf, NULL, sizes, nsizes);
+  }
+  print_row (copy.name, &copy, buf, dst, sizes, nsizes);
+  for (i = 0; i < nvariants; i++) {
+    snprintf (name, sizeof(name), "copy+%s", variants[i].name);
+    print_row (name, &variants[i], buf, dst, sizes, nsizes);
+  }
+
+  free (buf);
+  free (dst);
+  return ret;
+}
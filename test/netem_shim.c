@@ -0,0 +1,279 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A poor man's netem for machines where tc is not available. Preloaded into
+ * both ends of a transfer, it wraps sendto(), sendmsg() and sendmmsg() and
+ * puts every datagram through an emulated link, configured from the
+ * environment:
+ *
+ *   NETEM_LOSS      Probability of dropping a datagram that carries data.
+ *                   Bare headers (ACKs, handshake) are never dropped.
+ *   NETEM_DELAY_US  One way delay in microseconds, the RTT is twice that.
+ *   NETEM_RATE      Bottleneck rate in MB/s, unlimited if unset.
+ *   NETEM_LIMIT     Bottleneck queue in KB, tail dropped beyond it
+ *                   (default 256).
+ *
+ * e.g. NETEM_DELAY_US=10000 NETEM_RATE=20 LD_PRELOAD=./libnetem_shim.so \
+ *          ./bandwidth_test -m -c bbr -a 127.0.0.1 -p 8080 -f file
+ *
+ * Delayed datagrams are copied and sent in order by a thread of their own.
+ * Zero-copy sends go out untouched and io_uring or GSO transfers bypass or
+ * distort the emulation, so compare runs without -u and -o.
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+/* Length of a microTCP header, anything longer carries data */
+#define HEADER_LEN 32
+
+struct datagram
+{
+  struct datagram *next;
+  uint64_t due;
+  int fd;
+  int flags;
+  socklen_t namelen;
+  struct sockaddr_storage name;
+  size_t len;
+  size_t controllen;
+  uint8_t data[];
+};
+
+static ssize_t (*real_sendmsg) (int, const struct msghdr *, int);
+
+static double loss;
+static uint64_t delay_us;
+static double rate;
+static uint64_t limit = 256 * 1024;
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static struct datagram *head;
+static struct datagram *tail;
+static uint64_t link_free;
+static unsigned int seed;
+
+static uint64_t
+now_us (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Sends the queued datagrams once they are due, in order */
+static void *
+link_thread (void *arg)
+{
+  struct datagram *d;
+  struct msghdr msg;
+  struct iovec iov;
+  struct timespec ts;
+
+  (void) arg;
+  for (;;) {
+    pthread_mutex_lock (&lock);
+    while (!head) {
+      pthread_cond_wait (&cond, &lock);
+    }
+    d = head;
+    pthread_mutex_unlock (&lock);
+
+    /* Only the tail changes meanwhile, with a later due time */
+    ts.tv_sec = d->due / 1000000;
+    ts.tv_nsec = (d->due % 1000000) * 1000;
+    while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0);
+
+    pthread_mutex_lock (&lock);
+    head = d->next;
+    if (!head) {
+      tail = NULL;
+    }
+    pthread_mutex_unlock (&lock);
+
+    iov.iov_base = d->data;
+    iov.iov_len = d->len;
+    memset (&msg, 0, sizeof(msg));
+    msg.msg_name = d->namelen ? &d->name : NULL;
+    msg.msg_namelen = d->namelen;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = d->controllen ? d->data + d->len : NULL;
+    msg.msg_controllen = d->controllen;
+    /* A failure here is a loss on the link */
+    real_sendmsg (d->fd, &msg, d->flags);
+    free (d);
+  }
+  return NULL;
+}
+
+static void
+init (void)
+{
+  const char *e;
+  pthread_t tid;
+
+  real_sendmsg = dlsym (RTLD_NEXT, "sendmsg");
+  if ((e = getenv ("NETEM_LOSS"))) {
+    loss = atof (e);
+  }
+  if ((e = getenv ("NETEM_DELAY_US"))) {
+    delay_us = strtoull (e, NULL, 10);
+  }
+  if ((e = getenv ("NETEM_RATE"))) {
+    rate = atof (e) * 1024 * 1024;
+  }
+  if ((e = getenv ("NETEM_LIMIT"))) {
+    limit = strtoull (e, NULL, 10) * 1024;
+  }
+  seed = (unsigned int) now_us ();
+
+  if ((delay_us || rate > 0)
+      && pthread_create (&tid, NULL, link_thread, NULL) != 0) {
+    perror ("netem_shim: link thread");
+    abort ();
+  }
+}
+
+/* Puts one datagram on the link, returns its length as if it was sent */
+static ssize_t
+link_send (int fd, const struct msghdr *msg, int flags)
+{
+  struct datagram *d;
+  size_t len = 0;
+  size_t i, off;
+  uint64_t now, depart;
+
+  pthread_once (&once, init);
+  if (flags & MSG_ZEROCOPY) {
+    return real_sendmsg (fd, msg, flags);
+  }
+
+  for (i = 0; i < msg->msg_iovlen; i++) {
+    len += msg->msg_iov[i].iov_len;
+  }
+
+  pthread_mutex_lock (&lock);
+  if (len > HEADER_LEN && loss > 0
+      && rand_r (&seed) / (double) RAND_MAX < loss) {
+    pthread_mutex_unlock (&lock);
+    return len;
+  }
+  if (!delay_us && rate <= 0) {
+    pthread_mutex_unlock (&lock);
+    return real_sendmsg (fd, msg, flags);
+  }
+
+  /* Serialize behind the bottleneck queue, dropping what overflows it */
+  now = now_us ();
+  depart = now;
+  if (rate > 0) {
+    depart = link_free > now ? link_free : now;
+    if ((depart - now) * rate / 1e6 > limit) {
+      pthread_mutex_unlock (&lock);
+      return len;
+    }
+    depart += len * 1e6 / rate;
+    link_free = depart;
+  }
+  pthread_mutex_unlock (&lock);
+
+  d = malloc (sizeof(struct datagram) + len + msg->msg_controllen);
+  if (!d) {
+    return len;
+  }
+  d->next = NULL;
+  d->due = depart + delay_us;
+  d->fd = fd;
+  d->flags = flags;
+  d->namelen = msg->msg_name ? msg->msg_namelen : 0;
+  if (d->namelen) {
+    memcpy (&d->name, msg->msg_name, d->namelen);
+  }
+  d->len = len;
+  for (i = 0, off = 0; i < msg->msg_iovlen; i++) {
+    memcpy (d->data + off, msg->msg_iov[i].iov_base, msg->msg_iov[i].iov_len);
+    off += msg->msg_iov[i].iov_len;
+  }
+  d->controllen = msg->msg_controllen;
+  if (d->controllen) {
+    memcpy (d->data + len, msg->msg_control, d->controllen);
+  }
+
+  /* Due times only grow, so the queue stays in order */
+  pthread_mutex_lock (&lock);
+  if (tail) {
+    tail->next = d;
+  }
+  else {
+    head = d;
+    pthread_cond_signal (&cond);
+  }
+  tail = d;
+  pthread_mutex_unlock (&lock);
+  return len;
+}
+
+ssize_t
+sendto (int fd, const void *buf, size_t len, int flags,
+        const struct sockaddr *addr, socklen_t addrlen)
+{
+  struct iovec iov = { (void *) buf, len };
+  struct msghdr msg;
+
+  memset (&msg, 0, sizeof(msg));
+  msg.msg_name = (void *) addr;
+  msg.msg_namelen = addr ? addrlen : 0;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  return link_send (fd, &msg, flags);
+}
+
+ssize_t
+sendmsg (int fd, const struct msghdr *msg, int flags)
+{
+  return link_send (fd, msg, flags);
+}
+
+int
+sendmmsg (int fd, struct mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+  unsigned int i;
+  ssize_t ret;
+
+  for (i = 0; i < vlen; i++) {
+    ret = link_send (fd, &msgvec[i].msg_hdr, flags);
+    if (ret == -1) {
+      return i ? (int) i : -1;
+    }
+    msgvec[i].msg_len = ret;
+  }
+  return vlen;
+}
@@ -1,11 +1,79 @@
 #ifndef UTILS_CRC32_H_
 #define UTILS_CRC32_H_
 
+#include <pthread.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <string.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
+
+/*
+ * CRC-32, polynomial 0x104C11DB7 in its reflected form, as in Ethernet and
+ * zlib. update_crc32() picks at the first call the fastest implementation
+ * the CPU runs: carry-less multiplication folding (PCLMULQDQ) on x86-64,
+ * otherwise slicing-by-16 tables. They all give the same result, the byte
+ * at a time loop is kept as the reference. Every implementation can also
+ * copy the data while it checksums it, see update_crc32_copy().
+ */
+
+static const uint32_t crc32_lut[256] =
+  { 0x00000000L, 0x77073096L, 0xEE0E612CL, 0x990951BAL, 0x076DC419L,
+      0x706AF48FL, 0xE963A535L, 0x9E6495A3L, 0x0EDB8832L, 0x79DCB8A4L,
+      0xE0D5E91EL, 0x97D2D988L, 0x09B64C2BL, 0x7EB17CBDL, 0xE7B82D07L,
+      0x90BF1D91L, 0x1DB71064L, 0x6AB020F2L, 0xF3B97148L, 0x84BE41DEL,
+      0x1ADAD47DL, 0x6DDDE4EBL, 0xF4D4B551L, 0x83D385C7L, 0x136C9856L,
+      0x646BA8C0L, 0xFD62F97AL, 0x8A65C9ECL, 0x14015C4FL, 0x63066CD9L,
+      0xFA0F3D63L, 0x8D080DF5L, 0x3B6E20C8L, 0x4C69105EL, 0xD56041E4L,
+      0xA2677172L, 0x3C03E4D1L, 0x4B04D447L, 0xD20D85FDL, 0xA50AB56BL,
+      0x35B5A8FAL, 0x42B2986CL, 0xDBBBC9D6L, 0xACBCF940L, 0x32D86CE3L,
+      0x45DF5C75L, 0xDCD60DCFL, 0xABD13D59L, 0x26D930ACL, 0x51DE003AL,
+      0xC8D75180L, 0xBFD06116L, 0x21B4F4B5L, 0x56B3C423L, 0xCFBA9599L,
+      0xB8BDA50FL, 0x2802B89EL, 0x5F058808L, 0xC60CD9B2L, 0xB10BE924L,
+      0x2F6F7C87L, 0x58684C11L, 0xC1611DABL, 0xB6662D3DL, 0x76DC4190L,
+      0x01DB7106L, 0x98D220BCL, 0xEFD5102AL, 0x71B18589L, 0x06B6B51FL,
+      0x9FBFE4A5L, 0xE8B8D433L, 0x7807C9A2L, 0x0F00F934L, 0x9609A88EL,
+      0xE10E9818L, 0x7F6A0DBBL, 0x086D3D2DL, 0x91646C97L, 0xE6635C01L,
+      0x6B6B51F4L, 0x1C6C6162L, 0x856530D8L, 0xF262004EL, 0x6C0695EDL,
+      0x1B01A57BL, 0x8208F4C1L, 0xF50FC457L, 0x65B0D9C6L, 0x12B7E950L,
+      0x8BBEB8EAL, 0xFCB9887CL, 0x62DD1DDFL, 0x15DA2D49L, 0x8CD37CF3L,
+      0xFBD44C65L, 0x4DB26158L, 0x3AB551CEL, 0xA3BC0074L, 0xD4BB30E2L,
+      0x4ADFA541L, 0x3DD895D7L, 0xA4D1C46DL, 0xD3D6F4FBL, 0x4369E96AL,
+      0x346ED9FCL, 0xAD678846L, 0xDA60B8D0L, 0x44042D73L, 0x33031DE5L,
+      0xAA0A4C5FL, 0xDD0D7CC9L, 0x5005713CL, 0x270241AAL, 0xBE0B1010L,
+      0xC90C2086L, 0x5768B525L, 0x206F85B3L, 0xB966D409L, 0xCE61E49FL,
+      0x5EDEF90EL, 0x29D9C998L, 0xB0D09822L, 0xC7D7A8B4L, 0x59B33D17L,
+      0x2EB40D81L, 0xB7BD5C3BL, 0xC0BA6CADL, 0xEDB88320L, 0x9ABFB3B6L,
+      0x03B6E20CL, 0x74B1D29AL, 0xEAD54739L, 0x9DD277AFL, 0x04DB2615L,
+      0x73DC1683L, 0xE3630B12L, 0x94643B84L, 0x0D6D6A3EL, 0x7A6A5AA8L,
+      0xE40ECF0BL, 0x9309FF9DL, 0x0A00AE27L, 0x7D079EB1L, 0xF00F9344L,
+      0x8708A3D2L, 0x1E01F268L, 0x6906C2FEL, 0xF762575DL, 0x806567CBL,
+      0x196C3671L, 0x6E6B06E7L, 0xFED41B76L, 0x89D32BE0L, 0x10DA7A5AL,
+      0x67DD4ACCL, 0xF9B9DF6FL, 0x8EBEEFF9L, 0x17B7BE43L, 0x60B08ED5L,
+      0xD6D6A3E8L, 0xA1D1937EL, 0x38D8C2C4L, 0x4FDFF252L, 0xD1BB67F1L,
+      0xA6BC5767L, 0x3FB506DDL, 0x48B2364BL, 0xD80D2BDAL, 0xAF0A1B4CL,
+      0x36034AF6L, 0x41047A60L, 0xDF60EFC3L, 0xA867DF55L, 0x316E8EEFL,
+      0x4669BE79L, 0xCB61B38CL, 0xBC66831AL, 0x256FD2A0L, 0x5268E236L,
+      0xCC0C7795L, 0xBB0B4703L, 0x220216B9L, 0x5505262FL, 0xC5BA3BBEL,
+      0xB2BD0B28L, 0x2BB45A92L, 0x5CB36A04L, 0xC2D7FFA7L, 0xB5D0CF31L,
+      0x2CD99E8BL, 0x5BDEAE1DL, 0x9B64C2B0L, 0xEC63F226L, 0x756AA39CL,
+      0x026D930AL, 0x9C0906A9L, 0xEB0E363FL, 0x72076785L, 0x05005713L,
+      0x95BF4A82L, 0xE2B87A14L, 0x7BB12BAEL, 0x0CB61B38L, 0x92D28E9BL,
+      0xE5D5BE0DL, 0x7CDCEFB7L, 0x0BDBDF21L, 0x86D3D2D4L, 0xF1D4E242L,
+      0x68DDB3F8L, 0x1FDA836EL, 0x81BE16CDL, 0xF6B9265BL, 0x6FB077E1L,
+      0x18B74777L, 0x88085AE6L, 0xFF0F6A70L, 0x66063BCAL, 0x11010B5CL,
+      0x8F659EFFL, 0xF862AE69L, 0x616BFFD3L, 0x166CCF45L, 0xA00AE278L,
+      0xD70DD2EEL, 0x4E048354L, 0x3903B3C2L, 0xA7672661L, 0xD06016F7L,
+      0x4969474DL, 0x3E6E77DBL, 0xAED16A4AL, 0xD9D65ADCL, 0x40DF0B66L,
+      0x37D83BF0L, 0xA9BCAE53L, 0xDEBB9EC5L, 0x47B2CF7FL, 0x30B5FFE9L,
+      0xBDBDF21CL, 0xCABAC28AL, 0x53B39330L, 0x24B4A3A6L, 0xBAD03605L,
+      0xCDD70693L, 0x54DE5729L, 0x23D967BFL, 0xB3667A2EL, 0xC4614AB8L,
+      0x5D681B02L, 0x2A6F2B94L, 0xB40BBE37L, 0xC30C8EA1L, 0x5A05DF1BL,
+      0x2D02EF8DL };
 
 /**
- * CRC-32 calculation using lookup tables, supporting progressive CRC calculation
+ * CRC-32 calculation one byte at a time, supporting progressive CRC calculation
  * polynomial: 0x104C11DB7
  *
  * @param crc the initial feed
@@ -14,69 +82,316 @@
  * @return the CRC-32 result
  */
 static inline uint32_t
-update_crc32 (uint32_t crc, const uint8_t *data, size_t len)
+update_crc32_bytewise (uint32_t crc, const uint8_t *data, size_t len)
 {
-  static const uint32_t crc32_lut[256] =
-    { 0x00000000L, 0x77073096L, 0xEE0E612CL, 0x990951BAL, 0x076DC419L,
-        0x706AF48FL, 0xE963A535L, 0x9E6495A3L, 0x0EDB8832L, 0x79DCB8A4L,
-        0xE0D5E91EL, 0x97D2D988L, 0x09B64C2BL, 0x7EB17CBDL, 0xE7B82D07L,
-        0x90BF1D91L, 0x1DB71064L, 0x6AB020F2L, 0xF3B97148L, 0x84BE41DEL,
-        0x1ADAD47DL, 0x6DDDE4EBL, 0xF4D4B551L, 0x83D385C7L, 0x136C9856L,
-        0x646BA8C0L, 0xFD62F97AL, 0x8A65C9ECL, 0x14015C4FL, 0x63066CD9L,
-        0xFA0F3D63L, 0x8D080DF5L, 0x3B6E20C8L, 0x4C69105EL, 0xD56041E4L,
-        0xA2677172L, 0x3C03E4D1L, 0x4B04D447L, 0xD20D85FDL, 0xA50AB56BL,
-        0x35B5A8FAL, 0x42B2986CL, 0xDBBBC9D6L, 0xACBCF940L, 0x32D86CE3L,
-        0x45DF5C75L, 0xDCD60DCFL, 0xABD13D59L, 0x26D930ACL, 0x51DE003AL,
-        0xC8D75180L, 0xBFD06116L, 0x21B4F4B5L, 0x56B3C423L, 0xCFBA9599L,
-        0xB8BDA50FL, 0x2802B89EL, 0x5F058808L, 0xC60CD9B2L, 0xB10BE924L,
-        0x2F6F7C87L, 0x58684C11L, 0xC1611DABL, 0xB6662D3DL, 0x76DC4190L,
-        0x01DB7106L, 0x98D220BCL, 0xEFD5102AL, 0x71B18589L, 0x06B6B51FL,
-        0x9FBFE4A5L, 0xE8B8D433L, 0x7807C9A2L, 0x0F00F934L, 0x9609A88EL,
-        0xE10E9818L, 0x7F6A0DBBL, 0x086D3D2DL, 0x91646C97L, 0xE6635C01L,
-        0x6B6B51F4L, 0x1C6C6162L, 0x856530D8L, 0xF262004EL, 0x6C0695EDL,
-        0x1B01A57BL, 0x8208F4C1L, 0xF50FC457L, 0x65B0D9C6L, 0x12B7E950L,
-        0x8BBEB8EAL, 0xFCB9887CL, 0x62DD1DDFL, 0x15DA2D49L, 0x8CD37CF3L,
-        0xFBD44C65L, 0x4DB26158L, 0x3AB551CEL, 0xA3BC0074L, 0xD4BB30E2L,
-        0x4ADFA541L, 0x3DD895D7L, 0xA4D1C46DL, 0xD3D6F4FBL, 0x4369E96AL,
-        0x346ED9FCL, 0xAD678846L, 0xDA60B8D0L, 0x44042D73L, 0x33031DE5L,
-        0xAA0A4C5FL, 0xDD0D7CC9L, 0x5005713CL, 0x270241AAL, 0xBE0B1010L,
-        0xC90C2086L, 0x5768B525L, 0x206F85B3L, 0xB966D409L, 0xCE61E49FL,
-        0x5EDEF90EL, 0x29D9C998L, 0xB0D09822L, 0xC7D7A8B4L, 0x59B33D17L,
-        0x2EB40D81L, 0xB7BD5C3BL, 0xC0BA6CADL, 0xEDB88320L, 0x9ABFB3B6L,
-        0x03B6E20CL, 0x74B1D29AL, 0xEAD54739L, 0x9DD277AFL, 0x04DB2615L,
-        0x73DC1683L, 0xE3630B12L, 0x94643B84L, 0x0D6D6A3EL, 0x7A6A5AA8L,
-        0xE40ECF0BL, 0x9309FF9DL, 0x0A00AE27L, 0x7D079EB1L, 0xF00F9344L,
-        0x8708A3D2L, 0x1E01F268L, 0x6906C2FEL, 0xF762575DL, 0x806567CBL,
-        0x196C3671L, 0x6E6B06E7L, 0xFED41B76L, 0x89D32BE0L, 0x10DA7A5AL,
-        0x67DD4ACCL, 0xF9B9DF6FL, 0x8EBEEFF9L, 0x17B7BE43L, 0x60B08ED5L,
-        0xD6D6A3E8L, 0xA1D1937EL, 0x38D8C2C4L, 0x4FDFF252L, 0xD1BB67F1L,
-        0xA6BC5767L, 0x3FB506DDL, 0x48B2364BL, 0xD80D2BDAL, 0xAF0A1B4CL,
-        0x36034AF6L, 0x41047A60L, 0xDF60EFC3L, 0xA867DF55L, 0x316E8EEFL,
-        0x4669BE79L, 0xCB61B38CL, 0xBC66831AL, 0x256FD2A0L, 0x5268E236L,
-        0xCC0C7795L, 0xBB0B4703L, 0x220216B9L, 0x5505262FL, 0xC5BA3BBEL,
-        0xB2BD0B28L, 0x2BB45A92L, 0x5CB36A04L, 0xC2D7FFA7L, 0xB5D0CF31L,
-        0x2CD99E8BL, 0x5BDEAE1DL, 0x9B64C2B0L, 0xEC63F226L, 0x756AA39CL,
-        0x026D930AL, 0x9C0906A9L, 0xEB0E363FL, 0x72076785L, 0x05005713L,
-        0x95BF4A82L, 0xE2B87A14L, 0x7BB12BAEL, 0x0CB61B38L, 0x92D28E9BL,
-        0xE5D5BE0DL, 0x7CDCEFB7L, 0x0BDBDF21L, 0x86D3D2D4L, 0xF1D4E242L,
-        0x68DDB3F8L, 0x1FDA836EL, 0x81BE16CDL, 0xF6B9265BL, 0x6FB077E1L,
-        0x18B74777L, 0x88085AE6L, 0xFF0F6A70L, 0x66063BCAL, 0x11010B5CL,
-        0x8F659EFFL, 0xF862AE69L, 0x616BFFD3L, 0x166CCF45L, 0xA00AE278L,
-        0xD70DD2EEL, 0x4E048354L, 0x3903B3C2L, 0xA7672661L, 0xD06016F7L,
-        0x4969474DL, 0x3E6E77DBL, 0xAED16A4AL, 0xD9D65ADCL, 0x40DF0B66L,
-        0x37D83BF0L, 0xA9BCAE53L, 0xDEBB9EC5L, 0x47B2CF7FL, 0x30B5FFE9L,
-        0xBDBDF21CL, 0xCABAC28AL, 0x53B39330L, 0x24B4A3A6L, 0xBAD03605L,
-        0xCDD70693L, 0x54DE5729L, 0x23D967BFL, 0xB3667A2EL, 0xC4614AB8L,
-        0x5D681B02L, 0x2A6F2B94L, 0xB40BBE37L, 0xC30C8EA1L, 0x5A05DF1BL,
-        0x2D02EF8DL };
-
-  register uint32_t i;
+  size_t i;
   for (i = 0; i < len; i++) {
     crc = (crc >> 8) ^ crc32_lut[(crc ^ data[i]) & 0xff];
   }
   return crc;
 }
 
+/**
+ * Copies len bytes from src to dst and updates the CRC-32 with them, in a
+ * single pass. The buffers must not overlap.
+ */
+static inline uint32_t
+update_crc32_copy_bytewise (uint32_t crc, uint8_t *dst, const uint8_t *src,
+                            size_t len)
+{
+  size_t i;
+  for (i = 0; i < len; i++) {
+    dst[i] = src[i];
+    crc = (crc >> 8) ^ crc32_lut[(crc ^ src[i]) & 0xff];
+  }
+  return crc;
+}
+
+static uint32_t crc32_tables[16][256];
+static pthread_once_t crc32_tables_once = PTHREAD_ONCE_INIT;
+
+static void
+crc32_tables_build (void)
+{
+  int i, k;
+
+  for (i = 0; i < 256; i++) {
+    crc32_tables[0][i] = crc32_lut[i];
+  }
+  for (k = 1; k < 16; k++) {
+    for (i = 0; i < 256; i++) {
+      crc32_tables[k][i] = (crc32_tables[k - 1][i] >> 8)
+          ^ crc32_lut[crc32_tables[k - 1][i] & 0xff];
+    }
+  }
+}
+
+/**
+ * The tables of slicing-by-16, built once at the first call, whichever
+ * thread makes it. Table k gives the CRC of a byte followed by k zero bytes.
+ */
+static inline const uint32_t (*
+crc32_slice_tables (void))[256]
+{
+  pthread_once (&crc32_tables_once, crc32_tables_build);
+  return (const uint32_t (*)[256]) crc32_tables;
+}
+
+/**
+ * Slicing-by-16, 16 table lookups for every 16 bytes instead of a chain of
+ * 16 dependent ones. Copies the data to dst as well, unless it is NULL.
+ */
+static inline uint32_t
+update_crc32_copy_slice16 (uint32_t crc, uint8_t *dst, const uint8_t *data,
+                           size_t len)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  const uint32_t (*t)[256] = crc32_slice_tables ();
+  uint32_t w[4];
+
+  while (len >= 16) {
+    memcpy (w, data, sizeof(w));
+    if (dst) {
+      memcpy (dst, w, sizeof(w));
+      dst += 16;
+    }
+    w[0] ^= crc;
+    crc = t[15][w[0] & 0xff] ^ t[14][(w[0] >> 8) & 0xff]
+        ^ t[13][(w[0] >> 16) & 0xff] ^ t[12][w[0] >> 24]
+        ^ t[11][w[1] & 0xff] ^ t[10][(w[1] >> 8) & 0xff]
+        ^ t[9][(w[1] >> 16) & 0xff] ^ t[8][w[1] >> 24]
+        ^ t[7][w[2] & 0xff] ^ t[6][(w[2] >> 8) & 0xff]
+        ^ t[5][(w[2] >> 16) & 0xff] ^ t[4][w[2] >> 24]
+        ^ t[3][w[3] & 0xff] ^ t[2][(w[3] >> 8) & 0xff]
+        ^ t[1][(w[3] >> 16) & 0xff] ^ t[0][w[3] >> 24];
+    data += 16;
+    len -= 16;
+  }
+#endif
+  if (dst) {
+    return update_crc32_copy_bytewise (crc, dst, data, len);
+  }
+  return update_crc32_bytewise (crc, data, len);
+}
+
+/**
+ * Slicing-by-16 without the copy. Same parameters as update_crc32_bytewise().
+ */
+static inline uint32_t
+update_crc32_slice16 (uint32_t crc, const uint8_t *data, size_t len)
+{
+  return update_crc32_copy_slice16 (crc, NULL, data, len);
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define CRC32_HAVE_PCLMUL 1
+
+/**
+ * Folds 64 bytes at a time with carry-less multiplications and reduces the
+ * result with Barrett's method, see Intel's "Fast CRC Computation for Generic
+ * Polynomials Using PCLMULQDQ Instruction". The constants are the ones of
+ * zlib's crc32_simd.c. len must be a multiple of 16, at least 64. Every
+ * block loaded is stored to dst as well, unless it is NULL, so the copy
+ * costs no extra pass over the data.
+ */
+__attribute__((target ("pclmul,sse4.1")))
+static inline uint32_t
+crc32_pclmul_fold (uint32_t crc, uint8_t *dst, const uint8_t *data, size_t len)
+{
+  static const uint64_t __attribute__((aligned (16))) k1k2[] = { 0x0154442bd4, 0x01c6e41596 };
+  static const uint64_t __attribute__((aligned (16))) k3k4[] = { 0x01751997d0, 0x00ccaa009e };
+  static const uint64_t __attribute__((aligned (16))) k5k0[] = { 0x0163cd6124, 0x0000000000 };
+  static const uint64_t __attribute__((aligned (16))) poly[] = { 0x01db710641, 0x01f7011641 };
+  __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+  x1 = _mm_loadu_si128 ((const __m128i *) (data + 0x00));
+  x2 = _mm_loadu_si128 ((const __m128i *) (data + 0x10));
+  x3 = _mm_loadu_si128 ((const __m128i *) (data + 0x20));
+  x4 = _mm_loadu_si128 ((const __m128i *) (data + 0x30));
+  if (dst) {
+    _mm_storeu_si128 ((__m128i *) (dst + 0x00), x1);
+    _mm_storeu_si128 ((__m128i *) (dst + 0x10), x2);
+    _mm_storeu_si128 ((__m128i *) (dst + 0x20), x3);
+    _mm_storeu_si128 ((__m128i *) (dst + 0x30), x4);
+    dst += 64;
+  }
+  x1 = _mm_xor_si128 (x1, _mm_cvtsi32_si128 (crc));
+  x0 = _mm_load_si128 ((const __m128i *) k1k2);
+  data += 64;
+  len -= 64;
+
+  /* Four folds in parallel */
+  while (len >= 64) {
+    x5 = _mm_clmulepi64_si128 (x1, x0, 0x00);
+    x6 = _mm_clmulepi64_si128 (x2, x0, 0x00);
+    x7 = _mm_clmulepi64_si128 (x3, x0, 0x00);
+    x8 = _mm_clmulepi64_si128 (x4, x0, 0x00);
+    x1 = _mm_clmulepi64_si128 (x1, x0, 0x11);
+    x2 = _mm_clmulepi64_si128 (x2, x0, 0x11);
+    x3 = _mm_clmulepi64_si128 (x3, x0, 0x11);
+    x4 = _mm_clmulepi64_si128 (x4, x0, 0x11);
+    y5 = _mm_loadu_si128 ((const __m128i *) (data + 0x00));
+    y6 = _mm_loadu_si128 ((const __m128i *) (data + 0x10));
+    y7 = _mm_loadu_si128 ((const __m128i *) (data + 0x20));
+    y8 = _mm_loadu_si128 ((const __m128i *) (data + 0x30));
+    if (dst) {
+      _mm_storeu_si128 ((__m128i *) (dst + 0x00), y5);
+      _mm_storeu_si128 ((__m128i *) (dst + 0x10), y6);
+      _mm_storeu_si128 ((__m128i *) (dst + 0x20), y7);
+      _mm_storeu_si128 ((__m128i *) (dst + 0x30), y8);
+      dst += 64;
+    }
+    x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x5), y5);
+    x2 = _mm_xor_si128 (_mm_xor_si128 (x2, x6), y6);
+    x3 = _mm_xor_si128 (_mm_xor_si128 (x3, x7), y7);
+    x4 = _mm_xor_si128 (_mm_xor_si128 (x4, x8), y8);
+    data += 64;
+    len -= 64;
+  }
+
+  /* Fold the four into one */
+  x0 = _mm_load_si128 ((const __m128i *) k3k4);
+  x5 = _mm_clmulepi64_si128 (x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128 (x1, x0, 0x11);
+  x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x2), x5);
+  x5 = _mm_clmulepi64_si128 (x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128 (x1, x0, 0x11);
+  x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x3), x5);
+  x5 = _mm_clmulepi64_si128 (x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128 (x1, x0, 0x11);
+  x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x4), x5);
+
+  /* The rest, 16 bytes at a time */
+  while (len >= 16) {
+    x2 = _mm_loadu_si128 ((const __m128i *) data);
+    if (dst) {
+      _mm_storeu_si128 ((__m128i *) dst, x2);
+      dst += 16;
+    }
+    x5 = _mm_clmulepi64_si128 (x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128 (x1, x0, 0x11);
+    x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x2), x5);
+    data += 16;
+    len -= 16;
+  }
+
+  /* 128 bits to 64 */
+  x2 = _mm_clmulepi64_si128 (x1, x0, 0x10);
+  x3 = _mm_setr_epi32 (~0, 0, ~0, 0);
+  x1 = _mm_srli_si128 (x1, 8);
+  x1 = _mm_xor_si128 (x1, x2);
+  x0 = _mm_loadl_epi64 ((const __m128i *) k5k0);
+  x2 = _mm_srli_si128 (x1, 4);
+  x1 = _mm_and_si128 (x1, x3);
+  x1 = _mm_clmulepi64_si128 (x1, x0, 0x00);
+  x1 = _mm_xor_si128 (x1, x2);
+
+  /* Barrett reduction to 32 bits */
+  x0 = _mm_load_si128 ((const __m128i *) poly);
+  x2 = _mm_and_si128 (x1, x3);
+  x2 = _mm_clmulepi64_si128 (x2, x0, 0x10);
+  x2 = _mm_and_si128 (x2, x3);
+  x2 = _mm_clmulepi64_si128 (x2, x0, 0x00);
+  x1 = _mm_xor_si128 (x1, x2);
+  return _mm_extract_epi32 (x1, 1);
+}
+
+/**
+ * PCLMULQDQ folding for the bulk of the buffer, slicing-by-16 for what is
+ * too short to fold. Copies the data to dst as well, unless it is NULL.
+ * Only to be called when the CPU supports PCLMULQDQ and SSE4.1.
+ */
+static inline uint32_t
+update_crc32_copy_pclmul (uint32_t crc, uint8_t *dst, const uint8_t *data,
+                          size_t len)
+{
+  size_t bulk = len & ~(size_t) 15;
+
+  if (bulk >= 64) {
+    crc = crc32_pclmul_fold (crc, dst, data, bulk);
+    data += bulk;
+    len -= bulk;
+    if (dst) {
+      dst += bulk;
+    }
+  }
+  return update_crc32_copy_slice16 (crc, dst, data, len);
+}
+
+/**
+ * PCLMULQDQ without the copy. Same parameters as update_crc32_bytewise().
+ */
+static inline uint32_t
+update_crc32_pclmul (uint32_t crc, const uint8_t *data, size_t len)
+{
+  return update_crc32_copy_pclmul (crc, NULL, data, len);
+}
+#endif
+
+typedef uint32_t (*crc32_impl_t) (uint32_t crc, const uint8_t *data, size_t len);
+typedef uint32_t (*crc32_copy_impl_t) (uint32_t crc, uint8_t *dst,
+                                       const uint8_t *src, size_t len);
+
+/**
+ * @return the fastest CRC-32 implementation the CPU supports, in its
+ * copying form
+ */
+static inline crc32_copy_impl_t
+crc32_select (void)
+{
+#ifdef CRC32_HAVE_PCLMUL
+  if (__builtin_cpu_supports ("pclmul") && __builtin_cpu_supports ("sse4.1")) {
+    return update_crc32_copy_pclmul;
+  }
+#endif
+  return update_crc32_copy_slice16;
+}
+
+static inline crc32_copy_impl_t
+crc32_impl (void)
+{
+  static crc32_copy_impl_t impl;
+  crc32_copy_impl_t f = __atomic_load_n (&impl, __ATOMIC_RELAXED);
+
+  if (f == NULL) {
+    f = crc32_select ();
+    __atomic_store_n (&impl, f, __ATOMIC_RELAXED);
+  }
+  return f;
+}
+
+/**
+ * CRC-32 calculation, supporting progressive CRC calculation
+ * polynomial: 0x104C11DB7
+ *
+ * @param crc the initial feed
+ * @param data the buffer containing the data
+ * @param len the length of the buffer
+ * @return the CRC-32 result
+ */
+static inline uint32_t
+update_crc32 (uint32_t crc, const uint8_t *data, size_t len)
+{
+  return crc32_impl () (crc, NULL, data, len);
+}
+
+/**
+ * Copies len bytes from src to dst, which must not overlap, and updates the
+ * CRC-32 with them while they are in registers. It runs close to the speed
+ * of memcpy(), so checksumming data that is copied anyway is almost free.
+ *
+ * @param crc the initial feed
+ * @param dst the destination buffer
+ * @param src the buffer containing the data
+ * @param len the length of the buffers
+ * @return the CRC-32 result
+ */
+static inline uint32_t
+update_crc32_copy (uint32_t crc, uint8_t *dst, const uint8_t *src, size_t len)
+{
+  return crc32_impl () (crc, dst, src, len);
+}
+
 /**
  * Calculates the CRC-32 of the buffer buf.
  * @param buf The buffer containing the data
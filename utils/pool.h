@@ -0,0 +1,132 @@
+#ifndef UTILS_POOL_H_
+#define UTILS_POOL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+/**
+ * A fixed-size slab allocator. All the objects are carved out of a single
+ * allocation made by pool_init(), so pool_alloc() and pool_free() never
+ * touch the heap while the pool has free objects. When the slab runs out
+ * pool_alloc() falls back to malloc() and counts it in heap_allocs, which
+ * should stay 0 in steady state.
+ */
+typedef struct
+{
+  uint8_t *slab;                /**< The objects, one after the other */
+  void **free_list;             /**< Stack of the free objects of the slab */
+  size_t obj_size;              /**< Size of each object in bytes */
+  size_t nobjs;                 /**< Number of objects in the slab */
+  size_t nfree;                 /**< Number of free objects in the slab */
+  size_t in_use;                /**< Objects currently allocated, heap ones included */
+  size_t peak;                  /**< Most objects allocated at the same time */
+  uint64_t allocs;              /**< Allocations served */
+  uint64_t frees;               /**< Objects released */
+  uint64_t heap_allocs;         /**< Allocations that had to fall back to malloc() */
+} pool_t;
+
+/**
+ * Allocates the slab of the pool.
+ *
+ * @param pool the pool
+ * @param obj_size the size of each object
+ * @param nobjs the number of objects of the slab
+ * @return 0 on success or -1 if the memory could not be allocated
+ */
+static inline int
+pool_init (pool_t *pool, size_t obj_size, size_t nobjs)
+{
+  size_t i;
+
+  /* Keep every object suitably aligned for any type */
+  obj_size = (obj_size + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+
+  pool->slab = (uint8_t *) malloc (obj_size * nobjs);
+  pool->free_list = (void **) malloc (nobjs * sizeof(void *));
+  if (pool->slab == NULL || pool->free_list == NULL) {
+    free (pool->slab);
+    free (pool->free_list);
+    pool->slab = NULL;
+    pool->free_list = NULL;
+    return -1;
+  }
+
+  pool->obj_size = obj_size;
+  pool->nobjs = nobjs;
+  pool->nfree = nobjs;
+  pool->in_use = 0;
+  pool->peak = 0;
+  pool->allocs = 0;
+  pool->frees = 0;
+  pool->heap_allocs = 0;
+
+  /* Hand out the objects in address order */
+  for (i = 0; i < nobjs; i++) {
+    pool->free_list[i] = pool->slab + (nobjs - 1 - i) * obj_size;
+  }
+  return 0;
+}
+
+/**
+ * Releases the slab. Objects that came from the heap must have been
+ * returned with pool_free() before.
+ */
+static inline void
+pool_destroy (pool_t *pool)
+{
+  free (pool->slab);
+  free (pool->free_list);
+  pool->slab = NULL;
+  pool->free_list = NULL;
+  pool->nobjs = 0;
+  pool->nfree = 0;
+}
+
+/**
+ * @return a new object or NULL if the memory could not be allocated
+ */
+static inline void *
+pool_alloc (pool_t *pool)
+{
+  void *obj;
+
+  if (pool->nfree > 0) {
+    obj = pool->free_list[--pool->nfree];
+  }
+  else {
+    obj = malloc (pool->obj_size);
+    if (obj == NULL) {
+      return NULL;
+    }
+    pool->heap_allocs++;
+  }
+
+  pool->allocs++;
+  pool->in_use++;
+  if (pool->in_use > pool->peak) {
+    pool->peak = pool->in_use;
+  }
+  return obj;
+}
+
+static inline void
+pool_free (pool_t *pool, void *obj)
+{
+  uint8_t *p = (uint8_t *) obj;
+
+  if (obj == NULL) {
+    return;
+  }
+
+  pool->frees++;
+  pool->in_use--;
+  if (p >= pool->slab && p < pool->slab + pool->nobjs * pool->obj_size) {
+    pool->free_list[pool->nfree++] = obj;
+  }
+  else {
+    free (obj);
+  }
+}
+
+#endif /* UTILS_POOL_H_ */